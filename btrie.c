@@ -1508,7 +1508,7 @@ count_free(const struct btrie *btrie)
 const char *
 btrie_stats(const struct btrie *btrie)
 {
-  static char buf[128];
+  static __thread char buf[128];
   size_t n_nodes = btrie->n_lc_nodes + btrie->n_tbm_nodes;
   size_t alloc_free = (btrie->alloc_total
                        + sizeof(node_t) /* do not double-count the root node */
@@ -1564,6 +1564,12 @@ btrie_stats(const struct btrie *btrie)
   return buf;
 }
 
+unsigned long
+btrie_size(const struct btrie *btrie)
+{
+  return btrie->alloc_total;
+}
+
 
 /****************************************************************/
 
@@ -75,6 +75,8 @@ const void *btrie_lookup(const struct btrie *btrie,
                          const btrie_oct_t *pfx, unsigned len);
 
 const char *btrie_stats(const struct btrie *btrie);
+/* bytes allocated for the trie nodes and data */
+unsigned long btrie_size(const struct btrie *btrie);
 
 #ifndef NO_MASTER_DUMP
 typedef void btrie_walk_cb_t(const btrie_oct_t *prefix, unsigned len,
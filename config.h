@@ -0,0 +1,11 @@
+/* rbldnsd autoconfiguration header file.
+ * Generated automatically by configure. */
+
+#define HAVE_MALLINFO2 1
+#define HAVE_SETITIMER 1
+#define HAVE_RECVMMSG 1
+#define HAVE_EPOLL 1
+#define HAVE_INOTIFY 1
+#define HAVE_IO_URING 1
+#define NO_DSO		1	/* disabled by default */
+#define NDEBUG		1	/* option disabled */
@@ -0,0 +1,187 @@
+#! /usr/bin/env python
+""" Minimal Frame Streams reader for rbldnsd dnstap output (-D).
+
+Usage: fstrmread.py file
+       fstrmread.py -u socket
+
+Reads dnstap records from a file written by rbldnsd -D file, or listens
+on a unix socket for rbldnsd -D unix:socket (doing the bidirectional
+handshake) and prints one line per record: client address and port,
+query name and type, and reply length if the reply was included (-D +).
+Only what rbldnsd writes is decoded; it can also be imported, which is
+what the tests do.
+"""
+
+import os
+import socket
+import struct
+import sys
+
+FS_ACCEPT, FS_START, FS_STOP, FS_READY, FS_FINISH = 1, 2, 3, 4, 5
+CONTENT_TYPE = b'protobuf:dnstap.Dnstap'
+
+class FrameError(Exception):
+    """ Malformed frame stream. """
+
+def _readn(f, n):
+    buf = b''
+    while len(buf) < n:
+        d = f.read(n - len(buf))
+        if not d:
+            if buf:
+                raise FrameError("truncated frame")
+            return None
+        buf += d
+    return buf
+
+def _be32(b):
+    return struct.unpack('>I', b)[0]
+
+def read_frame(f):
+    """ Read one frame.  Returns ('data', bytes), ('control', type)
+    or None at the end of the stream """
+    hdr = _readn(f, 4)
+    if hdr is None:
+        return None
+    l = _be32(hdr)
+    if l:
+        return ('data', _readn(f, l))
+    l = _be32(_readn(f, 4))
+    ctl = _readn(f, l)
+    return ('control', _be32(ctl[:4]))
+
+def control_frame(ftype, content_type=True):
+    body = struct.pack('>I', ftype)
+    if content_type:
+        body += struct.pack('>II', 1, len(CONTENT_TYPE)) + CONTENT_TYPE
+    return struct.pack('>II', 0, len(body)) + body
+
+def read_frames(f):
+    """ Yield data frames of all streams in a file-like object """
+    while True:
+        frame = read_frame(f)
+        if frame is None:
+            return
+        if frame[0] == 'data':
+            yield frame[1]
+
+class _SockFile(object):
+    def __init__(self, sock):
+        self.sock = sock
+    def read(self, n):
+        return self.sock.recv(n)
+
+def serve(path, ready=None):
+    """ Listen on a unix socket, accept one connection and yield data
+    frames received on it until the stream is stopped """
+    if os.path.exists(path):
+        os.unlink(path)
+    ls = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    ls.bind(path)
+    ls.listen(1)
+    if ready:
+        ready()
+    conn = ls.accept()[0]
+    ls.close()
+    f = _SockFile(conn)
+    try:
+        frame = read_frame(f)
+        if frame != ('control', FS_READY):
+            raise FrameError("expected READY, got %r" % (frame,))
+        conn.sendall(control_frame(FS_ACCEPT))
+        frame = read_frame(f)
+        if frame != ('control', FS_START):
+            raise FrameError("expected START, got %r" % (frame,))
+        while True:
+            frame = read_frame(f)
+            if frame is None or frame == ('control', FS_STOP):
+                break
+            if frame[0] == 'data':
+                yield frame[1]
+        if frame is not None:
+            try:        # the writer may not wait for it
+                conn.sendall(control_frame(FS_FINISH, False))
+            except socket.error:
+                pass
+    finally:
+        conn.close()
+
+def _varint(b, i):
+    v = shift = 0
+    while True:
+        c = bytearray(b[i:i+1])[0]
+        i += 1
+        v |= (c & 0x7f) << shift
+        shift += 7
+        if not c & 0x80:
+            return v, i
+
+def pb_decode(b):
+    """ Decode protobuf message into {field: value} (last value wins) """
+    fields = {}
+    i = 0
+    while i < len(b):
+        tag, i = _varint(b, i)
+        if tag & 7 == 0:
+            v, i = _varint(b, i)
+        elif tag & 7 == 2:
+            l, i = _varint(b, i)
+            v = b[i:i+l]
+            i += l
+        else:
+            raise FrameError("unsupported wire type %d" % (tag & 7))
+        fields[tag >> 3] = v
+    return fields
+
+def dns_question(msg):
+    """ Query name and type of a DNS message """
+    i = 12
+    labels = []
+    while True:
+        l = bytearray(msg[i:i+1])[0]
+        i += 1
+        if not l:
+            break
+        labels.append(msg[i:i+l].decode('ascii', 'replace'))
+        i += l
+    return '.'.join(labels), struct.unpack('>H', msg[i:i+2])[0]
+
+def decode(frame):
+    """ Decode a dnstap frame into a dict """
+    d = pb_decode(frame)
+    m = pb_decode(d.get(14, b''))
+    r = {
+        'identity': d.get(1), 'version': d.get(2), 'type': d.get(15),
+        'message_type': m.get(1), 'family': m.get(2), 'protocol': m.get(3),
+        'query_port': m.get(6), 'query_time': m.get(8),
+        'query': m.get(10), 'response': m.get(14),
+        }
+    addr = m.get(4)
+    if addr is not None:
+        r['query_address'] = socket.inet_ntop(
+            len(addr) == 4 and socket.AF_INET or socket.AF_INET6, addr)
+    if r['query'] is not None:
+        r['qname'], r['qtype'] = dns_question(r['query'])
+    return r
+
+def show(frames):
+    for frame in frames:
+        r = decode(frame)
+        line = "%s %s %s %s" % (r.get('query_address'), r['query_port'],
+                                r.get('qname'), r.get('qtype'))
+        if r['response'] is not None:
+            line += " %d" % len(r['response'])
+        print(line)
+        sys.stdout.flush()
+
+def main(argv):
+    if len(argv) == 2 and argv[0] == '-u':
+        show(serve(argv[1]))
+    elif len(argv) == 1:
+        with open(argv[0], 'rb') as f:
+            show(read_frames(f))
+    else:
+        sys.exit(__doc__.split('\n\n')[1])
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
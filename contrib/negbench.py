@@ -0,0 +1,137 @@
+#! /usr/bin/env python
+""" Measure the cost of negative (NXDOMAIN) answers.
+
+Usage: negbench.py [-n queries] [-e entries] rbldnsd [rbldnsd...]
+
+Every given rbldnsd binary is started in turn on a generated ip4set
+zone with `entries' random entries, and `queries' queries for IPs which
+are not listed are sent to it one by one.  While they are answered,
+the daemon is watched by `perf stat -e instructions:u', and the number
+of user-space instructions and the CPU time it spent per query are
+printed.  To compare two versions, build both and give both binaries:
+
+  python contrib/negbench.py /tmp/old/rbldnsd ./rbldnsd
+
+Instruction counts need perf and a CPU with performance counters
+(usually missing in virtual machines); CPU time is always shown.
+"""
+
+import getopt
+import os
+import random
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+ZONE_HEADER = """\
+$SOA 0 example.org. hostmaster.example.com. 0 1h 1h 2d 1h
+$NS 1d ns0.example.org
+"""
+
+def zonefile(entries):
+    f = tempfile.NamedTemporaryFile(mode='w', suffix='.ip4set')
+    f.write(ZONE_HEADER)
+    rnd = random.Random(1)
+    for i in range(entries):
+        # listed IPs are all odd in the last octet, see missip()
+        f.write("%d.%d.%d.%d\n" % (rnd.randint(1, 254), rnd.randint(0, 255),
+                                   rnd.randint(0, 255),
+                                   rnd.randint(0, 127) * 2 + 1))
+    f.flush()
+    os.chmod(f.name, 0o644)     # rbldnsd may switch to another user
+    return f
+
+def missip(i):
+    return (i >> 16 & 255, i >> 8 & 255, i & 255, 2)
+
+def query(qid, ip):
+    q = struct.pack('>HHHHHH', qid, 0, 1, 0, 0, 0)
+    for label in ['%d' % o for o in reversed(ip)] + ['example', 'com']:
+        q += struct.pack('B', len(label)) + label.encode('ascii')
+    return q + struct.pack('>BHH', 0, 16, 1)
+
+def cputime(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / \
+        float(os.sysconf('SC_CLK_TCK'))
+
+def bench(binary, zone, nqueries, port):
+    cmd = [binary, '-n', '-b', '127.0.0.1/%d' % port,
+           'example.com:ip4set:%s' % zone]
+    devnull = open(os.devnull, 'w')
+    daemon = subprocess.Popen(cmd, stdout=devnull, stderr=devnull)
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(0.2)
+    s.connect(('127.0.0.1', port))
+    try:
+        for retry in range(100):
+            if daemon.poll() is not None:
+                raise RuntimeError("%s exited with code %d"
+                                   % (binary, daemon.returncode))
+            try:
+                s.send(query(0, missip(0)))
+                s.recv(512)
+                break
+            except socket.error:
+                time.sleep(0.1)
+        else:
+            raise RuntimeError("%s does not answer queries" % binary)
+
+        s.settimeout(5)
+        try:
+            perf = subprocess.Popen(['perf', 'stat', '-x', ',',
+                                     '-e', 'instructions:u',
+                                     '-p', str(daemon.pid)],
+                                    stdout=devnull, stderr=subprocess.PIPE)
+            time.sleep(0.2)     # let perf attach
+        except OSError:
+            perf = None
+        cpu = cputime(daemon.pid)
+        for i in range(nqueries):
+            s.send(query(i & 0xffff, missip(i)))
+            r = s.recv(512)
+            if struct.unpack('>H', r[2:4])[0] & 15 != 3:
+                raise RuntimeError("query %d: not an NXDOMAIN reply" % i)
+        cpu = cputime(daemon.pid) - cpu
+        insns = None
+        if perf:
+            perf.send_signal(signal.SIGINT)
+            out = perf.communicate()[1].decode('ascii', 'replace')
+            for line in out.splitlines():
+                f = line.split(',')
+                if len(f) > 2 and f[2].startswith('instructions') and \
+                   f[0].isdigit():
+                    insns = int(f[0])
+    finally:
+        daemon.terminate()
+        daemon.wait()
+        s.close()
+    return insns, cpu
+
+def main(argv):
+    nqueries, entries, port = 100000, 100000, 5353
+    try:
+        opts, binaries = getopt.getopt(argv, 'n:e:p:')
+    except getopt.GetoptError as e:
+        sys.exit(str(e))
+    for o, v in opts:
+        if o == '-n': nqueries = int(v)
+        elif o == '-e': entries = int(v)
+        elif o == '-p': port = int(v)
+    if not binaries:
+        sys.exit(__doc__.split('\n\n')[1])
+    zone = zonefile(entries)
+    for binary in binaries:
+        insns, cpu = bench(binary, zone.name, nqueries, port)
+        print("%s: %d misses, %s instructions/miss, %.2f usec CPU/miss" % (
+            binary, nqueries,
+            insns is None and 'n/a' or '%d' % (insns // nqueries),
+            cpu * 1e6 / nqueries))
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -6,6 +6,7 @@ BEGIN {
   n = ""
   s = ""
   print "/* file automatically generated */"
+  print "#include \"config.h\""
   print "#include \"dns.h\""
   print "#include <stdio.h>"
 }
@@ -29,7 +30,7 @@ n != "" && /^}/ {
   print " {0,0}"
   print "};\n"
   print "const char *dns_" n "name(enum dns_" n " code) {"
-  print " static char buf[20];"
+  print " static __thread char buf[20];"
   print " switch(code) {" s
   print " }"
   print " sprintf(buf, \"" n "%d\", code);"
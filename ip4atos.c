@@ -21,7 +21,7 @@ static char *oct(char *s, unsigned char o, char e) {
 /* return printable representation of ip4addr like inet_ntoa() */
 
 const char *ip4atos(ip4addr_t a) {
-  static char buf[16];
+  static __thread char buf[16];
   oct(oct(oct(oct(buf,
     (a >> 24) & 0xff, '.'),
     (a >> 16) & 0xff, '.'),
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
 #include "config.h"
 #ifndef NO_ZLIB
 #include <stdlib.h>
@@ -23,6 +24,18 @@
 # define UNUSED __attribute__((unused))
 #endif
 
+/* call readfn, counting time spent in it (reading and uncompressing) */
+static int
+istream_read(struct istream *sp, unsigned char *buf, int size, int szhint) {
+  struct timeval t0, t1;
+  int r;
+  gettimeofday(&t0, NULL);
+  r = sp->readfn(sp, buf, size, szhint);
+  gettimeofday(&t1, NULL);
+  sp->rdusec += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+  return r;
+}
+
 /* An attempt of efficient copy-less way to read lines from a file.
  * We fill in a buffer, and try to find next newline character.
  * If found, advance 'readp' pointer past it, replace it with
@@ -81,7 +94,7 @@ int istream_getline(struct istream *sp, char **linep, char delim) {
     }
 
     /* read the next chunk. read 2buf if at the beginning of buf */
-    r = sp->readfn(sp, sp->endp, ISTREAM_BUFSIZE - (sp->endp - sp->buf),
+    r = istream_read(sp, sp->endp, ISTREAM_BUFSIZE - (sp->endp - sp->buf),
                    sp->endp == sp->buf ? ISTREAM_BUFSIZE : ISTREAM_BUFSIZE/2);
     if (r <= 0)
       return r < 0 ? r : sp->readp - s;
@@ -104,7 +117,7 @@ int istream_fillbuf(struct istream *sp) {
         sp->readp = sp->buf;
       }
     }
-    r = sp->readfn(sp, sp->endp, ISTREAM_BUFSIZE - (sp->endp - sp->buf),
+    r = istream_read(sp, sp->endp, ISTREAM_BUFSIZE - (sp->endp - sp->buf),
                    sp->endp == sp->buf ? ISTREAM_BUFSIZE : ISTREAM_BUFSIZE/2);
     if (r <= 0)
       return r;
@@ -140,6 +153,7 @@ void istream_init(struct istream *sp,
   sp->readfn = readfn;
   sp->freefn = freefn;
   sp->readp = sp->endp = sp->buf;
+  sp->rdusec = 0;
 }
 
 void istream_destroy(struct istream *sp) {
@@ -310,6 +324,7 @@ int istream_uncompress_setup(struct istream *sp) {
   zsp->is.cookie = sp->cookie;
   zsp->is.readfn = sp->readfn;
   zsp->is.freefn = sp->freefn;
+  zsp->is.rdusec = 0;
   x = sp->endp - sp->readp;
   memcpy(zsp->is.buf, sp->readp, x);
   zsp->is.readp = zsp->is.buf;
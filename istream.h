@@ -15,6 +15,7 @@ struct istream {
   void *cookie;		/* cookie for readfn routine */
   int  (*readfn)(struct istream *sp, unsigned char *buf, int size, int szhint);
   void (*freefn)(struct istream *sp);
+  unsigned long rdusec;	/* time spent in readfn, usec */
 };
 #define istream_buf(sp) ((sp)->buf+ISTREAM_EXTRA)
 
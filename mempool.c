@@ -35,7 +35,7 @@ struct mempool_cfull { /* pseudo-chunk: one entry into full list */
 
 void mp_init(struct mempool *mp) {
   mp->mp_chunk = mp->mp_fullc = NULL;
-  mp->mp_nallocs = mp->mp_datasz = 0;
+  mp->mp_nallocs = mp->mp_datasz = mp->mp_nchunks = 0;
   mp->mp_lastbuf = NULL;
   mp->mp_lastlen = 0;
 }
@@ -49,6 +49,7 @@ void *mp_alloc(struct mempool *mp, unsigned size, int align) {
       return NULL;
     c->next = mp->mp_fullc;
     mp->mp_fullc = (struct mempool_chunk*)c;
+    ++mp->mp_nchunks;
     return c->buf;
   }
   else {
@@ -93,6 +94,7 @@ void *mp_alloc(struct mempool *mp, unsigned size, int align) {
         return NULL;
       c->next = mp->mp_chunk;
       mp->mp_chunk = c;
+      ++mp->mp_nchunks;
       c->size = MEMPOOL_CHUNKSIZE - size;
       return c->buf;
     }
@@ -112,6 +114,25 @@ void mp_free(struct mempool *mp) {
   mp_init(mp);
 }
 
+/* move all memory of another pool into this one, leaving it empty */
+void mp_merge(struct mempool *mp, struct mempool *from) {
+  struct mempool_chunk *c;
+  mp->mp_nallocs += from->mp_nallocs;
+  mp->mp_datasz += from->mp_datasz;
+  mp->mp_nchunks += from->mp_nchunks;
+  while((c = from->mp_chunk) != NULL) {
+    from->mp_chunk = c->next;
+    c->next = mp->mp_fullc;
+    mp->mp_fullc = c;
+  }
+  while((c = from->mp_fullc) != NULL) {
+    from->mp_fullc = c->next;
+    c->next = mp->mp_fullc;
+    mp->mp_fullc = c;
+  }
+  mp_init(from);
+}
+
 void *mp_memdup(struct mempool *mp, const void *buf, unsigned len) {
   void *b = mp_alloc(mp, len, 0);
   if (b)
@@ -11,6 +11,7 @@ struct mempool { /* free-once memory pool.  All members are private */
   struct mempool_chunk *mp_fullc; /* list of full chunks */
   unsigned mp_nallocs;		/* number of allocs so far */
   unsigned mp_datasz;		/* size of allocated data */
+  unsigned mp_nchunks;		/* number of chunks allocated */
   const char *mp_lastbuf;	/* last allocated string */
   unsigned mp_lastlen;		/* length of lastbuf */
 };
@@ -19,6 +20,7 @@ void mp_init(struct mempool *mp);
 void *mp_alloc(struct mempool *mp, unsigned size, int align);
 #define mp_talloc(mp, type) ((type*)mp_alloc((mp), sizeof(type), 1))
 void mp_free(struct mempool *mp);
+void mp_merge(struct mempool *mp, struct mempool *from);
 char *mp_strdup(struct mempool *mp, const char *str);
 void *mp_memdup(struct mempool *mp, const void *buf, unsigned len);
 const char *mp_dstrdup(struct mempool *mp, const char *str);
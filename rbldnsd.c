@@ -2,10 +2,12 @@
  */
 
 #define _LARGEFILE64_SOURCE /* to define O_LARGEFILE if supported */
+#define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
 
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -15,12 +17,16 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
 #include <signal.h>
 #include <syslog.h>
 #include <time.h>
 #include <sys/time.h>	/* some systems can't include time.h and sys/time.h */
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "rbldnsd.h"
 
 #ifndef NO_SELECT_H
@@ -39,15 +45,21 @@
 /* if system have stdint.h, assume it have inttypes.h too */
 # include <inttypes.h>
 #endif
-#ifndef NO_STATS
-# ifndef NO_IOVEC
-#  include <sys/uio.h>
-#  define STATS_IPC_IOVEC 1
-# endif
-#endif
 #ifndef NO_DSO
 # include <dlfcn.h>
 #endif
+#ifndef NO_THREADS
+# include <pthread.h>
+#endif
+#ifdef HAVE_EPOLL
+# include <sys/epoll.h>
+# include <sys/signalfd.h>
+# include <sys/timerfd.h>
+#endif
+#ifdef HAVE_IO_URING
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+#endif
 
 #ifndef NI_MAXHOST
 # define NI_MAXHOST 1025
@@ -60,6 +72,14 @@
 # define O_LARGEFILE 0
 #endif
 
+#ifndef MSG_WAITFORONE
+# define MSG_WAITFORONE 0
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
 const char *version = VERSION;
 const char *show_version = "rbldnsd " VERSION;
 /* version to show in version.bind CH TXT reply */
@@ -85,11 +105,57 @@ void error(int errnum, const char *fmt, ...) {
 }
 
 static unsigned recheck = 60;	/* interval between checks for reload */
+#ifdef HAVE_INOTIFY
+static int wfd = -1;		/* inotify fd watching data files */
+#define WATCH_DELAY 50		/* msec to wait for more changes to come */
+#endif
 static int initialized;		/* 1 when initialized */
 static char *logfile;		/* log file name */
+#ifndef NO_THREADS
+static unsigned logsample;	/* log every logsample'th query (-L) */
+static char *dtapfile;		/* dnstap output file or socket (-D) */
+static int dtapwire;		/* include reply bytes in dnstap (-D +) */
+static struct dnstap *dtap;
+/* held by the log writer while draining rings, and while reopening log */
+static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+static int drainlog(void);
+static const char *ctlpath;	/* control socket name (-S) */
+static int ctlfd = -1;		/* control socket */
+static const char *httpaddr;	/* metrics listener address (-H) */
+static int httpfd = -1;		/* metrics listening socket */
+/* held by the control and metrics threads while looking at zones and
+ * datasets, and by the main thread while changing them, i.e. with
+ * workers paused */
+static pthread_mutex_t ctllock = PTHREAD_MUTEX_INITIALIZER;
+#define ctlthreads() (ctlfd >= 0 || httpfd >= 0)
+static pthread_cond_t ctlcond = PTHREAD_COND_INITIALIZER;
+static int ctlreq;		/* reload requested by the control thread */
+static struct dataset *ctlds;	/* the only dataset to reload, if any */
+static unsigned ctldone;	/* number of requested reloads done */
+static int ctlres;		/* result of the last one */
+#define SIGCTL SIGURG		/* wakes up the main thread for ctlreq */
+#define logging() (flog || dtap)
+#else
+#define logging() (flog)
+#endif
+static char *proffile;		/* dataset load profiles (-Y) */
+static time_t start_time;	/* time we started at */
+static time_t reload_time;	/* time of the last reload, */
+static unsigned long reload_msec; /* ..how long it took */
+static int reload_ok;		/* ..and if everything was loaded */
+static unsigned long reloads[2]; /* number of failed/ok reloads */
 #ifndef NO_STATS
 static char *statsfile;		/* statistics file */
 static int stats_relative;	/* dump relative, not absolute, stats */
+static char *hitsfile;		/* dataset hits file (-W) */
+static char *clientsfile;	/* top client networks file (-G) */
+static struct dnsstats *totstats; /* sum of all workers' counters */
+static struct dnsstats *zpstats; /* for stats monitoring: prev values */
+static struct dnsstats gptot;
+static time_t stats_time;
+static char *shmpath;		/* shared statistics segment (-M) */
+static int shmfd = -1;		/* ..open early, mapped when zones are known */
+static struct stshm *stshm;	/* ..and mapped there */
 #endif
 int accept_in_cidr;		/* accept 127.0.0.1/8-"style" CIDRs */
 int nouncompress;		/* disable on-the-fly decompression */
@@ -97,19 +163,116 @@ unsigned def_ttl = 35*60;	/* default record TTL 35m */
 unsigned min_ttl, max_ttl;	/* TTL constraints */
 const char def_rr[5] = "\177\0\0\2\0";		/* default A RR */
 
+#ifndef NO_STATS
+union rxctl {		/* control data with a receive timestamp */
+  struct cmsghdr cm;
+  char buf[CMSG_SPACE(sizeof(struct timespec))];
+};
+# define RXCTLSIZE sizeof(union rxctl)
+#else
+# define RXCTLSIZE 0
+#endif
+
+#ifdef HAVE_RECVMMSG
+struct rqslot {		/* one request in a batch */
+  struct dnspacket pkt;
+  unsigned char buf[DNS_EDNS0_MAXPACKET];
+#ifndef NO_IPv6
+  struct sockaddr_storage sa;
+#else
+  struct sockaddr_in sa;
+#endif
+#ifndef NO_STATS
+  union rxctl ctl;
+  struct timespec rx;		/* when the query was received */
+#endif
+};
+#endif
+
+/* query worker: the main process, a thread with -T, or a child process
+ * with -P.  Every worker has its own sockets, packet buffers and
+ * statistics counters, so that workers never share anything but
+ * (read-only) zone data.
+ * With threads, worker #0 is the main thread which also handles signals;
+ * other workers are paused (by locking w_lock) while it reloads zones or
+ * reports statistics.
+ * With worker processes, the parent does not answer queries itself.
+ * Only the counters (w_stats, w_hits, w_clients, w_cnt and the log
+ * ring) are in shared memory, so that the parent can report them; the
+ * workers array itself, with packets and other serving state, is
+ * private to every process, since during restart an old and a new
+ * process serve the same sockets for a moment.
+ * With TCP (-K), the last worker serves TCP connections. */
+struct worker {
+  int *w_sock;			/* sockets to serve, numsock entries */
+  int w_tcp;			/* w_sock are TCP sockets, numtcp entries */
+  struct dnspacket w_pkt;	/* packet for non-batched requests */
+#ifndef NO_IPv6
+  struct sockaddr_storage w_peer_sa;
+#else
+  struct sockaddr_in w_peer_sa;
+#endif
+#ifndef NO_STATS
+  struct dnsstats *w_stats;	/* stats shard, numzones+1 entries */
+  struct dshits *w_hits;	/* dataset hits, numdatasets entries */
+  struct clisketch *w_clients;	/* queries per client network (-G) */
+#endif
+  struct anscache *w_cache;	/* answer cache (-R) */
+#ifdef HAVE_RECVMMSG
+  struct rqslot *w_rqs;		/* request slots */
+  struct mmsghdr *w_rmsgs;	/* recvmmsg() headers, one per slot */
+  struct mmsghdr *w_smsgs;	/* sendmmsg() headers for replies */
+  struct iovec *w_riov, *w_siov;
+#ifndef NO_STATS
+  struct wcounters *w_cnt;	/* batch counters */
+#endif
+#endif
+#ifndef NO_THREADS
+  pthread_t w_thread;
+  pthread_mutex_t w_lock;	/* held while answering queries */
+  struct logring *w_logring;	/* asynchronous log records (-L) */
+  unsigned w_lognth;		/* queries since last logged one */
+#endif
+};
+
+#if defined(HAVE_RECVMMSG) && !defined(NO_STATS)
+struct wcounters {
+  dnscnt_t wc_batches;		/* number of recvmmsg() batches */
+  dnscnt_t wc_packets;		/* number of packets in all batches */
+};
+#endif
+
 #define MAXSOCK	20	/* maximum # of supported sockets */
 static int sock[MAXSOCK];	/* array of active sockets */
 static int numsock;		/* number of active sockets in sock[] */
+static int tcpsock[MAXSOCK];	/* TCP sockets, bound to the same addresses */
+static int numtcp;
+int tcp_enabled;		/* TCP listener (-K) is active */
+static unsigned tcp_maxconn = 64;	/* max # of TCP connections */
+static unsigned tcp_perclient = 8;	/* max # of connections per client */
+static unsigned tcp_idle = 10;		/* TCP idle timeout, secs */
+static unsigned cachesize;	/* answer cache size per worker (-R) */
+static unsigned loaders = 1;	/* number of dataset loader threads (-j) */
+static struct worker *workers;	/* array of query workers */
+static int nworkers = 1;	/* number of workers (-T or -P) */
+#define MAXWORKERS 256	/* maximum # of worker threads or processes */
+static int prefork;		/* workers are pre-forked processes (-P) */
+static pid_t *wpids;		/* worker process pids in parent (-P) */
+static int wrestart;		/* restart worker processes to pick up data */
 static FILE *flog;		/* log file */
 static int flushlog;		/* flush log after each line */
+#ifdef HAVE_IO_URING
+static int use_uring;		/* use io_uring event loop (-U) */
+#endif
+#ifdef HAVE_RECVMMSG
+#define MAXBATCH 256	/* maximum # of packets per recvmmsg() */
+static unsigned batch = 1;	/* number of packets to receive at once */
+#endif
 static struct zone *zonelist;	/* list of zones we're authoritative for */
 static int numzones;		/* number of zones in zonelist */
 int lazy;			/* don't return AUTH section by default */
 static int fork_on_reload;
   /* >0 - perform fork on reloads, <0 - this is a child of reloading parent */
-#if STATS_IPC_IOVEC
-static struct iovec *stats_iov;
-#endif
 #ifndef NO_DSO
 int (*hook_reload_check)(), (*hook_reload)();
 int (*hook_query_access)(), (*hook_query_result)();
@@ -133,6 +296,14 @@ const struct dstype *ds_types[] = {
 };
 
 static int do_reload(int do_fork);
+static void initworker(struct worker *w);
+static void loadyield(void);
+#if !defined(NO_THREADS) && !defined(NO_STATS)
+static unsigned long logdrops(int reset);
+#endif
+#ifndef NO_STATS
+static void initstshm(void);
+#endif
 
 static int satoi(const char *s) {
   int n = 0;
@@ -142,6 +313,36 @@ static int satoi(const char *s) {
   return *s ? -1 : n;
 }
 
+#ifndef NO_MEMINFO
+struct meminfo {	/* memory allocated by malloc, bytes */
+  unsigned long arena, free, mmap;
+};
+
+static void meminfo(struct meminfo *m) {
+#ifdef HAVE_MALLINFO2
+  struct mallinfo2 mi = mallinfo2();
+  m->arena = mi.arena;
+  m->free = mi.fordblks;
+  m->mmap = mi.hblkhd;
+#else
+  /* int fields of old mallinfo() wrap above 2Gb, 4Gb at least is ok */
+  struct mallinfo mi = mallinfo();
+  m->arena = (unsigned)mi.arena;
+  m->free = (unsigned)mi.fordblks;
+  m->mmap = (unsigned)mi.hblkhd;
+#endif
+}
+#endif
+
+/* allocate zero-filled memory shared with worker processes */
+static void *shalloc(unsigned size) {
+  void *p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    error(errno, "unable to allocate shared memory");
+  return p;
+}
+
 static void NORETURN usage(int exitcode) {
    const struct dstype **dstp;
    printf(
@@ -167,12 +368,35 @@ static void NORETURN usage(int exitcode) {
 " -f - fork a child process while reloading zones, to process requests\n"
 "  during reload (may double memory requiriments)\n"
 " -q - quickstart, load zones after backgrounding\n"
+" -Q msec - while reloading, stop every `msec' milliseconds to answer\n"
+"  queries which came in meanwhile (not with -f or -P)\n"
 " -l [+]logfile - log queries and answers to this file (+ for unbuffered)\n"
+#ifndef NO_THREADS
+" -L sample - write log (-l) asynchronously in a separate thread, logging\n"
+"  only every `sample'th query (1 for all), dropping records on overload\n"
+" -j threads - load up to `threads' datasets in parallel on reload\n"
+" -D [+]dest - write dnstap records of answers to this file or to\n"
+"  unix:socket (+ to include complete replies), asynchronously as -L\n"
+" -S socket - accept commands (reload, stats, zones, datasets, hits,\n"
+"  clients, dump) on this unix socket\n"
+" -H /socket|addr/port - serve statistics, reload results and dataset\n"
+"  sizes for Prometheus at /metrics, on this unix or loopback socket\n"
+#endif
 #ifndef NO_STATS
 " -s [+]statsfile - write a line with short statistics summary into this\n"
 "  file every `check' (-c) secounds, for rrdtool-like applications\n"
 "  (+ to log relative, not absolute, statistics counters)\n"
 #endif
+#ifndef NO_STATS
+" -M statsfile - keep statistics counters in this file mapped into memory,\n"
+"  for monitoring tools to read at any time\n"
+" -W hitsfile - write hit counters and most often matched entries of every\n"
+"  dataset into this file when writing statistics (-s, SIGUSR1)\n"
+" -G clientsfile - count queries per client /24 (IPv4) or /56 (IPv6) network\n"
+"  and write the top ones into this file when writing statistics\n"
+#endif
+" -Y proffile - write load time profile and memory use of every dataset\n"
+"  into this file after every reload\n"
 " -a - omit AUTH section from regular replies, do not return list of\n"
 "  nameservers, but only return NS info when explicitly asked.\n"
 "  This is an equivalent of bind9 \"minimal-answers\" setting.\n"
@@ -186,7 +410,26 @@ static void NORETURN usage(int exitcode) {
 " -x extension - load given extension module (.so file)\n"
 " -X extarg - pass extarg to extension init routine\n"
 #endif
+#ifdef HAVE_RECVMMSG
+" -B batch - receive and answer up to `batch' queries per system call\n"
+#endif
+#ifndef NO_THREADS
+" -T threads - number of threads answering queries (1)\n"
+#endif
+" -P procs - answer queries in `procs' pre-forked worker processes\n"
+#ifndef NO_POLL
+" -K conns[:perclient[:idle]] - also answer queries over TCP, with up to\n"
+"  `conns' connections (64), `perclient' per client address (8), and\n"
+"  closing connections idle for `idle' time (10s)\n"
+#endif
+#ifdef HAVE_IO_URING
+" -U - use io_uring for network I/O if the kernel supports it\n"
+#endif
+" -R entries - cache up to `entries' answers in every worker\n"
 " -d - dump all zones in BIND format to standard output and exit\n"
+" -I dir - load all zones, write binary images of datasets into dir and exit\n"
+" -i dir - map dataset images from dir (made by -I) instead of reading\n"
+"  data files which did not change since the images were made\n"
 "each zone specified using `name:type:file,file...'\n"
 "syntax, repeated names constitute the same zone.\n"
 "Available dataset types:\n"
@@ -203,6 +446,9 @@ static volatile int signalled;
 #define SIGNALLED_SSTATS	0x08
 #define SIGNALLED_ZSTATS	0x10
 #define SIGNALLED_TERM		0x20
+#define SIGNALLED_CHLD		0x40
+#define SIGNALLED_WATCH		0x80	/* datasets marked dirty (inotify, -S) */
+#define SIGNALLED_CTL		0x100	/* request from the control socket */
 
 static inline int sockaddr_in_equal(const struct sockaddr_in *addr1,
                                     const struct sockaddr_in *addr2)
@@ -270,6 +516,14 @@ static int already_bound(const struct sockaddr *addr, socklen_t addrlen) {
   return 0;
 }
 
+static void setreuseport(int UNUSED fd) {
+#ifdef SO_REUSEPORT
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&on, sizeof(on)) < 0)
+    error(errno, "unable to set SO_REUSEPORT");
+#endif
+}
+
 #ifdef NO_IPv6
 static void newsocket(struct sockaddr_in *sin) {
   int fd;
@@ -282,6 +536,8 @@ static void newsocket(struct sockaddr_in *sin) {
   fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
   if (fd < 0)
     error(errno, "unable to create socket");
+  if (nworkers > 1)
+    setreuseport(fd);
   if (bind(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0)
     error(errno, "unable to bind to %s/%d", host, ntohs(sin->sin_port));
 
@@ -305,6 +561,8 @@ static int newsocket(struct addrinfo *ai) {
   getnameinfo(ai->ai_addr, ai->ai_addrlen,
               host, sizeof(host), serv, sizeof(serv),
               NI_NUMERICHOST|NI_NUMERICSERV);
+  if (nworkers > 1)
+    setreuseport(fd);
   if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
         error(errno, "unable to bind to %s/%s", host, serv);
 
@@ -314,6 +572,73 @@ static int newsocket(struct addrinfo *ai) {
 }
 #endif
 
+#ifdef SO_REUSEPORT
+/* create one more socket bound to the same address as fd,
+ * so that the kernel will distribute queries between the two */
+static int reusesocket(int fd) {
+#ifdef NO_IPv6
+  struct sockaddr_in sa;
+#else
+  struct sockaddr_storage sa;
+#endif
+  socklen_t salen = sizeof(sa);
+  int nfd;
+
+  if (getsockname(fd, (struct sockaddr *)&sa, &salen) < 0)
+    error(errno, "getsockname failed");
+  nfd = socket(((struct sockaddr *)&sa)->sa_family, SOCK_DGRAM, 0);
+  if (nfd < 0)
+    error(errno, "unable to create socket");
+  setreuseport(nfd);
+  if (bind(nfd, (struct sockaddr *)&sa, salen) < 0)
+    error(errno, "unable to bind worker socket");
+  return nfd;
+}
+#endif
+
+#ifndef NO_POLL
+/* create a listening non-blocking TCP socket bound to the address of fd */
+static int tcpsocket(int fd) {
+#ifdef NO_IPv6
+  struct sockaddr_in sa;
+#else
+  struct sockaddr_storage sa;
+#endif
+  socklen_t salen = sizeof(sa);
+  int nfd, on = 1;
+
+  if (getsockname(fd, (struct sockaddr *)&sa, &salen) < 0)
+    error(errno, "getsockname failed");
+  nfd = socket(((struct sockaddr *)&sa)->sa_family, SOCK_STREAM, 0);
+  if (nfd < 0)
+    error(errno, "unable to create TCP socket");
+  setsockopt(nfd, SOL_SOCKET, SO_REUSEADDR, (void*)&on, sizeof(on));
+  if (bind(nfd, (struct sockaddr *)&sa, salen) < 0)
+    error(errno, "unable to bind TCP socket");
+  if (listen(nfd, 64) < 0)
+    error(errno, "unable to listen on TCP socket");
+  fcntl(nfd, F_SETFL, fcntl(nfd, F_GETFL, 0) | O_NONBLOCK);
+  return nfd;
+}
+#endif
+
+static void setrcvbuf(int fd) {
+  int x = 65536;
+  do
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&x, sizeof x) == 0)
+      break;
+  while ((x -= (x >> 5)) >= 1024);
+}
+
+/* ask for kernel receive timestamps, so that query latency includes
+ * time spent in the socket queue */
+static void setrxstamp(int UNUSED fd) {
+#if !defined(NO_STATS) && defined(SO_TIMESTAMPNS)
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, (void*)&on, sizeof(on));
+#endif
+}
+
 static void
 initsockets(const char *bindaddr[MAXSOCK], int nba, int UNUSED family) {
 
@@ -409,13 +734,108 @@ initsockets(const char *bindaddr[MAXSOCK], int nba, int UNUSED family) {
   endhostent();
 
   for (i = 0; i < numsock; ++i) {
-    x = 65536;
-    do
-      if (setsockopt(sock[i], SOL_SOCKET, SO_RCVBUF, (void*)&x, sizeof x) == 0)
-        break;
-    while ((x -= (x >> 5)) >= 1024);
+    setrcvbuf(sock[i]);
+    setrxstamp(sock[i]);
+  }
+
+  /* first worker uses the sockets created above, others get their own
+   * sockets bound to the same addresses if the system supports it */
+  workers[0].w_sock = sock;
+  for (x = 1; x < nworkers - tcp_enabled; ++x) {
+#ifdef SO_REUSEPORT
+    workers[x].w_sock = (int *)emalloc(numsock * sizeof(int));
+    for (i = 0; i < numsock; ++i) {
+      workers[x].w_sock[i] = reusesocket(sock[i]);
+      setrcvbuf(workers[x].w_sock[i]);
+      setrxstamp(workers[x].w_sock[i]);
+    }
+#else
+    workers[x].w_sock = sock;
+#endif
+  }
+
+#ifndef NO_POLL
+  /* TCP worker listens on the same addresses */
+  if (tcp_enabled) {
+    for (i = 0; i < numsock; ++i)
+      tcpsock[i] = tcpsocket(sock[i]);
+    numtcp = numsock;
+    workers[nworkers - 1].w_sock = tcpsock;
+    workers[nworkers - 1].w_tcp = 1;
+  }
+#endif
+}
+
+#ifndef NO_THREADS
+/* listening control socket (-S), owned by the user we'll run as */
+static int
+ctlsocket(const char *path, uid_t uid, gid_t gid, const char *what) {
+  struct sockaddr_un sun;
+  int fd;
+  if (strlen(path) >= sizeof(sun.sun_path))
+    error(0, "%s name `%.50s' is too long", what, path);
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    error(errno, "unable to create %s", what);
+  unlink(path);		/* left from a previous run */
+  if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    error(errno, "unable to bind %s to %.50s", what, path);
+  if ((uid != (uid_t)-1 && chown(path, uid, gid) < 0) ||
+      chmod(path, 0660) < 0 || listen(fd, 8) < 0)
+    error(errno, "unable to set up %s %.50s", what, path);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+/* metrics listener (-H): a unix socket if addr is a path, or TCP on a
+ * loopback address given as addr/port, there's no access control */
+static int httpsocket(const char *addr, uid_t uid, gid_t gid) {
+  char host[64], *port;
+  struct sockaddr_in sin;
+#ifndef NO_IPv6
+  struct sockaddr_in6 sin6;
+#endif
+  struct sockaddr *sa = (struct sockaddr *)&sin;
+  socklen_t salen = sizeof(sin);
+  ip4addr_t a;
+  int fd, x, on = 1;
+
+  if (*addr == '/')
+    return ctlsocket(addr, uid, gid, "metrics socket");
+  ssprintf(host, sizeof(host), "%s", addr);
+  if (!(port = strrchr(host, '/')) ||
+      (x = satoi(port + 1)) < 1 || x > 0xffff)
+    error(0, "metrics address `%.60s' is neither /path nor addr/port", addr);
+  *port = '\0';
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(x);
+  if (ip4addr(host, &a, NULL) > 0 && a >> 24 == 127)
+    sin.sin_addr.s_addr = htonl(a);
+#ifndef NO_IPv6
+  else if (memset(&sin6, 0, sizeof(sin6)),
+           inet_pton(AF_INET6, host, &sin6.sin6_addr) > 0 &&
+           IN6_IS_ADDR_LOOPBACK(&sin6.sin6_addr)) {
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(x);
+    sa = (struct sockaddr *)&sin6;
+    salen = sizeof(sin6);
   }
+#endif
+  else
+    error(0, "metrics address `%.60s' is not a loopback address", addr);
+  if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) < 0)
+    error(errno, "unable to create metrics socket");
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&on, sizeof(on));
+  if (bind(fd, sa, salen) < 0 || listen(fd, 8) < 0)
+    error(errno, "unable to listen for metrics on %.60s", addr);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
 }
+#endif
 
 static struct {
     int facility;
@@ -473,9 +893,11 @@ static void init(int argc, char **argv) {
   uid_t uid = 0;
   gid_t gid = 0;
   int nodaemon = 0, quickstart = 0, dump = 0, nover = 0, forkon = 0;
+  int nprocs = 0;
+  const char *imgout = NULL;
   int family = AF_UNSPEC;
   int cfd = -1;
-  const struct zone *z;
+  struct zone *z;
 #ifndef NO_DSO
   char *ext = NULL, *extarg = NULL;
   int (*extinit)(const char *arg, struct zone *zonelist) = NULL;
@@ -488,7 +910,7 @@ static void init(int argc, char **argv) {
 
   if (argc <= 1) usage(1);
 
-  while((c = getopt(argc, argv, "u:r:b:w:t:c:p:nel:qs:h46dvaAfF:Cx:X:")) != EOF)
+  while((c = getopt(argc, argv, "u:r:b:w:t:c:p:nel:L:D:j:qs:h46dvaAfF:Cx:X:B:T:P:UK:R:i:I:S:Q:Y:M:H:W:G:")) != EOF)
     switch(c) {
     case 'u': user = optarg; break;
     case 'r': rootdir = optarg; break;
@@ -557,9 +979,42 @@ break;
       if (*statsfile != '+') stats_relative = 0;
       else ++statsfile, stats_relative = 1;
       if (!*statsfile) statsfile = NULL;
+#endif
+      break;
+    case 'W':
+#ifdef NO_STATS
+      fprintf(stderr,
+        "%s: warning: no statistics counters support is compiled in\n",
+        progname);
+#else
+      hitsfile = optarg;
+#endif
+      break;
+    case 'G':
+#ifdef NO_STATS
+      fprintf(stderr,
+        "%s: warning: no statistics counters support is compiled in\n",
+        progname);
+#else
+      clientsfile = optarg;
 #endif
       break;
     case 'q': quickstart = 1; break;
+    case 'Y': proffile = optarg; break;
+    case 'M':
+#ifdef NO_STATS
+      fprintf(stderr,
+        "%s: warning: no statistics counters support is compiled in\n",
+        progname);
+#else
+      shmpath = optarg;
+#endif
+      break;
+    case 'Q':
+      if ((c = satoi(optarg)) < 1)
+        error(0, "invalid load time slice (-Q) `%.50s'", optarg);
+      ldslice = c;
+      break;
     case 'd':
 #ifdef NO_MASTER_DUMP
       error(0, "master-format dump option (-d) isn't compiled in");
@@ -572,6 +1027,107 @@ break;
     case 'f': forkon = 1; break;
     case 'F': facility = optarg; break;
     case 'C': nouncompress = 1; break;
+    case 'i': imgdir = optarg; break;
+    case 'I': imgout = optarg; break;
+    case 'B':
+#ifdef HAVE_RECVMMSG
+      if ((c = satoi(optarg)) < 1 || c > MAXBATCH)
+        error(0, "invalid batch size (-B) value `%.50s' (1..%d)",
+              optarg, MAXBATCH);
+      batch = c;
+      break;
+#else
+      error(0, "batched I/O (-B) support is not compiled in");
+#endif
+    case 'T':
+#ifndef NO_THREADS
+      if ((c = satoi(optarg)) < 1 || c > MAXWORKERS)
+        error(0, "invalid number of threads (-T) `%.50s' (1..%d)",
+              optarg, MAXWORKERS);
+      nworkers = c;
+      break;
+#else
+      error(0, "threads support (-T) is not compiled in");
+#endif
+    case 'U':
+#ifdef HAVE_IO_URING
+      use_uring = 1;
+      break;
+#else
+      error(0, "io_uring support (-U) is not compiled in");
+#endif
+    case 'P':
+      if ((nprocs = satoi(optarg)) < 1 || nprocs > MAXWORKERS)
+        error(0, "invalid number of processes (-P) `%.50s' (1..%d)",
+              optarg, MAXWORKERS);
+      break;
+    case 'L':
+#ifndef NO_THREADS
+      if ((c = satoi(optarg)) < 1)
+        error(0, "invalid log sampling (-L) value `%.50s'", optarg);
+      logsample = c;
+      break;
+#else
+      error(0, "asynchronous log (-L) requires threads support");
+#endif
+    case 'j':
+#ifndef NO_THREADS
+      if ((c = satoi(optarg)) < 1 || c > MAXLOADERS)
+        error(0, "invalid number of loader threads (-j) `%.50s'", optarg);
+      loaders = c;
+      break;
+#else
+      error(0, "parallel loading (-j) requires threads support");
+#endif
+    case 'D':
+#ifndef NO_THREADS
+      if (*optarg == '+')
+        dtapwire = 1, ++optarg;
+      if (!*optarg)
+        error(0, "missing dnstap destination (-D)");
+      dtapfile = optarg;
+      break;
+#else
+      error(0, "dnstap output (-D) requires threads support");
+#endif
+    case 'S':
+#ifndef NO_THREADS
+      ctlpath = optarg;
+      break;
+#else
+      error(0, "control socket (-S) requires threads support");
+#endif
+    case 'H':
+#ifndef NO_THREADS
+      httpaddr = optarg;
+      break;
+#else
+      error(0, "metrics listener (-H) requires threads support");
+#endif
+    case 'R':
+      if ((c = satoi(optarg)) < 1)
+        error(0, "invalid answer cache size (-R) `%.50s'", optarg);
+      cachesize = c;
+      break;
+    case 'K':
+#ifndef NO_POLL
+      if ((c = strtol(optarg, &p, 10)) < 1 || p == optarg)
+        error(0, "invalid number of TCP connections (-K) `%.50s'", optarg);
+      tcp_maxconn = c;
+      if (*p == ':' && *++p != ':' && *p) {
+        if ((c = strtol(p, &p, 10)) < 1)
+          error(0, "invalid TCP connections per client (-K) `%.50s'", optarg);
+        tcp_perclient = c;
+      }
+      if (*p == ':' && (!(p = parse_time(p + 1, &tcp_idle)) || !tcp_idle))
+        error(0, "invalid TCP idle timeout (-K) `%.50s'", optarg);
+      if (*p)
+        error(0, "invalid value for -K (TCP) option: `%.50s'", optarg);
+      tcp_enabled = 1;
+      break;
+#else
+      error(0, "TCP support (-K) is not compiled in");
+#endif
 #ifndef NO_DSO
     case 'x': ext = optarg; break;
     case 'X': extarg = optarg; break;
@@ -589,6 +1145,21 @@ break;
     error(0, "no zone(s) to service specified (-h for help)");
   argv += optind;
 
+  if (imgout) {
+    logto = LOGTO_STDERR;
+    imgdir = NULL;	/* images are always made from data files */
+    for(c = 0; c < argc; ++c)
+      zonelist = addzone(zonelist, argv[c]);
+    init_zones_caches(zonelist);
+    if (rootdir && (chdir(rootdir) < 0 || chroot(rootdir) < 0))
+      error(errno, "unable to chroot to %.50s", rootdir);
+    if (workdir && chdir(workdir) < 0)
+      error(errno, "unable to chdir to %.50s", workdir);
+    if (!do_reload(0))
+      error(0, "zone loading errors, aborting");
+    exit(writeimages(imgout) ? 0 : 1);
+  }
+
 #ifndef NO_MASTER_DUMP
   if (dump) {
     time_t now;
@@ -614,6 +1185,33 @@ break;
 
   if (!nba)
     error(0, "no address to listen on (-b option) specified");
+#ifndef NO_THREADS
+  if (dtapfile && !logsample)
+    logsample = 1;
+  if (logsample && !logfile && !flog && !dtapfile)
+    error(0, "asynchronous log (-L) requires a log file (-l)");
+#endif
+  if (forkon && nworkers > 1)
+    error(0, "fork on reload (-f) can not be used with threads (-T)");
+  if (ldslice && (forkon || nprocs))
+    error(0, "time-sliced loading (-Q) can not be used with -f or -P");
+  if (nprocs) {
+    if (forkon || nworkers > 1)
+      error(0, "worker processes (-P) can not be used with -f or -T");
+    nworkers = nprocs;
+    prefork = 1;
+  }
+  if (tcp_enabled) {
+    /* TCP connections are served by one more worker */
+    if (forkon)
+      error(0, "fork on reload (-f) can not be used with TCP (-K)");
+#ifdef NO_THREADS
+    if (!prefork)
+      error(0, "TCP (-K) requires worker processes (-P) "
+               "when threads support is not compiled in");
+#endif
+    ++nworkers;
+  }
 
   if ( facility == NULL ) {
     logfacility = LOG_DAEMON;
@@ -647,6 +1245,7 @@ break;
     if (!quickstart && !flog) logto |= LOGTO_STDOUT;
   }
 
+  workers = (struct worker *)ezalloc(nworkers * sizeof(*workers));
   initsockets(bindaddr, nba, family);
 
 #ifndef NO_DSO
@@ -694,6 +1293,20 @@ break;
     p[-1] = ':';
   }
 
+#ifndef NO_THREADS
+  if (ctlpath)
+    ctlfd = ctlsocket(ctlpath, user ? uid : (uid_t)-1, gid, "control socket");
+  if (httpaddr)
+    httpfd = httpsocket(httpaddr, user ? uid : (uid_t)-1, gid);
+#endif
+
+#ifndef NO_STATS
+  /* mapped later when the number of zones is known */
+  if (shmpath &&
+      (shmfd = open(shmpath, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0)
+    error(errno, "unable to create statistics file %.50s", shmpath);
+#endif
+
   if (pidfile) {
     int fdpid;
     char buf[40];
@@ -730,13 +1343,19 @@ break;
     ++c;
   numzones = c;
 
-#if STATS_IPC_IOVEC
-  stats_iov = (struct iovec *)emalloc(numzones * sizeof(struct iovec));
-  for(c = 0, z = zonelist; z; z = z->z_next, ++c) {
-    stats_iov[c].iov_base = (char*)&z->z_stats;
-    stats_iov[c].iov_len = sizeof(z->z_stats);
-  }
+#ifndef NO_STATS
+  for(c = 0, z = zonelist; z; z = z->z_next)
+    z->z_sidx = ++c;	/* [0] is for global counters */
+  totstats = (struct dnsstats *)emalloc((numzones + 1) * sizeof(*totstats));
+  zpstats = (struct dnsstats *)ezalloc((numzones + 1) * sizeof(*zpstats));
+  if (shmfd >= 0)
+    initstshm();
 #endif
+  for(c = 0; c < nworkers; ++c)
+    initworker(&workers[c]);
+  if (ldslice)
+    ldyield = loadyield;
+
   dslog(LOG_INFO, 0, "rbldnsd version %s started (%d socket(s), %d zone(s))",
         version, numsock, numzones);
   initialized = 1;
@@ -780,11 +1399,33 @@ static void sighandler(int sig) {
   case SIGINT:
     signalled |= SIGNALLED_TERM;
     break;
+  case SIGCHLD:
+    signalled |= SIGNALLED_CHLD;
+    break;
+#ifndef NO_THREADS
+  case SIGCTL:
+    signalled |= SIGNALLED_CTL;
+    break;
+#endif
   }
 }
 
 static sigset_t ssblock; /* signals to block during zone reload */
 static sigset_t ssempty; /* empty set */
+static sigset_t ssrun;	 /* signals blocked while serving (signalfd) */
+
+/* arrange for SIGALRM every `secs' seconds, 0 to cancel */
+static void setalarm(unsigned secs) {
+#ifdef HAVE_SETITIMER
+  struct itimerval itv;
+  itv.it_interval.tv_sec  = itv.it_value.tv_sec  = secs;
+  itv.it_interval.tv_usec = itv.it_value.tv_usec = 0;
+  if (setitimer(ITIMER_REAL, &itv, NULL) < 0)
+    error(errno, "unable to setitimer()");
+#else
+  alarm(secs);
+#endif
+}
 
 static void setup_signals(void) {
   struct sigaction sa;
@@ -792,6 +1433,7 @@ static void setup_signals(void) {
   sa.sa_handler = sighandler;
   sigemptyset(&ssblock);
   sigemptyset(&ssempty);
+  sigemptyset(&ssrun);
   sigaction(SIGHUP, &sa, NULL);
   sigaddset(&ssblock, SIGHUP);
   sigaction(SIGALRM, &sa, NULL);
@@ -804,36 +1446,101 @@ static void setup_signals(void) {
 #endif
   sigaction(SIGTERM, &sa, NULL);
   sigaction(SIGINT, &sa, NULL);
+  if (prefork)
+    sigaction(SIGCHLD, &sa, NULL);
+#ifndef NO_THREADS
+  if (ctlfd >= 0) {
+    sigaction(SIGCTL, &sa, NULL);
+    sigaddset(&ssblock, SIGCTL);
+  }
+#endif
   signal(SIGPIPE, SIG_IGN);	/* in case logfile is FIFO */
 }
 
 #ifndef NO_STATS
 
-struct dnsstats gstats;
-static struct dnsstats gptot;
-static time_t stats_time;
+/* sum up counters of all workers into totstats[] */
+static void sumstats(void) {
+  dnscnt_t *t, *e = (dnscnt_t *)(totstats + numzones + 1);
+  const dnscnt_t *s;
+  int w;
+  memcpy(totstats, workers[0].w_stats, (numzones + 1) * sizeof(*totstats));
+  for(w = 1; w < nworkers; ++w)
+    for(t = (dnscnt_t *)totstats, s = (dnscnt_t *)workers[w].w_stats; t < e; )
+      *t++ += *s++;
+}
+
+static void addhist(dnscnt_t *t, const dnscnt_t *s) {
+  unsigned b;
+  for(b = 0; b < LAT_NBUCKETS; ++b)
+    t[b] += s[b];
+}
+
+/* add up counters of queries by type, rcode, ACL result and so on */
+static void addqstats(struct dnsstats *t, const struct dnsstats *s) {
+#define add(x) t->x += s->x
+  add(t_a); add(t_txt); add(t_any); add(t_other);
+  add(e_edns); add(e_plain);
+  add(r_servfail); add(r_notimpl); add(r_refused); add(r_trunc);
+  add(a_ignore); add(a_refuse); add(a_empty); add(a_always); add(a_pass);
+#undef add
+}
+
+/* latency within which permille of replies in histogram h were sent,
+ * in usecs rounded up to the bucket boundary, 0 if there were none */
+static unsigned long latquantile(const dnscnt_t *h, unsigned permille) {
+  dnscnt_t n = 0, c = 0;
+  unsigned b;
+  for(b = 0; b < LAT_NBUCKETS; ++b)
+    n += h[b];
+  if (!n)
+    return 0;
+  n = (n * permille + 999) / 1000;
+  for(b = 0; (c += h[b]) < n; ++b)
+    ;
+  if (b < LAT_SUB)
+    return b + 1;
+  return (unsigned long)(LAT_SUB + b % LAT_SUB + 1) << (b / LAT_SUB - 1);
+}
+
+#define LAT_FMT " p50=%lu p99=%lu p999=%lu"
+#define lat_args(h) \
+  latquantile(h, 500), latquantile(h, 990), latquantile(h, 999)
+/* expects C(x) to be defined as for the key=value stats lines */
+#define QST_FMT \
+  C(qa) C(qtxt) C(qany) C(qother) C(edns) C(plain) \
+  C(servfail) C(notimpl) C(refused) C(trunc) \
+  C(aclignore) C(aclrefuse) C(aclempty) C(aclalways) C(aclpass)
+#define qst_args(s) \
+  (s).t_a, (s).t_txt, (s).t_any, (s).t_other, (s).e_edns, (s).e_plain, \
+  (s).r_servfail, (s).r_notimpl, (s).r_refused, (s).r_trunc, \
+  (s).a_ignore, (s).a_refuse, (s).a_empty, (s).a_always, (s).a_pass
 
 static void dumpstats(void) {
   struct dnsstats tot;
   char name[DNS_MAXDOMAIN+1];
   FILE *f;
   struct zone *z;
+  const struct dnsstats *zs, *zp;
 
   f = fopen(statsfile, "a");
 
   if (f)
     fprintf(f, "%ld", (long)time(NULL));
 
+  sumstats();
 #define C ":%" PRI_DNSCNT
-  tot = gstats;
+  tot = totstats[0];
   for(z = zonelist; z; z = z->z_next) {
-#define add(x) tot.x += z->z_stats.x
+    zs = &totstats[z->z_sidx];
+    zp = &zpstats[z->z_sidx];
+#define add(x) tot.x += zs->x
     add(b_in); add(b_out);
     add(q_ok); add(q_nxd); add(q_err);
 #undef add
     if (f) {
       dns_dntop(z->z_dn, name, sizeof(name));
-#define delta(x) z->z_stats.x - z->z_pstats.x
+#define delta(x) zs->x - zp->x
       fprintf(f, " %s" C C C C C,
         name,
         delta(q_ok) + delta(q_nxd) + delta(q_err),
@@ -841,8 +1548,6 @@ static void dumpstats(void) {
         delta(b_in), delta(b_out));
 #undef delta
     }
-    if (stats_relative)
-      z->z_pstats = z->z_stats;
   }
   if (f) {
 #define delta(x) tot.x - gptot.x
@@ -853,8 +1558,10 @@ static void dumpstats(void) {
 #undef delta
     fclose(f);
   }
-  if (stats_relative)
+  if (stats_relative) {
+    memcpy(zpstats, totstats, (numzones + 1) * sizeof(*zpstats));
     gptot = tot;
+  }
 #undef C
 }
 
@@ -869,68 +1576,209 @@ static void dumpstats_z(void) {
 static void logstats(int reset) {
   time_t t = time(NULL);
   time_t d = t - stats_time;
-  struct dnsstats tot = gstats;
+  struct dnsstats tot;
   char name[DNS_MAXDOMAIN+1];
   struct zone *z;
+  const struct dnsstats *zs;
+  int w;
 
+  sumstats();
+  tot = totstats[0];
 #define C(x) " " #x "=%" PRI_DNSCNT
   for(z = zonelist; z; z = z->z_next) {
-#define add(x) tot.x += z->z_stats.x
+    zs = &totstats[z->z_sidx];
+#define add(x) tot.x += zs->x
     add(b_in); add(b_out);
     add(q_ok); add(q_nxd); add(q_err);
 #undef add
+    addhist(tot.l_hist, zs->l_hist);
+    addqstats(&tot, zs);
     dns_dntop(z->z_dn, name, sizeof(name));
     dslog(LOG_INFO, 0,
-      "stats for %ldsecs zone %.60s:" C(tot) C(ok) C(nxd) C(err) C(in) C(out),
+      "stats for %ldsecs zone %.60s:" C(tot) C(ok) C(nxd) C(err) C(in) C(out)
+      LAT_FMT QST_FMT,
       (long)d, name,
-      z->z_stats.q_ok + z->z_stats.q_nxd + z->z_stats.q_err,
-      z->z_stats.q_ok, z->z_stats.q_nxd, z->z_stats.q_err,
-      z->z_stats.b_in, z->z_stats.b_out);
+      zs->q_ok + zs->q_nxd + zs->q_err,
+      zs->q_ok, zs->q_nxd, zs->q_err,
+      zs->b_in, zs->b_out, lat_args(zs->l_hist), qst_args(*zs));
   }
   dslog(LOG_INFO, 0,
-    "stats for %ldsec:" C(tot) C(ok) C(nxd) C(err) C(in) C(out),
+    "stats for %ldsec:" C(tot) C(ok) C(nxd) C(err) C(in) C(out)
+    LAT_FMT QST_FMT,
     (long)d,
     tot.q_ok + tot.q_nxd + tot.q_err,
     tot.q_ok, tot.q_nxd, tot.q_err,
-    tot.b_in, tot.b_out);
+    tot.b_in, tot.b_out, lat_args(tot.l_hist), qst_args(tot));
+  if (cachesize)
+    dslog(LOG_INFO, 0,
+      "stats for %ldsec: cache" C(hits) C(misses) C(evictions),
+      (long)d, tot.c_hit, tot.c_miss, tot.c_evict);
 #undef C
+#ifndef NO_THREADS
+  if (logsample) {
+    unsigned long drops = logdrops(0);
+    if (dtap)
+      dslog(LOG_INFO, 0, "stats for %ldsec: log dropped=%lu dnstap dropped=%lu",
+            (long)d, drops, dnstap_drops(dtap));
+    else
+      dslog(LOG_INFO, 0, "stats for %ldsec: log dropped=%lu", (long)d, drops);
+  }
+#endif
+#ifdef HAVE_RECVMMSG
+  {
+    dnscnt_t batches = 0, packets = 0, avg;
+    for(w = 0; w < nworkers; ++w) {
+      batches += workers[w].w_cnt->wc_batches;
+      packets += workers[w].w_cnt->wc_packets;
+    }
+    if (batches) {
+      avg = packets * 100 / batches;
+      dslog(LOG_INFO, 0,
+        "stats for %ldsec: batches=%" PRI_DNSCNT " packets=%" PRI_DNSCNT
+        " avgbatch=%u.%02u",
+        (long)d, batches, packets,
+        (unsigned)(avg / 100), (unsigned)(avg % 100));
+    }
+  }
+#endif
   if (reset) {
-    for(z = zonelist; z; z = z->z_next) {
-      memset(&z->z_stats, 0, sizeof(z->z_stats));
-      memset(&z->z_pstats, 0, sizeof(z->z_pstats));
+    /* worker processes (-P) keep counting while we clear their counters,
+     * so a query being answered right now may be accounted twice */
+    for(w = 0; w < nworkers; ++w) {
+      memset(workers[w].w_stats, 0,
+             (numzones + 1) * sizeof(*workers[w].w_stats));
+      memset(workers[w].w_hits, 0,
+             numdatasets * sizeof(*workers[w].w_hits));
+      if (clientsfile)
+        memset(workers[w].w_clients, 0, sizeof(*workers[w].w_clients));
+#ifdef HAVE_RECVMMSG
+      memset(workers[w].w_cnt, 0, sizeof(*workers[w].w_cnt));
+#endif
     }
-    memset(&gstats, 0, sizeof(gstats));
+#ifndef NO_THREADS
+    if (logsample)
+      logdrops(1);
+#endif
+    memset(zpstats, 0, (numzones + 1) * sizeof(*zpstats));
     memset(&gptot, 0, sizeof(gptot));
     stats_time = t;
+    if (stshm) {
+      stshm->sh_reset = t;
+      ++stshm->sh_resets;
+    }
   }
 }
 
-#if STATS_IPC_IOVEC
-# define ipc_read_stats(fd)  readv(fd, stats_iov, numzones)
-# define ipc_write_stats(fd) writev(fd, stats_iov, numzones)
-#else
-static void ipc_read_stats(int fd) {
-  struct zone *z;
-  for(z = zonelist; z; z = z->z_next)
-    if (read(fd, &z->z_stats, sizeof(z->z_stats)) <= 0)
-      break;
+/* dataset hits of all workers */
+static void listallhits(FILE *f) {
+  struct dshits *wh[MAXWORKERS];
+  int w;
+  for(w = 0; w < nworkers; ++w)
+    wh[w] = workers[w].w_hits;
+  listhits(f, wh, nworkers);
 }
-static void ipc_write_stats(int fd) {
-  const struct zone *z;
-  for(z = zonelist; z; z = z->z_next)
-    if (write(fd, &z->z_stats, sizeof(z->z_stats)) <= 0)
-      break;
+
+/* client networks of all workers */
+static void listallclients(FILE *f) {
+  struct clisketch *wc[MAXWORKERS];
+  int w;
+  for(w = 0; w < nworkers; ++w)
+    wc[w] = workers[w].w_clients;
+  listclients(f, wc, nworkers);
 }
-#endif
 
-#else
-# define ipc_read_stats(fd)
-# define ipc_write_stats(fd)
-#endif
+/* write a list into file (hitsfile, clientsfile), replacing it */
+static void writelist(const char *file, void (*list)(FILE *)) {
+  char tmp[1024];
+  FILE *f;
+  ssprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  if (!(f = fopen(tmp, "w"))) {
+    dslog(LOG_WARNING, 0, "unable to create %s: %s", tmp, strerror(errno));
+    return;
+  }
+  fprintf(f, "# %ld secs\n", (long)(time(NULL) - stats_time));
+  list(f);
+  if (fclose(f) != 0 || rename(tmp, file) != 0) {
+    dslog(LOG_WARNING, 0, "unable to write %s: %s", file, strerror(errno));
+    unlink(tmp);
+  }
+}
 
-static void reopenlog(void) {
-  if (logfile) {
-    int fd;
+/* map the shared statistics segment (-M) and fill in its header.
+ * Workers count right there, in MAP_SHARED memory, so counters of
+ * worker processes and of the -f child need not be passed around */
+static void initstshm(void) {
+  unsigned zoff = sizeof(struct stshm);
+  unsigned soff = zoff + numzones * STSHM_ZONELEN;
+  unsigned size = soff + nworkers * (numzones + 1) * sizeof(struct dnsstats);
+  struct stshm *sh;
+  struct zone *z;
+  char *p;
+
+  if (ftruncate(shmfd, size) < 0 ||
+      (p = (char *)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                        shmfd, 0)) == MAP_FAILED)
+    error(errno, "unable to map statistics file %.50s", shmpath);
+  close(shmfd);
+  shmfd = -1;
+  sh = (struct stshm *)p;
+  sh->sh_version = STSHM_VERSION;
+  sh->sh_size = size;
+  sh->sh_nzones = numzones;
+  sh->sh_nshards = nworkers;
+  sh->sh_zoneoff = zoff;
+  sh->sh_shardoff = soff;
+  sh->sh_cntsize = sizeof(dnscnt_t);
+  sh->sh_ncnt = sizeof(struct dnsstats) / sizeof(dnscnt_t);
+  sh->sh_pid = getpid();
+  sh->sh_start = time(NULL);
+  for(z = zonelist; z; z = z->z_next)
+    dns_dntop(z->z_dn, p + zoff + (z->z_sidx - 1) * STSHM_ZONELEN,
+              STSHM_ZONELEN);
+  memcpy(sh->sh_magic, STSHM_MAGIC, sizeof(sh->sh_magic));
+  stshm = sh;
+}
+
+/* pass counters from the temporary query-answering child (-f) to
+ * the parent.  There's only one worker in this case; its shard of
+ * struct dnsstats goes over as a whole, with all the counters in it */
+static void ipc_read(int fd, void *buf, int l) {
+  char *p = (char *)buf;
+  int r;
+  while(l > 0 && (r = read(fd, p, l)) > 0)
+    p += r, l -= r;
+}
+static void ipc_write(int fd, const void *buf, int l) {
+  const char *p = (const char *)buf;
+  int r;
+  while(l > 0 && (r = write(fd, p, l)) > 0)
+    p += r, l -= r;
+}
+static void ipc_read_stats(int fd) {
+  if (!stshm)	/* or else the child counted in the shared segment */
+    ipc_read(fd, workers[0].w_stats,
+             (numzones + 1) * sizeof(struct dnsstats));
+  ipc_read(fd, workers[0].w_hits, numdatasets * sizeof(struct dshits));
+  if (clientsfile)
+    ipc_read(fd, workers[0].w_clients, sizeof(struct clisketch));
+}
+static void ipc_write_stats(int fd) {
+  if (!stshm)
+    ipc_write(fd, workers[0].w_stats,
+              (numzones + 1) * sizeof(struct dnsstats));
+  ipc_write(fd, workers[0].w_hits, numdatasets * sizeof(struct dshits));
+  if (clientsfile)
+    ipc_write(fd, workers[0].w_clients, sizeof(struct clisketch));
+}
+
+#else
+# define ipc_read_stats(fd)
+# define ipc_write_stats(fd)
+#endif
+
+static void reopenlog(void) {
+  if (logfile) {
+    int fd;
     if (flog) fclose(flog);
     fd = open(logfile, O_WRONLY|O_APPEND|O_CREAT|O_NONBLOCK|O_LARGEFILE, 0644);
     if (fd < 0 || (flog = fdopen(fd, "a")) == NULL) {
@@ -946,6 +1794,37 @@ static void reopenlog(void) {
   }
 }
 
+#ifndef NO_THREADS
+/* other workers do not touch zone data or counters while paused */
+# define lockworker(w) \
+  do { if ((w) != workers) pthread_mutex_lock(&(w)->w_lock); } while(0)
+# define unlockworker(w) \
+  do { if ((w) != workers) pthread_mutex_unlock(&(w)->w_lock); } while(0)
+
+static void pause_workers(void) {
+  int w;
+  if (ctlthreads())
+    pthread_mutex_lock(&ctllock);
+  if (!prefork && initialized)
+    for(w = 1; w < nworkers; ++w)
+      pthread_mutex_lock(&workers[w].w_lock);
+}
+
+static void resume_workers(void) {
+  int w;
+  if (!prefork && initialized)
+    for(w = 1; w < nworkers; ++w)
+      pthread_mutex_unlock(&workers[w].w_lock);
+  if (ctlthreads())
+    pthread_mutex_unlock(&ctllock);
+}
+#else
+# define lockworker(w)
+# define unlockworker(w)
+# define pause_workers()
+# define resume_workers()
+#endif
+
 static void check_expires(void) {
   struct zone *zone;
   time_t now = time(NULL);
@@ -955,6 +1834,8 @@ static void check_expires(void) {
     if (zone->z_expires && zone->z_expires < now) {
       zlog(LOG_WARNING, zone, "zone data expired, zone will not be serviced");
       zone->z_stamp = 0;
+      wrestart = 1;
+      ++anscache_gen;
     }
   }
 }
@@ -967,6 +1848,7 @@ static int do_reload(int do_fork) {
   struct zone *zone;
   pid_t cpid = 0;	/* child pid; =0 to make gcc happy */
   int cfd = 0;		/* child stats fd; =0 to make gcc happy */
+  struct timeval tv0, tv;
 #ifndef NO_TIMES
   struct tms tms;
   clock_t utm, etm;
@@ -977,7 +1859,9 @@ static int do_reload(int do_fork) {
 
   ds = nextdataset2reload(NULL);
   if (!ds && call_hook(reload_check, (zonelist)) == 0) {
+    pause_workers();
     check_expires();
+    resume_workers();
     return 1;	/* nothing to reload */
   }
 
@@ -1007,6 +1891,16 @@ static int do_reload(int do_fork) {
         close(pfd[1]);
       }
       fork_on_reload = -1;
+      /* a signalfd registered in the parent's epoll set will not wake
+       * us up, so get SIGTERM delivered the usual way */
+      sigemptyset(&ssrun);
+#ifndef NO_THREADS
+      /* the control and metrics threads stay in the parent */
+      if (ctlfd >= 0)
+        close(ctlfd), ctlfd = -1;
+      if (httpfd >= 0)
+        close(httpfd), httpfd = -1;
+#endif
       return 1;
     }
     else {
@@ -1023,13 +1917,13 @@ static int do_reload(int do_fork) {
   etm = times(&tms);
   utm = tms.tms_utime;
 #endif /* NO_TIMES */
+  gettimeofday(&tv0, NULL);
 
-  r = 1;
-  while(ds) {
-    if (!loaddataset(ds))
-      r = 0;
-    ds = nextdataset2reload(ds);
-  }
+  r = loaddatasets(loaders);
+
+  /* other workers answered queries from the old data so far */
+  pause_workers();
+  swapdatasets();
 
   for (zone = zonelist; zone; zone = zone->z_next) {
     time_t stamp = 0;
@@ -1070,6 +1964,7 @@ static int do_reload(int do_fork) {
 
   if (call_hook(reload, (zonelist)) != 0)
     r = 0;
+  ++anscache_gen;	/* all cached answers are stale now */
 
   ip = ssprintf(ibuf, sizeof(ibuf), "zones reloaded");
 #ifndef NO_TIMES
@@ -1082,19 +1977,31 @@ static int do_reload(int do_fork) {
 #endif /* NO_TIMES */
 #ifndef NO_MEMINFO
   {
-    struct mallinfo mi = mallinfo();
+    struct meminfo mi;
+    meminfo(&mi);
 # define kb(x) ((mi.x + 512)>>10)
     ip += ssprintf(ibuf + ip, sizeof(ibuf) - ip,
-          ", mem arena=%d free=%d mmap=%d Kb",
-          kb(arena), kb(fordblks), kb(hblkhd));
+          ", mem arena=%lu free=%lu mmap=%lu Kb",
+          kb(arena), kb(free), kb(mmap));
 # undef kb
   }
 #endif /* NO_MEMINFO */
   dslog(LOG_INFO, 0, "%s", ibuf);
 
+  gettimeofday(&tv, NULL);
+  reload_time = tv.tv_sec;
+  reload_msec = (tv.tv_sec - tv0.tv_sec) * 1000 +
+                (tv.tv_usec - tv0.tv_usec) / 1000;
+  reload_ok = r != 0;
+  ++reloads[reload_ok];
+
   check_expires();
+  resume_workers();
+  if (proffile)
+    writeprofile(proffile);
 
   /* ok, (something) loaded. */
+  wrestart = 1;
 
   if (do_fork) {
     /* here we should notify query-answering child (send SIGTERM to it),
@@ -1126,19 +2033,45 @@ static int do_reload(int do_fork) {
   return r;
 }
 
+
+static void stop_workers(void);
+static void restart_workers(void);
+static void reap_workers(void);
+
 static void do_signalled(void) {
+#ifndef NO_THREADS
+  int ctl, r = 1;
+#endif
   sigprocmask(SIG_SETMASK, &ssblock, NULL);
+  pause_workers();
   if (signalled & SIGNALLED_TERM) {
-    if (fork_on_reload < 0) { /* this is a temp child; dump stats and exit */
-      ipc_write_stats(1);
+    if (fork_on_reload < 0) { /* this is a child; dump stats and exit */
+#ifndef NO_STATS
+      if (!prefork) /* worker processes count in shared memory */
+        ipc_write_stats(1);
+#endif
       if (flog && !flushlog)
         fflush(flog);
       _exit(0);
     }
     dslog(LOG_INFO, 0, "terminating");
+    if (prefork)
+      stop_workers();
+#ifndef NO_THREADS
+    if (logsample) {
+      pthread_mutex_lock(&loglock);
+      drainlog();
+      if (dtap)
+        dnstap_reopen(dtap, 1);
+    }
+#endif
 #ifndef NO_STATS
     if (statsfile)
       dumpstats();
+    if (hitsfile)
+      writelist(hitsfile, listallhits);
+    if (clientsfile)
+      writelist(clientsfile, listallclients);
     logstats(0);
     if (statsfile)
       dumpstats_z();
@@ -1148,79 +2081,1720 @@ static void do_signalled(void) {
 #ifndef NO_STATS
   if (signalled & SIGNALLED_SSTATS && statsfile)
     dumpstats();
+  if (signalled & SIGNALLED_SSTATS && hitsfile)
+    writelist(hitsfile, listallhits);
+  if (signalled & SIGNALLED_SSTATS && clientsfile)
+    writelist(clientsfile, listallclients);
   if (signalled & SIGNALLED_LSTATS) {
     logstats(signalled & SIGNALLED_ZSTATS);
     if (signalled & SIGNALLED_ZSTATS && statsfile)
       dumpstats_z();
   }
 #endif
-  if (signalled & SIGNALLED_RELOG)
+  if (signalled & SIGNALLED_RELOG) {
+#ifndef NO_THREADS
+    pthread_mutex_lock(&loglock);
+    reopenlog();
+    if (dtap)
+      dnstap_reopen(dtap, 0);
+    pthread_mutex_unlock(&loglock);
+#else
     reopenlog();
-  if (signalled & SIGNALLED_RELOAD)
+#endif
+    wrestart = 1;
+  }
+#ifndef NO_THREADS
+  /* a request which comes while reloading waits for the next round */
+  if ((ctl = ctlreq) != 0) {
+    if (ctlds)
+      ctlds->ds_dirty = 1, signalled |= SIGNALLED_WATCH;
+    else
+      signalled |= SIGNALLED_RELOAD;
+  }
+#endif
+  if (signalled & (SIGNALLED_RELOAD|SIGNALLED_WATCH)) {
+    /* on inotify events or a request for one dataset alone,
+     * check only the datasets affected */
+    reload_dirty = !(signalled & SIGNALLED_RELOAD);
+    /* do_reload() pauses workers only while swapping the new data in */
+    resume_workers();
+#ifndef NO_THREADS
+    r = do_reload(fork_on_reload);
+#else
     do_reload(fork_on_reload);
+#endif
+    pause_workers();
+    reload_dirty = 0;
+  }
+#ifndef NO_THREADS
+  if (ctl) {
+    ctlreq = 0;
+    ctlres = r;
+    ++ctldone;
+    pthread_cond_broadcast(&ctlcond);
+  }
+#endif
+  if (prefork) {
+    reap_workers();
+    if (wrestart)
+      restart_workers();
+  }
   signalled = 0;
-  sigprocmask(SIG_SETMASK, &ssempty, NULL);
+  resume_workers();
+  sigprocmask(SIG_SETMASK, &ssrun, NULL);
 }
 
-#ifndef NO_IPv6
-static struct sockaddr_storage peer_sa;
+#ifndef NO_THREADS
+
+/* Asynchronous query log (-L).  Instead of formatting and writing log
+ * lines while answering queries, workers put fixed-size binary records
+ * into a per-worker ring buffer in shared memory, and a writer thread in
+ * the main process formats them and writes to the log file in large
+ * blocks.  Only every logsample'th query is logged.  If a ring is full,
+ * the record is dropped and counted, a query is never delayed.
+ * A ring has one consumer but may have two producers for a moment (an
+ * old and a new worker process during restart), so every slot has a
+ * sequence number telling whether it is free or filled (as in
+ * D. Vyukov's bounded queue).
+ * The same records are used for dnstap output (-D); when reply bytes
+ * are to be included, every slot is followed by room for a UDP reply. */
+
+#define LOGRING 4096	/* # of records in a ring, power of 2 */
+
+struct logslot {
+  unsigned ls_seq;		/* == pos if free, == pos+1 if filled */
+  struct logrec ls_rec;
+};
+
+struct logring {
+  unsigned lg_head;		/* next slot to fill */
+  unsigned lg_tail;		/* next slot to write out */
+  unsigned long lg_drops;	/* records dropped because ring was full */
+  volatile time_t lg_now;	/* current time, kept by the log writer */
+  struct logslot lg_slot[1];	/* LOGRING slots of logstride bytes */
+};
+
+static unsigned logstride;	/* size of a slot in a ring */
+static char logbuf[65536];	/* formatted lines not written yet */
+static unsigned logbuflen;
+static unsigned long logwdrops;	/* records lost writing the log file */
+
+#define logslot(lg, pos) \
+  ((struct logslot *)((char *)(lg)->lg_slot + \
+                      ((pos) & (LOGRING - 1)) * logstride))
+
+static struct logring *newlogring(void) {
+  struct logring *lg;
+  unsigned i;
+  if (!logstride)
+    logstride = sizeof(struct logslot) + (dtapwire ? DNS_EDNS0_MAXPACKET : 0);
+  lg = (struct logring *)shalloc(offsetof(struct logring, lg_slot) +
+                                 LOGRING * logstride);
+  for(i = 0; i < LOGRING; ++i)
+    logslot(lg, i)->ls_seq = i;
+  return lg;
+}
+
+#ifndef NO_STATS
+/* total number of records dropped from all rings, optionally resetting */
+static unsigned long logdrops(int reset) {
+  unsigned long drops = 0;
+  int w;
+  for(w = 0; w < nworkers; ++w) {
+    drops += workers[w].w_logring->lg_drops;
+    if (reset)
+      workers[w].w_logring->lg_drops = 0;
+  }
+  drops += __atomic_load_n(&logwdrops, __ATOMIC_RELAXED);
+  if (reset)
+    __atomic_store_n(&logwdrops, 0UL, __ATOMIC_RELAXED);
+  return drops;
+}
+#endif
+
+static void logasync(struct worker *w, const struct dnspacket *pkt) {
+  struct logring *lg = w->w_logring;
+  struct logslot *s;
+  unsigned pos, seq;
+
+  if (++w->w_lognth < logsample)
+    return;
+  w->w_lognth = 0;
+  pos = __atomic_load_n(&lg->lg_head, __ATOMIC_RELAXED);
+  for(;;) {
+    s = logslot(lg, pos);
+    seq = __atomic_load_n(&s->ls_seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&lg->lg_head, &pos, pos + 1, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if ((int)(seq - pos) < 0) {	/* ring is full */
+      __atomic_add_fetch(&lg->lg_drops, 1UL, __ATOMIC_RELAXED);
+      return;
+    }
+    else
+      pos = __atomic_load_n(&lg->lg_head, __ATOMIC_RELAXED);
+  }
+  logfill(&s->ls_rec, pkt, lg->lg_now);
+  if (dtapwire && pkt->p_cur - pkt->p_buf <= DNS_EDNS0_MAXPACKET) {
+    s->ls_rec.lr_wirelen = pkt->p_cur - pkt->p_buf;
+    memcpy(s + 1, pkt->p_buf, s->ls_rec.lr_wirelen);
+  }
+  __atomic_store_n(&s->ls_seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* write out formatted log lines.  The log file is non-blocking: when
+ * a pipe or FIFO reader is slow, the rest is kept for the next time, so
+ * no line is cut; on error, it is dropped and its records counted */
+static void logflush(void) {
+  unsigned off = 0;
+  const char *p;
+  int r;
+  while(off < logbuflen) {
+    r = write(fileno(flog), logbuf + off, logbuflen - off);
+    if (r > 0)
+      off += r;
+    else if (r < 0 && errno == EINTR)
+      continue;
+    else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    else {
+      for(p = logbuf + off; p < logbuf + logbuflen; ++p)
+        if (*p == '\n')
+          __atomic_add_fetch(&logwdrops, 1UL, __ATOMIC_RELAXED);
+      off = logbuflen;
+    }
+  }
+  memmove(logbuf, logbuf + off, logbuflen - off);
+  logbuflen -= off;
+}
+
+/* write out all filled records, with loglock held */
+static int drainlog(void) {
+  unsigned pos;
+  int w, r = 0;
+  struct logring *lg;
+  struct logslot *s;
+
+  for(w = 0; w < nworkers; ++w) {
+    lg = workers[w].w_logring;
+    for(pos = lg->lg_tail; ; ++pos) {
+      s = logslot(lg, pos);
+      if (__atomic_load_n(&s->ls_seq, __ATOMIC_ACQUIRE) != pos + 1)
+        break;
+      if (flog) {
+        if (logbuflen + LOGLINESZ > sizeof(logbuf))
+          logflush();
+        if (logbuflen + LOGLINESZ > sizeof(logbuf)) /* reader is stuck */
+          __atomic_add_fetch(&logwdrops, 1UL, __ATOMIC_RELAXED);
+        else
+          logbuflen += logformat(logbuf + logbuflen, &s->ls_rec);
+      }
+      if (dtap)
+        dnstap_write(dtap, &s->ls_rec, (unsigned char *)(s + 1));
+      __atomic_store_n(&s->ls_seq, pos + LOGRING, __ATOMIC_RELEASE);
+      ++r;
+    }
+    lg->lg_tail = pos;
+  }
+  if (logbuflen && flog)
+    logflush();
+  if (r && dtap)
+    dnstap_flush(dtap);
+  return r;
+}
+
+/* update the time stamped into log records.  Rings are in shared
+ * memory, so this reaches worker processes (-P) too */
+static void logtick(void) {
+  time_t now = time(NULL);
+  int w;
+  for(w = 0; w < nworkers; ++w)
+    workers[w].w_logring->lg_now = now;
+}
+
+static void *logwriter(void UNUSED *arg) {
+  struct timespec ts;
+  for(;;) {
+    logtick();
+    pthread_mutex_lock(&loglock);
+    if (!drainlog()) {
+      pthread_mutex_unlock(&loglock);
+      ts.tv_sec = 0;
+      ts.tv_nsec = 20000000;	/* nothing to do, sleep for 20ms */
+      nanosleep(&ts, NULL);
+    }
+    else
+      pthread_mutex_unlock(&loglock);
+  }
+  return NULL;
+}
+
+static void startlogwriter(void) {
+  pthread_t t;
+  sigset_t ss, oss;
+  logtick();
+  sigfillset(&ss);
+  pthread_sigmask(SIG_SETMASK, &ss, &oss);
+  if ((errno = pthread_create(&t, NULL, logwriter, NULL)) != 0)
+    error(errno, "unable to create log writer thread");
+  pthread_sigmask(SIG_SETMASK, &oss, NULL);
+}
+
+/* Control socket (-S).  A separate thread accepts connections on a
+ * unix socket, reads one command line from each and writes the reply,
+ * so clients of the control socket never delay queries.  Zones and
+ * datasets are looked at with ctllock held, which the main thread takes
+ * when it pauses workers to change them; a reply is formatted in memory
+ * and written out after the lock is released.  Reloads are done by the
+ * main thread as usual: the control thread posts a request, wakes the
+ * main thread up with SIGCTL and waits for the reload to finish. */
+
+#define CTL_TIMEOUT 10	/* secs to wait for a slow control client */
+
+static void ctl_reload(FILE *f, const char *arg) {
+  struct dataset *ds = NULL;
+  unsigned done;
+  int r;
+  pthread_mutex_lock(&ctllock);
+  if (*arg && !(ds = finddataset(arg))) {
+    pthread_mutex_unlock(&ctllock);
+    fprintf(f, "error: unknown dataset %s\n", arg);
+    return;
+  }
+  ctlds = ds;
+  ctlreq = 1;
+  done = ctldone;
+  kill(getpid(), SIGCTL);
+  while(ctldone == done)
+    pthread_cond_wait(&ctlcond, &ctllock);
+  r = ctlres;
+  pthread_mutex_unlock(&ctllock);
+  fprintf(f, r ? "ok\n" : "error: not all datasets are loaded, see log\n");
+}
+
+#ifndef NO_STATS
+/* sum up counters #sidx of all workers */
+static void ctl_sumstats(struct dnsstats *t, unsigned sidx) {
+  dnscnt_t *tc = (dnscnt_t *)t, *e = (dnscnt_t *)(t + 1);
+  const dnscnt_t *s;
+  int w;
+  *t = workers[0].w_stats[sidx];
+  for(w = 1; w < nworkers; ++w)
+    for(tc = (dnscnt_t *)t, s = (dnscnt_t *)&workers[w].w_stats[sidx];
+        tc < e; )
+      *tc++ += *s++;
+}
+#endif
+
+static void ctl_stats(FILE *f) {
+#ifndef NO_STATS
+  struct dnsstats tot, zs;
+  char name[DNS_MAXDOMAIN+1];
+  const struct zone *z;
+  /* zone list does not change after startup */
+  ctl_sumstats(&tot, 0);
+#define C(x) " " #x "=%" PRI_DNSCNT
+  for(z = zonelist; z; z = z->z_next) {
+    ctl_sumstats(&zs, z->z_sidx);
+#define add(x) tot.x += zs.x
+    add(b_in); add(b_out);
+    add(q_ok); add(q_nxd); add(q_err);
+#undef add
+    addhist(tot.l_hist, zs.l_hist);
+    addqstats(&tot, &zs);
+    dns_dntop(z->z_dn, name, sizeof(name));
+    fprintf(f, "zone %s" C(tot) C(ok) C(nxd) C(err) C(in) C(out)
+               LAT_FMT QST_FMT "\n",
+      name, zs.q_ok + zs.q_nxd + zs.q_err,
+      zs.q_ok, zs.q_nxd, zs.q_err, zs.b_in, zs.b_out, lat_args(zs.l_hist),
+      qst_args(zs));
+  }
+  fprintf(f, "total secs=%ld" C(tot) C(ok) C(nxd) C(err) C(in) C(out)
+             LAT_FMT QST_FMT "\n",
+    (long)(time(NULL) - stats_time), tot.q_ok + tot.q_nxd + tot.q_err,
+    tot.q_ok, tot.q_nxd, tot.q_err, tot.b_in, tot.b_out,
+    lat_args(tot.l_hist), qst_args(tot));
+  if (cachesize)
+    fprintf(f, "cache" C(hits) C(misses) C(evictions) "\n",
+      tot.c_hit, tot.c_miss, tot.c_evict);
+#undef C
 #else
-static struct sockaddr_in peer_sa;
+  fprintf(f, "error: statistics counters are not compiled in\n");
 #endif
-static struct dnspacket pkt;
+}
 
-static void request(int fd) {
-  int q, r;
-  socklen_t salen = sizeof(peer_sa);
+static void ctl_zones(FILE *f) {
+  char name[DNS_MAXDOMAIN+1];
+  const struct zone *z;
+  const struct dslist *dsl;
+  time_t t;
+  struct tm tmb, *tm;
+  pthread_mutex_lock(&ctllock);
+  for(z = zonelist; z; z = z->z_next) {
+    dns_dntop(z->z_dn, name, sizeof(name));
+    fprintf(f, "%s", name);
+    if (!z->z_stamp)
+      fprintf(f, " not serviced");
+    else {
+      t = z->z_stamp;
+      tm = gmtime_r(&t, &tmb);
+      fprintf(f, " %04d%02d%02d %02d%02d%02d",
+              tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+              tm->tm_hour, tm->tm_min, tm->tm_sec);
+      if (z->z_expires)
+        fprintf(f, " expires=%ld", (long)z->z_expires);
+    }
+    for(dsl = z->z_dsl; dsl; dsl = dsl->dsl_next)
+      fprintf(f, " %s:%s",
+              dsl->dsl_ds->ds_type->dst_name, dsl->dsl_ds->ds_spec);
+    fprintf(f, "\n");
+  }
+  pthread_mutex_unlock(&ctllock);
+}
 
-  q = recvfrom(fd, (void*)pkt.p_buf, sizeof(pkt.p_buf), 0,
-               (struct sockaddr *)&peer_sa, &salen);
-  if (q <= 0)			/* interrupted? */
+static void ctl_datasets(FILE *f) {
+  pthread_mutex_lock(&ctllock);
+  listdatasets(f);
+  pthread_mutex_unlock(&ctllock);
+}
+
+static void ctl_hits(FILE *f) {
+#ifndef NO_STATS
+  pthread_mutex_lock(&ctllock);
+  listallhits(f);
+  pthread_mutex_unlock(&ctllock);
+#else
+  fprintf(f, "error: statistics counters are not compiled in\n");
+#endif
+}
+
+static void ctl_clients(FILE *f) {
+#ifndef NO_STATS
+  if (!clientsfile) {
+    fprintf(f, "error: client networks are not counted (no -G)\n");
     return;
+  }
+  pthread_mutex_lock(&ctllock);
+  listallclients(f);
+  pthread_mutex_unlock(&ctllock);
+#else
+  fprintf(f, "error: statistics counters are not compiled in\n");
+#endif
+}
+
+static void ctl_dump(FILE *f, const char *arg) {
+#ifndef NO_MASTER_DUMP
+  char name[DNS_MAXDOMAIN+1];
+  const struct zone *z;
+  int n = 0;
+  pthread_mutex_lock(&ctllock);
+  for(z = zonelist; z; z = z->z_next) {
+    dns_dntop(z->z_dn, name, sizeof(name));
+    if (!*arg || strcasecmp(arg, name) == 0)
+      dumpzone(z, f), ++n;
+  }
+  pthread_mutex_unlock(&ctllock);
+  if (!n)
+    fprintf(f, "error: unknown zone %s\n", arg);
+#else
+  fprintf(f, "error: master-format dump isn't compiled in\n");
+#endif
+}
+
+/* execute one command line, writing the reply to f */
+static void ctl_command(FILE *f, char *cmd) {
+  char *arg = cmd + strcspn(cmd, " \t");
+  if (*arg)
+    for(*arg++ = '\0'; *arg == ' ' || *arg == '\t'; ++arg)
+      ;
+  if (strcmp(cmd, "reload") == 0)
+    ctl_reload(f, arg);
+  else if (strcmp(cmd, "stats") == 0)
+    ctl_stats(f);
+  else if (strcmp(cmd, "zones") == 0)
+    ctl_zones(f);
+  else if (strcmp(cmd, "datasets") == 0)
+    ctl_datasets(f);
+  else if (strcmp(cmd, "hits") == 0)
+    ctl_hits(f);
+  else if (strcmp(cmd, "clients") == 0)
+    ctl_clients(f);
+  else if (strcmp(cmd, "dump") == 0)
+    ctl_dump(f, arg);
+  else
+    fprintf(f, "error: unknown command, expected "
+               "reload [type:spec], stats, zones, datasets, hits, "
+               "clients or dump [zone]\n");
+}
+
+/* accept next connection on lfd, with timeouts set */
+static int ctlaccept(int lfd) {
+  struct timeval tv;
+  int fd;
+  while((fd = accept(lfd, NULL, NULL)) < 0)
+    if (errno != EINTR && errno != ECONNABORTED)
+      sleep(1);	/* out of fds or such, do not spin */
+  tv.tv_sec = CTL_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void*)&tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (void*)&tv, sizeof(tv));
+  return fd;
+}
+
+/* write the whole buffer out, return 0 on errors */
+static int ctlwrite(int fd, const char *p, size_t len) {
+  size_t l;
+  int r;
+  for(l = 0; l < len; l += r)
+    if ((r = write(fd, p + l, len - l)) <= 0)
+      return 0;
+  return 1;
+}
+
+static void ctlclose(int fd) {
+  /* worker processes forked meanwhile (-P, -f) have the fd too */
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+}
+
+static void *ctlthread(void UNUSED *arg) {
+  char buf[1024];
+  char *out;
+  size_t outlen, l;
+  FILE *f;
+  int fd, r;
+
+  for(;;) {
+    fd = ctlaccept(ctlfd);
+    /* one command line, terminated by newline or end of input */
+    for(l = 0; l < sizeof(buf) - 1 && (l == 0 || buf[l-1] != '\n'); l += r)
+      if ((r = read(fd, buf + l, sizeof(buf) - 1 - l)) <= 0)
+        break;
+    while(l && (buf[l-1] == '\n' || buf[l-1] == '\r'))
+      --l;
+    buf[l] = '\0';
+    out = NULL;
+    outlen = 0;
+    if (l && (f = open_memstream(&out, &outlen)) != NULL) {
+      ctl_command(f, buf);
+      if (fclose(f) != 0)
+        outlen = 0;
+    }
+    ctlwrite(fd, out, outlen);
+    ctlclose(fd);
+    free(out);
+  }
+  return NULL;
+}
+
+/* Metrics listener (-H).  Another thread answers HTTP GET /metrics
+ * with counters, reload results, datasets and memory use in Prometheus
+ * text format, one request per connection.  Like in the control
+ * thread, zones and datasets are looked at with ctllock held and
+ * counters are summed up without locking. */
+
+#define metric(f, name, type, help) \
+  fprintf(f, "# HELP rbldnsd_" name " " help "\n" \
+             "# TYPE rbldnsd_" name " " type "\n")
+
+static void http_metrics(FILE *f) {
+  const struct zone *z;
+  char name[DNS_MAXDOMAIN+1];
+#ifndef NO_STATS
+  struct dnsstats *zs, tot;
+#endif
+
+  metric(f, "info", "gauge", "Version of rbldnsd.");
+  fprintf(f, "rbldnsd_info{version=\"");
+  fputlabel(f, version);
+  fprintf(f, "\"} 1\n");
+  metric(f, "start_time_seconds", "gauge", "Time rbldnsd was started at.");
+  fprintf(f, "rbldnsd_start_time_seconds %ld\n", (long)start_time);
 
-  pkt.p_peerlen = salen;
-  r = replypacket(&pkt, q, zonelist);
+#ifndef NO_STATS
+  /* zone list does not change after startup */
+  zs = (struct dnsstats *)malloc((numzones + 1) * sizeof(*zs));
+  if (zs) {
+    ctl_sumstats(&tot, 0);
+    for(z = zonelist; z; z = z->z_next) {
+      ctl_sumstats(&zs[z->z_sidx], z->z_sidx);
+#define add(x) tot.x += zs[z->z_sidx].x
+      add(b_in); add(b_out);
+      add(q_ok); add(q_nxd); add(q_err);
+#undef add
+      addqstats(&tot, &zs[z->z_sidx]);
+    }
+#define C "%" PRI_DNSCNT "\n"
+    metric(f, "stats_reset_time_seconds", "gauge",
+           "Time statistics counters were last reset at.");
+    fprintf(f, "rbldnsd_stats_reset_time_seconds %ld\n", (long)stats_time);
+    metric(f, "queries_total", "counter", "Queries received, by reply.");
+    fprintf(f, "rbldnsd_queries_total{result=\"ok\"} " C
+               "rbldnsd_queries_total{result=\"nxdomain\"} " C
+               "rbldnsd_queries_total{result=\"error\"} " C,
+            tot.q_ok, tot.q_nxd, tot.q_err);
+    metric(f, "bytes_total", "counter", "Bytes of queries and replies.");
+    fprintf(f, "rbldnsd_bytes_total{direction=\"in\"} " C
+               "rbldnsd_bytes_total{direction=\"out\"} " C,
+            tot.b_in, tot.b_out);
+    if (cachesize) {
+      metric(f, "cache_total", "counter", "Answer cache lookups and evictions.");
+      fprintf(f, "rbldnsd_cache_total{event=\"hit\"} " C
+                 "rbldnsd_cache_total{event=\"miss\"} " C
+                 "rbldnsd_cache_total{event=\"eviction\"} " C,
+              tot.c_hit, tot.c_miss, tot.c_evict);
+    }
+    metric(f, "queries_by_type_total", "counter", "Queries, by type.");
+    fprintf(f, "rbldnsd_queries_by_type_total{type=\"a\"} " C
+               "rbldnsd_queries_by_type_total{type=\"txt\"} " C
+               "rbldnsd_queries_by_type_total{type=\"any\"} " C
+               "rbldnsd_queries_by_type_total{type=\"other\"} " C,
+            tot.t_a, tot.t_txt, tot.t_any, tot.t_other);
+    metric(f, "queries_by_edns_total", "counter",
+           "Queries, with and without EDNS0.");
+    fprintf(f, "rbldnsd_queries_by_edns_total{edns=\"yes\"} " C
+               "rbldnsd_queries_by_edns_total{edns=\"no\"} " C,
+            tot.e_edns, tot.e_plain);
+    metric(f, "error_replies_total", "counter", "Error replies, by rcode.");
+    fprintf(f, "rbldnsd_error_replies_total{rcode=\"servfail\"} " C
+               "rbldnsd_error_replies_total{rcode=\"notimpl\"} " C
+               "rbldnsd_error_replies_total{rcode=\"refused\"} " C,
+            tot.r_servfail, tot.r_notimpl, tot.r_refused);
+    metric(f, "truncated_replies_total", "counter",
+           "Replies some data did not fit into.");
+    fprintf(f, "rbldnsd_truncated_replies_total " C, tot.r_trunc);
+    metric(f, "acl_total", "counter", "ACL lookups, by action.");
+    fprintf(f, "rbldnsd_acl_total{action=\"ignore\"} " C
+               "rbldnsd_acl_total{action=\"refuse\"} " C
+               "rbldnsd_acl_total{action=\"empty\"} " C
+               "rbldnsd_acl_total{action=\"always\"} " C
+               "rbldnsd_acl_total{action=\"pass\"} " C,
+            tot.a_ignore, tot.a_refuse, tot.a_empty, tot.a_always, tot.a_pass);
+#define Z(metric, label, x) \
+    for(z = zonelist; z; z = z->z_next) { \
+      dns_dntop(z->z_dn, name, sizeof(name)); \
+      fprintf(f, "rbldnsd_" metric "{zone=\""); \
+      fputlabel(f, name); \
+      fprintf(f, "\"" label "} " C, zs[z->z_sidx].x); \
+    }
+    metric(f, "zone_queries_total", "counter",
+           "Queries received for a zone, by reply.");
+    Z("zone_queries_total", ",result=\"ok\"", q_ok);
+    Z("zone_queries_total", ",result=\"nxdomain\"", q_nxd);
+    Z("zone_queries_total", ",result=\"error\"", q_err);
+    metric(f, "zone_bytes_total", "counter",
+           "Bytes of queries and replies for a zone.");
+    Z("zone_bytes_total", ",direction=\"in\"", b_in);
+    Z("zone_bytes_total", ",direction=\"out\"", b_out);
+    metric(f, "zone_queries_by_type_total", "counter",
+           "Queries for a zone, by type.");
+    Z("zone_queries_by_type_total", ",type=\"a\"", t_a);
+    Z("zone_queries_by_type_total", ",type=\"txt\"", t_txt);
+    Z("zone_queries_by_type_total", ",type=\"any\"", t_any);
+    Z("zone_queries_by_type_total", ",type=\"other\"", t_other);
+    metric(f, "zone_queries_by_edns_total", "counter",
+           "Queries for a zone, with and without EDNS0.");
+    Z("zone_queries_by_edns_total", ",edns=\"yes\"", e_edns);
+    Z("zone_queries_by_edns_total", ",edns=\"no\"", e_plain);
+    metric(f, "zone_error_replies_total", "counter",
+           "Error replies for a zone, by rcode.");
+    Z("zone_error_replies_total", ",rcode=\"servfail\"", r_servfail);
+    Z("zone_error_replies_total", ",rcode=\"notimpl\"", r_notimpl);
+    Z("zone_error_replies_total", ",rcode=\"refused\"", r_refused);
+    metric(f, "zone_truncated_replies_total", "counter",
+           "Replies for a zone some data did not fit into.");
+    Z("zone_truncated_replies_total", "", r_trunc);
+    metric(f, "zone_acl_total", "counter",
+           "Zone ACL lookups, by action.");
+    Z("zone_acl_total", ",action=\"ignore\"", a_ignore);
+    Z("zone_acl_total", ",action=\"refuse\"", a_refuse);
+    Z("zone_acl_total", ",action=\"empty\"", a_empty);
+    Z("zone_acl_total", ",action=\"always\"", a_always);
+    Z("zone_acl_total", ",action=\"pass\"", a_pass);
+#undef Z
+#undef C
+    free(zs);
+  }
+#endif
+
+  pthread_mutex_lock(&ctllock);
+  metric(f, "reloads_total", "counter", "Data reloads, by result.");
+  fprintf(f, "rbldnsd_reloads_total{result=\"ok\"} %lu\n"
+             "rbldnsd_reloads_total{result=\"failed\"} %lu\n",
+          reloads[1], reloads[0]);
+  metric(f, "last_reload_time_seconds", "gauge",
+         "Time the last reload finished at.");
+  fprintf(f, "rbldnsd_last_reload_time_seconds %ld\n", (long)reload_time);
+  metric(f, "last_reload_success", "gauge",
+         "Whether all data was loaded by the last reload.");
+  fprintf(f, "rbldnsd_last_reload_success %d\n", reload_ok);
+  metric(f, "last_reload_duration_seconds", "gauge",
+         "How long the last reload took.");
+  fprintf(f, "rbldnsd_last_reload_duration_seconds %lu.%03lu\n",
+          reload_msec / 1000, reload_msec % 1000);
+  metric(f, "zone_timestamp_seconds", "gauge",
+         "Timestamp of zone data, 0 if the zone is not serviced.");
+  for(z = zonelist; z; z = z->z_next) {
+    dns_dntop(z->z_dn, name, sizeof(name));
+    fprintf(f, "rbldnsd_zone_timestamp_seconds{zone=\"");
+    fputlabel(f, name);
+    fprintf(f, "\"} %u\n", z->z_stamp);
+  }
+  metricdatasets(f);
+  pthread_mutex_unlock(&ctllock);
+
+#ifndef NO_MEMINFO
+  {
+    struct meminfo mi;
+    meminfo(&mi);
+    metric(f, "malloc_bytes", "gauge", "Memory allocated by malloc.");
+    fprintf(f, "rbldnsd_malloc_bytes{kind=\"arena\"} %lu\n"
+               "rbldnsd_malloc_bytes{kind=\"free\"} %lu\n"
+               "rbldnsd_malloc_bytes{kind=\"mmap\"} %lu\n",
+            mi.arena, mi.free, mi.mmap);
+  }
+#endif
+}
+
+#undef metric
+
+#define HTTP_MAXREQ 4096	/* max size of request line and headers */
+
+static void *httpthread(void UNUSED *arg) {
+  char buf[HTTP_MAXREQ], hdr[256], *p, *out;
+  const char *status;
+  size_t outlen, l;
+  FILE *f;
+  int fd, r, head;
+
+  for(;;) {
+    fd = ctlaccept(httpfd);
+    /* read up to the empty line ending the headers */
+    for(l = 0; l < sizeof(buf) - 1; l += r) {
+      if ((r = read(fd, buf + l, sizeof(buf) - 1 - l)) <= 0)
+        break;
+      buf[l + r] = '\0';
+      if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+        l += r;
+        break;
+      }
+    }
+    buf[l] = '\0';
+    head = strncmp(buf, "HEAD ", 5) == 0;
+    p = buf + (head ? 5 : 4);
+    out = NULL;
+    outlen = 0;
+    if (!head && strncmp(buf, "GET ", 4) != 0)
+      status = "405 Method Not Allowed";
+    else if (strncmp(p, "/metrics", 8) != 0 || !strchr(" ?\r\n", p[8]))
+      status = "404 Not Found";
+    else if (!(f = open_memstream(&out, &outlen)))
+      status = "500 Internal Server Error";
+    else {
+      http_metrics(f);
+      status = fclose(f) == 0 ? "200 OK" : "500 Internal Server Error";
+    }
+    if (*status != '2')
+      outlen = 0;
+    r = ssprintf(hdr, sizeof(hdr),
+                 "HTTP/1.0 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                 "Content-Length: %lu\r\n"
+                 "Connection: close\r\n\r\n",
+                 status, (unsigned long)outlen);
+    if (ctlwrite(fd, hdr, r) && !head)
+      ctlwrite(fd, out, outlen);
+    ctlclose(fd);
+    free(out);
+  }
+  return NULL;
+}
+
+static void startctl(void *(*fn)(void *), const char *what) {
+  pthread_t t;
+  sigset_t ss, oss;
+  sigfillset(&ss);
+  pthread_sigmask(SIG_SETMASK, &ss, &oss);
+  if ((errno = pthread_create(&t, NULL, fn, NULL)) != 0)
+    error(errno, "unable to create %s thread", what);
+  pthread_sigmask(SIG_SETMASK, &oss, NULL);
+}
+
+#endif /* NO_THREADS */
+
+/* log a query, called with the worker locked */
+static void logquery(struct worker UNUSED *w, const struct dnspacket *pkt) {
+#ifndef NO_THREADS
+  if (logsample)
+    logasync(w, pkt);
+  else
+#endif
+  logreply(pkt, flog, flushlog);
+}
+
+#ifndef NO_STATS
+
+/* Query latency, from receipt of a query till its reply is sent, goes
+ * to the histogram of the zone replied for (rbldnsd.h).  Receipt time is
+ * taken from the kernel timestamp if the socket gives one (see
+ * setrxstamp()), or read when the query is read.  Histograms are
+ * updated after the reply is sent, that is, without the worker lock,
+ * so a reset (SIGUSR2) may miss a query or two being answered. */
+
+static void rxstamp(struct timespec *ts, struct msghdr *msg) {
+#ifdef SO_TIMESTAMPNS
+  struct cmsghdr *cm;
+  for(cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(ts, CMSG_DATA(cm), sizeof(*ts));
+      return;
+    }
+#endif
+  clock_gettime(CLOCK_REALTIME, ts);
+}
+
+#define txstamp(ts) clock_gettime(CLOCK_REALTIME, ts)
+
+static void latency(const struct dnspacket *pkt,
+                    const struct timespec *rx, const struct timespec *tx) {
+  long s = tx->tv_sec - rx->tv_sec, usec;
+  unsigned b, e;
+  if (s > 100)		/* way above the last bucket */
+    s = 100;
+  usec = s * 1000000L + (tx->tv_nsec - rx->tv_nsec) / 1000;
+  if (usec < LAT_SUB)	/* clock stepped back if negative */
+    b = usec < 0 ? 0 : usec;
+  else if (usec >> LAT_MAXBITS)
+    b = LAT_NBUCKETS - 1;
+  else {
+    for(e = LAT_SUBBITS; usec >> (e + 1); ++e)
+      ;
+    b = (e - LAT_SUBBITS + 1) * LAT_SUB +
+        ((usec >> (e - LAT_SUBBITS)) & (LAT_SUB - 1));
+  }
+  pkt->p_stats[pkt->p_sidx].l_hist[b] += 1;
+}
+
+#else
+# define rxstamp(ts, msg)
+# define txstamp(ts)
+# define latency(pkt, rx, tx)
+#endif
+
+/* receive and answer one query, return <= 0 if nothing is received */
+static int request(struct worker *w, int fd, int flags) {
+  int q, r;
+  struct dnspacket *pkt = &w->w_pkt;
+  struct msghdr msg;
+  struct iovec iov;
+#ifndef NO_STATS
+  union rxctl ctl;
+  struct timespec rx, tx;
+#endif
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &w->w_peer_sa;
+  msg.msg_namelen = sizeof(w->w_peer_sa);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  iov.iov_base = pkt->p_buf;
+  iov.iov_len = pkt->p_bufsz;
+#ifndef NO_STATS
+  msg.msg_control = &ctl;
+  msg.msg_controllen = sizeof(ctl);
+#endif
+  q = recvmsg(fd, &msg, flags);
+  if (q <= 0)			/* interrupted? */
+    return q;
+  rxstamp(&rx, &msg);
+
+  pkt->p_peerlen = msg.msg_namelen;
+  lockworker(w);
+  r = replypacket(pkt, q, zonelist);
+  if (r && logging())
+    logquery(w, pkt);
+  unlockworker(w);
   if (!r)
-    return;
-  if (flog)
-    logreply(&pkt, flog, flushlog);
+    return q;
 
   /* finally, send a reply */
-  while(sendto(fd, (void*)pkt.p_buf, r, 0,
-               (struct sockaddr *)&peer_sa, salen) < 0)
+  while(sendto(fd, (void*)pkt->p_buf, r, 0,
+               (struct sockaddr *)&w->w_peer_sa, msg.msg_namelen) < 0)
     if (errno != EINTR) break;
+  txstamp(&tx);
+  latency(pkt, &rx, &tx);
 
+  return q;
 }
 
-int main(int argc, char **argv) {
-  init(argc, argv);
-  setup_signals();
-  reopenlog();
-#ifdef HAVE_SETITIMER
-  if (recheck) {
-    struct itimerval itv;
-    itv.it_interval.tv_sec  = itv.it_value.tv_sec  = recheck;
-    itv.it_interval.tv_usec = itv.it_value.tv_usec = 0;
-    if (setitimer(ITIMER_REAL, &itv, NULL) < 0)
-      error(errno, "unable to setitimer()");
+#ifdef HAVE_RECVMMSG
+
+/* batched variant of request(): receive up to `batch' packets with
+ * one recvmmsg(), construct replies in separate buffers, and send
+ * them all back with one sendmmsg().
+ */
+
+static void init_batch(struct worker *w) {
+  unsigned i;
+  struct rqslot *rqs;
+  rqs = w->w_rqs = (struct rqslot *)emalloc(batch * sizeof(*rqs));
+  w->w_rmsgs = (struct mmsghdr *)ezalloc(batch * sizeof(*w->w_rmsgs));
+  w->w_smsgs = (struct mmsghdr *)ezalloc(batch * sizeof(*w->w_smsgs));
+  w->w_riov = (struct iovec *)emalloc(batch * sizeof(*w->w_riov));
+  w->w_siov = (struct iovec *)emalloc(batch * sizeof(*w->w_siov));
+  for(i = 0; i < batch; ++i) {
+    rqs[i].pkt.p_buf = rqs[i].buf;
+    rqs[i].pkt.p_bufsz = sizeof(rqs[i].buf);
+    rqs[i].pkt.p_peer = (struct sockaddr *)&rqs[i].sa;
+    rqs[i].pkt.p_cache = w->w_cache;
+#ifndef NO_STATS
+    rqs[i].pkt.p_stats = w->w_stats;
+    rqs[i].pkt.p_hits = w->w_hits;
+    rqs[i].pkt.p_clients = w->w_clients;
+#endif
+    w->w_riov[i].iov_base = rqs[i].pkt.p_buf;
+    w->w_riov[i].iov_len = sizeof(rqs[i].buf);
+    w->w_rmsgs[i].msg_hdr.msg_name = &rqs[i].sa;
+    w->w_rmsgs[i].msg_hdr.msg_iov = &w->w_riov[i];
+    w->w_rmsgs[i].msg_hdr.msg_iovlen = 1;
+#ifndef NO_STATS
+    w->w_rmsgs[i].msg_hdr.msg_control = &rqs[i].ctl;
+#endif
+    w->w_smsgs[i].msg_hdr.msg_iov = &w->w_siov[i];
+    w->w_smsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+static int request_batch(struct worker *w, int fd, int flags) {
+  int q, n, i, r;
+  struct rqslot *rq;
+  struct mmsghdr *rmsgs = w->w_rmsgs, *smsgs = w->w_smsgs;
+#ifndef NO_STATS
+  struct timespec tx;
+#endif
+
+  for(i = 0; i < (int)batch; ++i) {
+    rmsgs[i].msg_hdr.msg_namelen = sizeof(w->w_rqs[i].sa);
+    rmsgs[i].msg_hdr.msg_controllen = RXCTLSIZE;
+  }
+  q = recvmmsg(fd, rmsgs, batch, flags, NULL);
+  if (q <= 0)			/* interrupted? */
+    return q;
+
+  lockworker(w);
+#ifndef NO_STATS
+  w->w_cnt->wc_batches += 1;
+  w->w_cnt->wc_packets += q;
+#endif
+  for(i = n = 0; i < q; ++i) {
+    rq = &w->w_rqs[i];
+    rxstamp(&rq->rx, &rmsgs[i].msg_hdr);
+    rq->pkt.p_peerlen = rmsgs[i].msg_hdr.msg_namelen;
+    r = replypacket(&rq->pkt, rmsgs[i].msg_len, zonelist);
+    if (!r) {
+      rmsgs[i].msg_len = 0;	/* no reply, see below */
+      continue;
+    }
+    if (logging())
+      logquery(w, &rq->pkt);
+    w->w_siov[n].iov_base = rq->pkt.p_buf;
+    w->w_siov[n].iov_len = r;
+    smsgs[n].msg_hdr.msg_name = &rq->sa;
+    smsgs[n].msg_hdr.msg_namelen = rq->pkt.p_peerlen;
+    ++n;
   }
+  unlockworker(w);
+
+  /* finally, send all the replies.  sendmmsg() only returns an error
+   * if the very first packet can not be sent, skip it in this case */
+  for(i = 0; i < n; )
+    if ((r = sendmmsg(fd, smsgs + i, n - i, 0)) > 0)
+      i += r;
+    else if (r == 0 || errno != EINTR)
+      ++i;
+#ifndef NO_STATS
+  txstamp(&tx);
+  for(i = 0; i < q; ++i)
+    if (rmsgs[i].msg_len)
+      latency(&w->w_rqs[i].pkt, &w->w_rqs[i].rx, &tx);
+#endif
+
+  return q;
+}
+
+/* single socket: block for the first packet only.
+ * several sockets: socket is known to be readable, do not block at all */
+# define serve(w, fd, flags) (batch > 1 ? \
+  request_batch(w, fd, flags) : request(w, fd, (flags) & MSG_DONTWAIT))
 #else
-  alarm(recheck);
+# define serve(w, fd, flags) request(w, fd, (flags) & MSG_DONTWAIT)
 #endif
+
+#define LOAD_DRAIN 256	/* max # of queries from a socket per yield */
+
+/* answer queries waiting on main worker sockets, called by the loader
+ * every -Q msec.  Data being loaded is not visible to queries yet */
+static void loadyield(void) {
+  int i, c;
+  for(i = 0; i < numsock; ++i)
+    for(c = LOAD_DRAIN;
+        c && serve(workers, workers->w_sock[i], MSG_DONTWAIT) > 0; --c)
+      ;
+}
+
+#ifdef HAVE_IO_URING
+
+/* io_uring event loop (-U).  A multishot recvmsg request is kept armed
+ * on every socket of a worker, incoming queries land in a ring of
+ * buffers provided to the kernel, and replies are queued as sendmsg
+ * requests, so that a whole bunch of queries and replies costs a single
+ * io_uring_enter() system call.  Raw system calls are used, so there's
+ * no dependency on liburing.
+ */
+
+#define UR_ENTRIES	512	/* submission queue size */
+#define UR_NBUFS	256	/* number of receive buffers, power of 2 */
+#define UR_NSLOTS	512	/* number of reply slots */
+#define UR_BUFSZ	(sizeof(struct io_uring_recvmsg_out) + \
+			 sizeof(struct sockaddr_storage) + RXCTLSIZE + \
+			 DNS_EDNS0_MAXPACKET)
+#define UR_SEND		0x10000	/* user_data flag: reply slot, not socket */
+
+#define ur_load(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ur_store(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct urslot {		/* reply being sent */
+  struct dnspacket pkt;
+  unsigned char buf[DNS_EDNS0_MAXPACKET];
+  struct sockaddr_storage sa;
+  struct msghdr msg;
+  struct iovec iov;
 #ifndef NO_STATS
-  stats_time = time(NULL);
-  if (statsfile)
-    dumpstats_z();
+  struct timespec rx;		/* when the query was received */
+#endif
+};
+
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+  unsigned sqtail, pending;	/* local SQ tail, # of SQEs to submit */
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *br;	/* provided buffers ring */
+  unsigned short brtail;
+  unsigned char *bufs;		/* UR_NBUFS receive buffers */
+  struct msghdr rmsg;		/* recvmsg template */
+  struct urslot *slots;
+  unsigned *freeslots, nfree;
+};
+
+static int
+ur_enter(struct uring *ur, unsigned submit, unsigned wait, unsigned flags) {
+  return syscall(__NR_io_uring_enter, ur->fd, submit, wait, flags, NULL, 0);
+}
+
+static int ur_init(struct uring *ur, struct worker *w) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  unsigned char *ring;
+  unsigned size, i;
+
+  memset(ur, 0, sizeof(*ur));
+  memset(&p, 0, sizeof(p));
+  /* we're the only thread using the ring, and always wait for events */
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  ur->fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+  if (ur->fd < 0 && errno == EINVAL) {	/* older kernel */
+    memset(&p, 0, sizeof(p));
+    ur->fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+  }
+  if (ur->fd < 0)
+    return 0;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    errno = ENOSYS;
+    goto fail;
+  }
+
+  size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  i = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (size < i)
+    size = i;
+  ring = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+              ur->fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED)
+    goto fail;
+  ur->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED)
+    goto fail;
+  ur->sq_head = (unsigned *)(ring + p.sq_off.head);
+  ur->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+  ur->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+  ur->sq_entries = p.sq_entries;
+  ur->sqtail = *ur->sq_tail;
+  for(i = 0; i < p.sq_entries; ++i)	/* SQEs are used in order */
+    ((unsigned *)(ring + p.sq_off.array))[i] = i;
+  ur->cq_head = (unsigned *)(ring + p.cq_off.head);
+  ur->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  ur->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+  /* provided buffers for multishot recvmsg, group 0 */
+  ur->br = mmap(NULL, UR_NBUFS * sizeof(struct io_uring_buf),
+                PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (ur->br == MAP_FAILED)
+    goto fail;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)ur->br;
+  reg.ring_entries = UR_NBUFS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, ur->fd,
+              IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    goto fail;
+  ur->bufs = (unsigned char *)emalloc(UR_NBUFS * UR_BUFSZ);
+  for(i = 0; i < UR_NBUFS; ++i) {
+    struct io_uring_buf *b = &ur->br->bufs[i];
+    b->addr = (unsigned long)(ur->bufs + i * UR_BUFSZ);
+    b->len = UR_BUFSZ;
+    b->bid = i;
+  }
+  ur->brtail = UR_NBUFS;
+  ur_store(&ur->br->tail, ur->brtail);
+
+  /* only sizes of name and control are used by multishot recvmsg */
+  ur->rmsg.msg_namelen = sizeof(struct sockaddr_storage);
+  ur->rmsg.msg_controllen = RXCTLSIZE;
+
+  ur->slots = (struct urslot *)emalloc(UR_NSLOTS * sizeof(struct urslot));
+  ur->freeslots = (unsigned *)emalloc(UR_NSLOTS * sizeof(unsigned));
+  for(i = 0; i < UR_NSLOTS; ++i) {
+    struct urslot *s = &ur->slots[i];
+    s->pkt.p_buf = s->buf;
+    s->pkt.p_bufsz = sizeof(s->buf);
+    s->pkt.p_peer = (struct sockaddr *)&s->sa;
+    s->pkt.p_cache = w->w_cache;
+#ifndef NO_STATS
+    s->pkt.p_stats = w->w_stats;
+    s->pkt.p_hits = w->w_hits;
+    s->pkt.p_clients = w->w_clients;
+#endif
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_name = &s->sa;
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    s->iov.iov_base = s->pkt.p_buf;
+    ur->freeslots[i] = i;
+  }
+  ur->nfree = UR_NSLOTS;
+  return 1;
+
+fail:
+  i = errno;
+  close(ur->fd);
+  errno = i;
+  return 0;
+}
+
+/* get next free SQE, submitting queued ones if the queue is full */
+static struct io_uring_sqe *ur_sqe(struct uring *ur) {
+  struct io_uring_sqe *sqe;
+  while (ur->sqtail - ur_load(ur->sq_head) >= ur->sq_entries) {
+    int r = ur_enter(ur, ur->pending, 0, 0);
+    if (r > 0)
+      ur->pending -= r;
+  }
+  sqe = &ur->sqes[ur->sqtail & ur->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ur_store(ur->sq_tail, ++ur->sqtail);
+  ++ur->pending;
+  return sqe;
+}
+
+static void ur_recv(struct uring *ur, unsigned i, int fd) {
+  struct io_uring_sqe *sqe = ur_sqe(ur);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)&ur->rmsg;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = i;
+}
+
+/* handle one received packet in buffer bid */
+static void
+ur_query(struct worker *w, struct uring *ur, unsigned bid, unsigned len,
+         int fd) {
+  unsigned char *buf = ur->bufs + bid * UR_BUFSZ;
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+  unsigned char *name = buf + sizeof(*out);
+  unsigned char *data = name + ur->rmsg.msg_namelen + ur->rmsg.msg_controllen;
+  struct io_uring_sqe *sqe;
+  struct urslot *s;
+  unsigned n;
+  int r;
+#ifndef NO_STATS
+  struct msghdr msg;
+#endif
+
+  if (len < (unsigned)(data - buf) ||
+      out->namelen > ur->rmsg.msg_namelen ||
+      (out->flags & MSG_TRUNC) || !ur->nfree)
+    return;			/* drop it */
+  n = ur->freeslots[--ur->nfree];
+  s = &ur->slots[n];
+#ifndef NO_STATS
+  /* control data follows the name, as a msghdr would point to it */
+  msg.msg_control = name + ur->rmsg.msg_namelen;
+  msg.msg_controllen = out->controllen;
+  rxstamp(&s->rx, &msg);
+#endif
+  memcpy(s->pkt.p_buf, data, out->payloadlen);
+  memcpy(&s->sa, name, out->namelen);
+  s->pkt.p_peerlen = out->namelen;
+  r = replypacket(&s->pkt, out->payloadlen, zonelist);
+  if (!r) {
+    ur->freeslots[ur->nfree++] = n;
+    return;
+  }
+  if (logging())
+    logquery(w, &s->pkt);
+  s->msg.msg_namelen = s->pkt.p_peerlen;
+  s->iov.iov_len = r;
+  sqe = ur_sqe(ur);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)&s->msg;
+  sqe->user_data = UR_SEND | n;
+}
+
+/* serve queries using io_uring.  Returns only if io_uring can not be
+ * used, in which case the caller falls back to the regular loop */
+static void uring_loop(struct worker *w, int sigs) {
+  struct uring ur;
+  struct io_uring_cqe *cqe;
+  unsigned head, tail, i;
+  int r;
+#ifndef NO_STATS
+  struct timespec tx;
+#endif
+
+  if (!ur_init(&ur, w)) {
+    dslog(LOG_WARNING, 0, "io_uring is not available (%s), using %s",
+          strerror(errno), numsock > 1 ? "poll()" : "recv()");
+    return;
+  }
+  for(i = 0; i < (unsigned)numsock; ++i)
+    ur_recv(&ur, i, w->w_sock[i]);
+
+  for(;;) {
+    if (sigs && signalled) do_signalled();
+    r = ur_enter(&ur, ur.pending, 1, IORING_ENTER_GETEVENTS);
+    if (r > 0)
+      ur.pending -= r;
+    else if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      break;
+
+    head = *ur.cq_head;
+    tail = ur_load(ur.cq_tail);
+    if (head == tail)
+      continue;
+    txstamp(&tx);
+    lockworker(w);
+    for(; head != tail; ++head) {
+      cqe = &ur.cqes[head & ur.cq_mask];
+      i = (unsigned)cqe->user_data;
+      if (i & UR_SEND) {	/* reply sent, free the slot */
+        i &= ~UR_SEND;
+        latency(&ur.slots[i].pkt, &ur.slots[i].rx, &tx);
+        ur.freeslots[ur.nfree++] = i;
+        continue;
+      }
+      if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        r = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ur_query(w, &ur, r, cqe->res, w->w_sock[i]);
+        /* give the buffer back to the kernel */
+        ur.br->bufs[ur.brtail & (UR_NBUFS-1)].addr =
+          (unsigned long)(ur.bufs + r * UR_BUFSZ);
+        ur.br->bufs[ur.brtail & (UR_NBUFS-1)].len = UR_BUFSZ;
+        ur.br->bufs[ur.brtail & (UR_NBUFS-1)].bid = r;
+        ++ur.brtail;
+      }
+      else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR) {
+        /* most likely multishot recvmsg is not supported */
+        errno = -cqe->res;
+        break;
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE))	/* re-arm it */
+        ur_recv(&ur, i, w->w_sock[i]);
+    }
+    ur_store(ur.cq_head, head);
+    ur_store(&ur.br->tail, ur.brtail);
+    unlockworker(w);
+    if (head != tail)
+      break;
+  }
+
+  /* io_uring does not work.  Buffers are not freed since the kernel
+   * may still refer to them until the ring is torn down */
+  dslog(LOG_WARNING, 0, "io_uring error (%s), using %s instead",
+        strerror(errno), numsock > 1 ? "poll()" : "recv()");
+  close(ur.fd);
+}
+
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_EPOLL
+
+/* epoll event loop.  For the worker handling signals, signals are read
+ * from a signalfd and periodic checks are driven by a timerfd instead of
+ * SIGALRM, so system calls in the query path are never interrupted.
+ * Every readable socket is drained until EAGAIN (or EV_DRAIN reads).
+ * Returns only if epoll can not be used. */
+static void epoll_loop(struct worker *w, int sigs) {
+  struct epoll_event ev, evs[MAXSOCK + 4];
+  int efd, sfd = -1, tfd = -1;
+#ifdef HAVE_INOTIFY
+  int dfd = -1;
+  struct itimerspec dts;
+#endif
+  int i, n;
+  sigset_t ss;
+
+#define EV_SIGNAL MAXSOCK	/* data.u32 for signalfd */
+#define EV_TIMER (MAXSOCK+1)	/* data.u32 for timerfd */
+#define EV_WATCH (MAXSOCK+2)	/* data.u32 for inotify fd */
+#define EV_DELAY (MAXSOCK+3)	/* data.u32 for WATCH_DELAY timerfd */
+#define EV_DRAIN 1024		/* max # of reads from a socket in a row */
+
+  efd = epoll_create1(0);
+  if (efd < 0)
+    return;
+  ev.events = EPOLLIN;
+  for(i = 0; i < numsock; ++i) {
+    ev.data.u32 = i;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, w->w_sock[i], &ev) < 0)
+      error(errno, "epoll_ctl() failed");
+  }
+
+  if (sigs) {
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGHUP);
+    sigaddset(&ss, SIGALRM);
+#ifndef NO_STATS
+    sigaddset(&ss, SIGUSR1);
+    sigaddset(&ss, SIGUSR2);
+#endif
+    sigaddset(&ss, SIGTERM);
+    sigaddset(&ss, SIGINT);
+#ifndef NO_THREADS
+    if (ctlfd >= 0)
+      sigaddset(&ss, SIGCTL);
+#endif
+    sfd = signalfd(-1, &ss, SFD_NONBLOCK);
+    if (sfd < 0)
+      error(errno, "unable to create signalfd");
+    ev.data.u32 = EV_SIGNAL;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) < 0)
+      error(errno, "epoll_ctl() failed");
+    /* keep these signals blocked, do_signalled() included */
+    ssrun = ss;
+    for(i = 1; i < NSIG; ++i)
+      if (sigismember(&ss, i))
+        sigaddset(&ssblock, i);
+    sigprocmask(SIG_SETMASK, &ssrun, NULL);
+
+    if (recheck && fork_on_reload >= 0) {
+      struct itimerspec its;
+      tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+      if (tfd < 0)
+        error(errno, "unable to create timerfd");
+      its.it_interval.tv_sec = its.it_value.tv_sec = recheck;
+      its.it_interval.tv_nsec = its.it_value.tv_nsec = 0;
+      if (timerfd_settime(tfd, 0, &its, NULL) < 0)
+        error(errno, "unable to set timerfd");
+      ev.data.u32 = EV_TIMER;
+      if (epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+        error(errno, "epoll_ctl() failed");
+      setalarm(0);	/* timerfd replaces SIGALRM */
+    }
+
+#ifdef HAVE_INOTIFY
+    /* changes of data files trigger a reload WATCH_DELAY msec after
+     * the last one; periodic checks above are still done, in case
+     * anything is missed.  Not used with -f */
+    if (recheck && !fork_on_reload && (wfd = watchdatasets()) >= 0) {
+      dfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+      if (dfd < 0)
+        error(errno, "unable to create timerfd");
+      memset(&dts, 0, sizeof(dts));
+      dts.it_value.tv_nsec = WATCH_DELAY * 1000000;
+      ev.data.u32 = EV_WATCH;
+      if (epoll_ctl(efd, EPOLL_CTL_ADD, wfd, &ev) < 0)
+        error(errno, "epoll_ctl() failed");
+      ev.data.u32 = EV_DELAY;
+      if (epoll_ctl(efd, EPOLL_CTL_ADD, dfd, &ev) < 0)
+        error(errno, "epoll_ctl() failed");
+    }
+#endif
+  }
+
+  for(;;) {
+    if (sigs && signalled) do_signalled();
+    n = epoll_wait(efd, evs, sizeof(evs)/sizeof(evs[0]), -1);
+    for(i = 0; i < n; ++i) {
+      unsigned k = evs[i].data.u32;
+      if (k < (unsigned)numsock) {
+        /* drain the socket, but do not let a flood of queries
+         * delay signals or other sockets forever */
+        int fd = w->w_sock[k], c = EV_DRAIN;
+        while(serve(w, fd, MSG_DONTWAIT) > 0 && --c && !signalled)
+          ;
+      }
+      else if (k == EV_SIGNAL) {
+        struct signalfd_siginfo si;
+        while(read(sfd, &si, sizeof(si)) == sizeof(si))
+          sighandler(si.ssi_signo);
+      }
+      else if (k == EV_TIMER) {
+        uint64_t x;
+        /* the -f child shares the timerfd but must not reload */
+        if (read(tfd, &x, sizeof(x)) == sizeof(x) && fork_on_reload >= 0)
+          signalled |= SIGNALLED_RELOAD|SIGNALLED_SSTATS;
+      }
+#ifdef HAVE_INOTIFY
+      else if (k == EV_WATCH) {
+        if (readwatches(wfd))	/* (re)start the delay */
+          timerfd_settime(dfd, 0, &dts, NULL);
+      }
+      else if (k == EV_DELAY) {
+        uint64_t x;
+        if (read(dfd, &x, sizeof(x)) == sizeof(x))
+          signalled |= SIGNALLED_WATCH;
+      }
+#endif
+    }
+  }
+#undef EV_SIGNAL
+#undef EV_TIMER
+#undef EV_WATCH
+#undef EV_DELAY
+#undef EV_DRAIN
+}
+
+#endif /* HAVE_EPOLL */
+
+#ifndef NO_POLL
+
+/* TCP connections (-K), all served by one worker using poll().
+ * Queries may be pipelined: every complete query in the input buffer
+ * is answered in turn, until a reply can not be sent at once.  Then
+ * the rest of the reply is kept until the socket becomes writable,
+ * and no more queries are read from this connection meanwhile. */
+
+struct tcpconn {
+  int fd;			/* -1 if the slot is free */
+  time_t last;			/* time of last activity */
+  unsigned ilen;		/* bytes in ibuf */
+  unsigned char *obuf;		/* unsent part of a reply, if any */
+  unsigned opos, olen;
+#ifndef NO_IPv6
+  struct sockaddr_storage sa;
+#else
+  struct sockaddr_in sa;
+#endif
+  socklen_t salen;
+  unsigned char ibuf[2 + DNS_EDNS0_MAXPACKET]; /* length + query */
+};
+
+static int sameclient(const struct sockaddr *a, const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family)
+    return 0;
+  if (a->sa_family == AF_INET)
+    return ((const struct sockaddr_in *)a)->sin_addr.s_addr ==
+           ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+#ifndef NO_IPv6
+  if (a->sa_family == AF_INET6)
+    return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+                  &((const struct sockaddr_in6 *)b)->sin6_addr, 16) == 0;
+#endif
+  return 0;
+}
+
+static void tcp_close(struct tcpconn *c) {
+  close(c->fd);
+  c->fd = -1;
+  free(c->obuf);
+  c->obuf = NULL;
+}
+
+/* send a reply prefixed by its length, keep what can't be sent now */
+static int tcp_send(struct tcpconn *c, const unsigned char *buf, unsigned len) {
+  unsigned char pfx[2];
+  struct iovec iov[2];
+  struct msghdr msg;
+  int n;
+  pfx[0] = len >> 8; pfx[1] = len;
+  iov[0].iov_base = pfx; iov[0].iov_len = 2;
+  iov[1].iov_base = (void *)buf; iov[1].iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  n = sendmsg(c->fd, &msg, 0);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      return 0;
+    n = 0;
+  }
+  if ((unsigned)n == len + 2)
+    return 1;
+  c->olen = len + 2 - n;
+  c->opos = 0;
+  if (!(c->obuf = (unsigned char *)malloc(c->olen)))
+    return 0;
+  if (n < 2) {
+    memcpy(c->obuf, pfx + n, 2 - n);
+    memcpy(c->obuf + 2 - n, buf, len);
+  }
+  else
+    memcpy(c->obuf, buf + n - 2, c->olen);
+  return 1;
+}
+
+/* send the rest of pending reply */
+static int tcp_flush(struct tcpconn *c) {
+  int n = write(c->fd, c->obuf + c->opos, c->olen - c->opos);
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  if ((c->opos += n) == c->olen) {
+    free(c->obuf);
+    c->obuf = NULL;
+  }
+  return 1;
+}
+
+/* answer all complete queries read so far, return 0 to close */
+static int tcp_queries(struct worker *w, struct tcpconn *c) {
+  struct dnspacket *pkt = &w->w_pkt;
+  unsigned p = 0, q;
+  int r;
+#ifndef NO_STATS
+  struct timespec rx, tx;
+  txstamp(&rx);		/* queries were read just now */
+#endif
+
+  while(!c->obuf && c->ilen - p >= 2) {
+    q = ((unsigned)c->ibuf[p] << 8) | c->ibuf[p + 1];
+    if (q > sizeof(c->ibuf) - 2)
+      return 0;		/* too large query */
+    if (c->ilen - p - 2 < q)
+      break;		/* incomplete */
+    memcpy(pkt->p_buf, c->ibuf + p + 2, q);
+    p += 2 + q;
+    pkt->p_peer = (struct sockaddr *)&c->sa;
+    pkt->p_peerlen = c->salen;
+    lockworker(w);
+    r = replypacket(pkt, q, zonelist);
+    if (r && logging())
+      logquery(w, pkt);
+    unlockworker(w);
+    if (!r)
+      continue;
+    if (!tcp_send(c, pkt->p_buf, r))
+      return 0;
+    txstamp(&tx);
+    latency(pkt, &rx, &tx);
+  }
+  if (p && (c->ilen -= p) != 0)
+    memmove(c->ibuf, c->ibuf + p, c->ilen);
+  return 1;
+}
+
+static void
+tcp_accept(int lfd, struct tcpconn *conns, unsigned *nconn, time_t now) {
+  struct tcpconn *c, *fc = NULL;
+  unsigned i, n = 0;
+  int fd;
+#ifndef NO_IPv6
+  struct sockaddr_storage sa;
+#else
+  struct sockaddr_in sa;
+#endif
+  socklen_t salen = sizeof(sa);
+
+  fd = accept(lfd, (struct sockaddr *)&sa, &salen);
+  if (fd < 0)
+    return;
+  for(i = 0; i < tcp_maxconn; ++i) {
+    c = &conns[i];
+    if (c->fd < 0) {
+      if (!fc) fc = c;
+    }
+    else if (sameclient((struct sockaddr *)&c->sa, (struct sockaddr *)&sa))
+      ++n;
+  }
+  if (!fc || n >= tcp_perclient) {	/* over the limits */
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  fc->fd = fd;
+  fc->last = now;
+  fc->ilen = 0;
+  memcpy(&fc->sa, &sa, salen);
+  fc->salen = salen;
+  ++*nconn;
+}
+
+static void NORETURN tcp_loop(struct worker *w, int sigs) {
+  struct tcpconn *conns, *c;
+  struct pollfd *pfda;
+  unsigned *cidx;		/* connection index of pfda[] entries */
+  unsigned nconn = 0, i, n;
+  time_t now;
+  int r;
+
+  conns = (struct tcpconn *)emalloc(tcp_maxconn * sizeof(*conns));
+  for(i = 0; i < tcp_maxconn; ++i) {
+    conns[i].fd = -1;
+    conns[i].obuf = NULL;
+  }
+  pfda = (struct pollfd *)
+    emalloc((numtcp + tcp_maxconn) * sizeof(struct pollfd));
+  cidx = (unsigned *)emalloc(tcp_maxconn * sizeof(unsigned));
+  for(i = 0; i < (unsigned)numtcp; ++i) {
+    pfda[i].fd = w->w_sock[i];
+    pfda[i].events = POLLIN;
+  }
+
+  for(;;) {
+    if (sigs && signalled) do_signalled();
+    n = numtcp;
+    for(i = 0; i < tcp_maxconn; ++i)
+      if (conns[i].fd >= 0) {
+        pfda[n].fd = conns[i].fd;
+        pfda[n].events = conns[i].obuf ? POLLOUT : POLLIN;
+        cidx[n - numtcp] = i;
+        ++n;
+      }
+    /* wake up once a second to close idle connections */
+    r = poll(pfda, n, nconn ? 1000 : -1);
+    now = time(NULL);
+    if (r > 0) {
+      for(i = 0; i < (unsigned)numtcp; ++i)
+        if (pfda[i].revents & POLLIN)
+          tcp_accept(pfda[i].fd, conns, &nconn, now);
+      for(; i < n; ++i) {
+        if (!pfda[i].revents)
+          continue;
+        c = &conns[cidx[i - numtcp]];
+        if (c->obuf) {
+          if (!tcp_flush(c))
+            goto drop;
+          if (c->obuf)
+            continue;
+        }
+        else {
+          r = read(c->fd, c->ibuf + c->ilen, sizeof(c->ibuf) - c->ilen);
+          if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINTR))
+            continue;
+          if (r <= 0)
+            goto drop;
+          c->ilen += r;
+        }
+        c->last = now;
+        if (tcp_queries(w, c))
+          continue;
+      drop:
+        tcp_close(c);
+        --nconn;
+      }
+    }
+    for(i = 0; i < tcp_maxconn; ++i)
+      if (conns[i].fd >= 0 && now - conns[i].last >= (time_t)tcp_idle) {
+        tcp_close(&conns[i]);
+        --nconn;
+      }
+  }
+}
+
+#endif /* NO_POLL */
+
+static void initworker(struct worker *w) {
+  w->w_pkt.p_bufsz = w->w_tcp ? DNS_MAXTCPPACKET : DNS_EDNS0_MAXPACKET;
+  w->w_pkt.p_buf = (unsigned char *)emalloc(w->w_pkt.p_bufsz);
+  w->w_pkt.p_peer = (struct sockaddr *)&w->w_peer_sa;
+#ifndef NO_STATS
+  if (stshm)
+    w->w_stats = (struct dnsstats *)((char *)stshm + stshm->sh_shardoff) +
+                 (w - workers) * (numzones + 1);
+  else if (prefork)
+    w->w_stats = (struct dnsstats *)
+      shalloc((numzones + 1) * sizeof(struct dnsstats));
+  else
+    w->w_stats = (struct dnsstats *)
+      ezalloc((numzones + 1) * sizeof(struct dnsstats));
+  w->w_pkt.p_stats = w->w_stats;
+  if (prefork)
+    w->w_hits = (struct dshits *)
+      shalloc(numdatasets * sizeof(struct dshits));
+  else
+    w->w_hits = (struct dshits *)
+      ezalloc(numdatasets * sizeof(struct dshits));
+  w->w_pkt.p_hits = w->w_hits;
+  if (clientsfile && prefork)
+    w->w_clients = (struct clisketch *)shalloc(sizeof(struct clisketch));
+  else if (clientsfile)
+    w->w_clients = (struct clisketch *)ezalloc(sizeof(struct clisketch));
+  w->w_pkt.p_clients = w->w_clients;
+#ifdef HAVE_RECVMMSG
+  if (prefork)
+    w->w_cnt = (struct wcounters *)shalloc(sizeof(struct wcounters));
+  else
+    w->w_cnt = tzalloc(struct wcounters);
+#endif
 #endif
+  if (cachesize)
+    w->w_pkt.p_cache = w->w_cache = anscache_new(cachesize);
+#ifdef HAVE_RECVMMSG
+  if (batch > 1 && !w->w_tcp)
+    init_batch(w);
+#endif
+#ifndef NO_THREADS
+  pthread_mutex_init(&w->w_lock, NULL);
+  if (logsample)
+    w->w_logring = newlogring();
+#endif
+}
 
-  pkt.p_peer = (struct sockaddr *)&peer_sa;
+/* answer queries on all sockets of a worker.  Only the main
+ * worker (#0) handles signals */
+static void NORETURN serve_loop(struct worker *w) {
+  const int sigs = w == workers;
+
+#ifndef NO_POLL
+  if (w->w_tcp)
+    tcp_loop(w, sigs);
+#endif
+#ifdef HAVE_IO_URING
+  if (use_uring)
+    uring_loop(w, sigs);
+#endif
+#ifdef HAVE_EPOLL
+  epoll_loop(w, sigs);
+#endif
 
   if (numsock == 1) {
     /* optimized case for only one socket */
-    int fd = sock[0];
+    int fd = w->w_sock[0];
     for(;;) {
-      if (signalled) do_signalled();
-      request(fd);
+      if (sigs && signalled) do_signalled();
+      serve(w, fd, MSG_WAITFORONE);
     }
   }
   else {
@@ -1228,21 +3802,21 @@ int main(int argc, char **argv) {
 #ifdef NO_POLL
     fd_set rfds;
     int maxfd = 0;
-    int *fdi, *fde = sock + numsock;
+    int *fdi, *fde = w->w_sock + numsock;
     FD_ZERO(&rfds);
-    for (fdi = sock; fdi < fde; ++fdi) {
+    for (fdi = w->w_sock; fdi < fde; ++fdi) {
       FD_SET(*fdi, &rfds);
       if (*fdi > maxfd) maxfd = *fdi;
     }
     ++maxfd;
     for(;;) {
       fd_set rfd = rfds;
-      if (signalled) do_signalled();
+      if (sigs && signalled) do_signalled();
       if (select(maxfd, &rfd, NULL, NULL, NULL) <= 0)
         continue;
-      for(fdi = sock; fdi < fde; ++fdi) {
+      for(fdi = w->w_sock; fdi < fde; ++fdi) {
         if (FD_ISSET(*fdi, &rfd))
-          request(*fdi);
+          serve(w, *fdi, MSG_DONTWAIT);
       }
     }
 #else /* !NO_POLL */
@@ -1250,16 +3824,16 @@ int main(int argc, char **argv) {
     struct pollfd *pfdi, *pfde = pfda + numsock;
     int r;
     for(r = 0; r < numsock; ++r) {
-      pfda[r].fd = sock[r];
+      pfda[r].fd = w->w_sock[r];
       pfda[r].events = POLLIN;
     }
     for(;;) {
-      if (signalled) do_signalled();
+      if (sigs && signalled) do_signalled();
       r = poll(pfda, numsock, -1);
       if (r <= 0) continue;
       for(pfdi = pfda; pfdi < pfde; ++pfdi) {
         if (!(pfdi->revents & POLLIN)) continue;
-        request(pfdi->fd);
+        serve(w, pfdi->fd, MSG_DONTWAIT);
         if (!--r) break;
       }
     }
@@ -1267,6 +3841,203 @@ int main(int argc, char **argv) {
   }
 }
 
+#ifndef NO_THREADS
+static void *worker_thread(void *arg) {
+  serve_loop((struct worker *)arg);
+}
+
+static void start_workers(void) {
+  sigset_t ss, oss;
+  int w;
+  /* all signals are handled by the main thread */
+  sigfillset(&ss);
+  pthread_sigmask(SIG_SETMASK, &ss, &oss);
+  for(w = 1; w < nworkers; ++w)
+    if ((errno = pthread_create(&workers[w].w_thread, NULL,
+                                worker_thread, &workers[w])) != 0)
+      error(errno, "unable to create worker thread");
+  pthread_sigmask(SIG_SETMASK, &oss, NULL);
+}
+#endif
+
+/* Pre-forked worker processes (-P).  The parent loads the data and
+ * forks the workers, which share it copy-on-write.  After a reload (or
+ * log reopen), the parent replaces the workers one by one: a new worker
+ * is started on the same sockets before the old one is told to exit,
+ * so queries are answered all the time. */
+
+static int start_worker(int i) {
+  pid_t pid;
+  if (flog && !flushlog)
+    fflush(flog);
+  pid = fork();
+  if (pid < 0) {
+    dslog(LOG_WARNING, 0, "unable to start worker process: %s",
+          strerror(errno));
+    return 0;
+  }
+  if (pid) {
+    wpids[i] = pid;
+    return 1;
+  }
+  /* child: serve queries until SIGTERM */
+  signal(SIGALRM, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+#ifndef NO_STATS
+  signal(SIGUSR1, SIG_IGN);
+  signal(SIGUSR2, SIG_IGN);
+#endif
+  signal(SIGCHLD, SIG_DFL);
+  fork_on_reload = -1;
+#ifndef NO_THREADS
+  if (ctlfd >= 0)
+    close(ctlfd), ctlfd = -1;
+  if (httpfd >= 0)
+    close(httpfd), httpfd = -1;
+#endif
+  workers += i;
+  nworkers = 1;
+  signalled = 0;
+  sigprocmask(SIG_SETMASK, &ssempty, NULL);
+  serve_loop(workers);
+}
+
+static void stop_worker(pid_t pid) {
+  struct timeval tv;
+  int n, s;
+  /* SIGTERM may arrive right before the worker blocks in recv(),
+   * in which case it will only be noticed with the next query.
+   * Repeat it for a while, and resort to SIGKILL at the end. */
+  for(n = 0; n < 100; ++n) {
+    kill(pid, SIGTERM);
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000;
+    select(0, NULL, NULL, NULL, &tv);
+    if (waitpid(pid, &s, WNOHANG) != 0)
+      return;
+  }
+  dslog(LOG_WARNING, 0, "worker process %ld does not terminate, killing it",
+        (long)pid);
+  kill(pid, SIGKILL);
+  waitpid(pid, &s, 0);
+}
+
+static void stop_workers(void) {
+  int i;
+  for(i = 0; i < nworkers; ++i)
+    if (wpids[i]) {
+      stop_worker(wpids[i]);
+      wpids[i] = 0;
+    }
+}
+
+static void restart_workers(void) {
+  int i;
+  pid_t pid;
+  for(i = 0; i < nworkers; ++i) {
+    pid = wpids[i];
+    if (start_worker(i) && pid)
+      stop_worker(pid);
+  }
+  wrestart = 0;
+}
+
+static void reap_workers(void) {
+  pid_t pid;
+  int i, s;
+  while((pid = waitpid(-1, &s, WNOHANG)) > 0)
+    for(i = 0; i < nworkers; ++i)
+      if (wpids[i] == pid) {
+        dslog(LOG_WARNING, 0,
+              "worker process %ld terminated (status %d), restarting",
+              (long)pid, s);
+        wpids[i] = 0;
+        start_worker(i);
+        break;
+      }
+}
+
+#if defined(HAVE_INOTIFY) && !defined(NO_POLL)
+/* sigsuspend() which also watches data files, reporting changes as
+ * SIGNALLED_WATCH after WATCH_DELAY msec without more changes (or
+ * along with any signal which comes earlier) */
+static void watchsuspend(const sigset_t *ss) {
+  struct pollfd pfd;
+  struct timespec ts;
+  int pending = 0;
+  pfd.fd = wfd;
+  pfd.events = POLLIN;
+  ts.tv_sec = 0;
+  ts.tv_nsec = WATCH_DELAY * 1000000;
+  while(!signalled)
+    switch(ppoll(&pfd, 1, pending ? &ts : NULL, ss)) {
+    case 0: signalled |= SIGNALLED_WATCH; break;
+    case 1: if (readwatches(wfd)) pending = 1; break;
+    }
+  if (pending)
+    signalled |= SIGNALLED_WATCH;
+}
+#endif
+
+static void NORETURN prefork_loop(void) {
+  sigset_t ssall;
+  int i;
+  wpids = (pid_t *)ezalloc(nworkers * sizeof(pid_t));
+  for(i = 0; i < nworkers; ++i)
+    start_worker(i);
+  wrestart = 0;
+  sigfillset(&ssall);
+#if defined(HAVE_INOTIFY) && !defined(NO_POLL)
+  if (recheck)
+    wfd = watchdatasets();
+#endif
+  for(;;) {
+    sigprocmask(SIG_SETMASK, &ssall, NULL);
+#if defined(HAVE_INOTIFY) && !defined(NO_POLL)
+    if (wfd >= 0)
+      watchsuspend(&ssempty);
+    else
+#endif
+    while(!signalled)
+      sigsuspend(&ssempty);
+    do_signalled();
+  }
+}
+
+int main(int argc, char **argv) {
+  init(argc, argv);
+  setup_signals();
+  reopenlog();
+#ifndef NO_THREADS
+  if (dtapfile) {
+    static char host[256];
+    gethostname(host, sizeof(host) - 1);
+    dtap = dnstap_open(dtapfile, host, "rbldnsd " VERSION);
+  }
+  if (logsample)
+    startlogwriter();
+  if (ctlfd >= 0)
+    startctl(ctlthread, "control socket");
+  if (httpfd >= 0)
+    startctl(httpthread, "metrics");
+#endif
+  setalarm(recheck);
+  start_time = time(NULL);
+#ifndef NO_STATS
+  stats_time = time(NULL);
+  if (statsfile)
+    dumpstats_z();
+#endif
+
+  if (prefork)
+    prefork_loop();
+#ifndef NO_THREADS
+  if (nworkers > 1)
+    start_workers();
+#endif
+  serve_loop(&workers[0]);
+}
+
 void oom(void) {
   if (initialized)
     dslog(LOG_ERR, 0, "out of memory loading dataset");
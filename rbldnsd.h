@@ -31,13 +31,15 @@ extern int logto;
 void PRINTFLIKE(2,3) NORETURN error(int errnum, const char *fmt, ...);
 
 struct zone;
+struct anscache;
 struct dataset;
 struct dsdata;
 struct dsctx;
 struct sockaddr;
 
 struct dnspacket {		/* private structure */
-  unsigned char p_buf[DNS_EDNS0_MAXPACKET]; /* packet buffer */
+  unsigned char *p_buf;		/* packet buffer */
+  unsigned p_bufsz;		/* DNS_EDNS0_MAXPACKET, or DNS_MAXTCPPACKET */
   unsigned char *p_endp;	/* end of packet buffer */
   unsigned char *p_cur;		/* current pointer */
   unsigned char *p_sans;	/* start of answers */
@@ -45,6 +47,14 @@ struct dnspacket {		/* private structure */
   const struct dataset *p_substds;
   const struct sockaddr *p_peer;/* address of the requesting client */
   unsigned p_peerlen;
+#ifndef NO_STATS
+  struct dnsstats *p_stats;	/* stats shard: [0] global, [z_sidx] zones */
+  unsigned p_sidx;		/* stats index of the zone replied for, or 0 */
+  int p_trunc;			/* some data did not fit into the reply */
+  struct dshits *p_hits;	/* dataset hits, [ds_sidx] */
+  struct clisketch *p_clients;	/* queries per client network (-G) if any */
+#endif
+  struct anscache *p_cache;	/* answer cache if any */
 };
 
 struct dnsquery {	/* q */
@@ -54,6 +64,7 @@ struct dnsquery {	/* q */
   unsigned q_dnlen;			/* length of q_dn */
   unsigned q_dnlab;			/* number of labels in q_dn */
   unsigned char *q_lptr[DNS_MAXLABELS];	/* pointers to labels */
+  int q_edns;				/* query has EDNS0 OPT record */
 };
 
 struct dnsqinfo {	/* qi */
@@ -98,6 +109,9 @@ typedef void ds_startfn_t(struct dataset *ds);
 typedef int ds_linefn_t(struct dataset *ds, char *line, struct dsctx *dsc);
 typedef void ds_finishfn_t(struct dataset *ds, struct dsctx *dsc);
 typedef void ds_resetfn_t(struct dsdata *dsd, int freeall);
+/* move data parsed into part (an empty copy of ds with its own dsdata
+ * and mempool, the latter is merged by the caller) to ds */
+typedef int ds_mergefn_t(struct dataset *ds, struct dataset *part);
 typedef int
 ds_queryfn_t(const struct dataset *ds, const struct dnsqinfo *qi,
              struct dnspacket *pkt);
@@ -139,6 +153,7 @@ struct dstype {	/* dst */
   ds_queryfn_t *dst_queryfn;	/* routine to perform query */
   ds_dumpfn_t *dst_dumpfn;	/* dump zone in BIND format */
   const char *dst_descr;    	/* short description of a ds type */
+  ds_mergefn_t *dst_mergefn;	/* if set, large files may be split */
 };
 
 /* dst_flags */
@@ -147,7 +162,12 @@ struct dstype {	/* dst */
 #define DSTF_SPECIAL	0x08	/* special ds: non-recursive */
 
 #define declaredstype(t) extern const struct dstype dataset_##t##_type
-#define definedstype(t, flags, descr) \
+#define definedstype(t, flags, descr) _definedstype(t, flags, descr, NULL)
+/* dataset type which can load parts of a file in parallel */
+#define definedmergeable(t, flags, descr) \
+ static ds_mergefn_t ds_##t##_merge; \
+ _definedstype(t, flags, descr, ds_##t##_merge)
+#define _definedstype(t, flags, descr, merge) \
  static ds_resetfn_t ds_##t##_reset; \
  static ds_startfn_t ds_##t##_start; \
  static ds_linefn_t ds_##t##_line; \
@@ -159,7 +179,7 @@ struct dstype {	/* dst */
    #t /* name */, flags, sizeof(struct dsdata), \
    ds_##t##_reset, ds_##t##_start, ds_##t##_line, ds_##t##_finish, \
    ds_##t##_query, ds_##t##_dump, \
-   descr }
+   descr, merge }
 
 declaredstype(ip4set);
 declaredstype(ip4tset);
@@ -204,6 +224,21 @@ struct dsns { /* dsns, nameserver */
   unsigned char dsns_dn[1];		/* nameserver DN, varlen */
 };
 
+/* load profile of a dataset: where time went while loading it (usec,
+ * not counting -Q pauses) and memory the loaded data takes (bytes) */
+struct dsprof {
+  unsigned long dp_read;	/* open, read and uncompress files */
+  unsigned long dp_parse;	/* parse lines */
+  unsigned long dp_sort;	/* dst_finishfn(): sort entries */
+  unsigned long dp_dedup;	/* dst_finishfn(): remove duplicates */
+  unsigned long dp_shrink;	/* dst_finishfn(): shrink arrays and the rest */
+  unsigned long dp_lines;	/* lines read */
+  unsigned long dp_earr;	/* entry arrays */
+  unsigned long dp_trie;	/* btrie nodes and data (in the pool) */
+  unsigned long dp_pool;	/* data allocated from the pool (mp_datasz) */
+  unsigned dp_chunks;		/* memory pool chunks */
+};
+
 struct dataset {	/* ds */
   const struct dstype *ds_type;	/* type of this data */
   struct dsdata *ds_dsd;		/* type-specific data */
@@ -219,6 +254,17 @@ struct dataset {	/* ds */
 #define SUBST_BASE_TEMPLATE	10
   struct mempool *ds_mp;		/* memory pool for data */
   struct dataset *ds_next;		/* next in global list */
+  struct dataset *ds_shadow;		/* new data loaded, to be swapped in */
+  unsigned long ds_etime, ds_utime;	/* last load wall/CPU time, msec */
+  struct dsfile *ds_delta;		/* delta file (+file in spec) if any */
+  unsigned ds_seq;			/* $SEQ of last applied delta */
+  int ds_dpending;			/* delta is ready to be put in place */
+  int ds_dirty;				/* marked for reload (inotify, -S) */
+  char *ds_img;				/* image the data is mapped from */
+  unsigned long ds_imgsz;		/* size of ds_img mapping */
+  char ds_info[80];			/* summary of the data, as logged */
+  struct dsprof ds_prof;		/* load profile of the data */
+  unsigned ds_sidx;			/* index of its hit counters */
 };
 
 struct dslist {	/* dsl */
@@ -241,11 +287,95 @@ typedef unsigned long long dnscnt_t;
 typedef unsigned long dnscnt_t;
 #define PRI_DNSCNT "lu"
 #endif
+/* Query latency histogram, from packet receipt to reply sent, in
+ * microseconds: values below LAT_SUB have a bucket each, larger ones
+ * LAT_SUB buckets per power of two, so a bucket is within 1/LAT_SUB
+ * of its values.  The last bucket takes everything from 2^LAT_MAXBITS. */
+#define LAT_SUBBITS	3
+#define LAT_SUB		(1 << LAT_SUBBITS)
+#define LAT_MAXBITS	24
+#define LAT_NBUCKETS	((LAT_MAXBITS - LAT_SUBBITS + 1) * LAT_SUB)
 struct dnsstats {
   dnscnt_t b_in, b_out;		/* number of bytes: in, out */
   dnscnt_t q_ok, q_nxd, q_err;	/* number of requests: OK, NXDOMAIN, ERROR */
+  dnscnt_t c_hit, c_miss, c_evict; /* answer cache, in global stats only */
+  dnscnt_t t_a, t_txt, t_any, t_other; /* queries by type */
+  dnscnt_t e_edns, e_plain;	/* queries with and without EDNS0 */
+  dnscnt_t r_servfail, r_notimpl, r_refused; /* error replies by rcode */
+  dnscnt_t r_trunc;		/* replies some data did not fit into */
+  dnscnt_t a_ignore, a_refuse, a_empty, a_always, a_pass; /* ACL results */
+  dnscnt_t l_hist[LAT_NBUCKETS]; /* latency of replies sent */
+};
+
+/* Shared statistics segment (-M): this header, then zone names (as
+ * text, STSHM_ZONELEN bytes each), then sh_nshards shards of counters,
+ * one per worker, each being sh_nzones+1 struct dnsstats: global
+ * counters first, then zones in the order of names.  Every counter is
+ * written by its worker only and never locked; readers sum the shards.
+ * The layout changes only together with sh_version. */
+#define STSHM_MAGIC	"RBLDSTAT"
+#define STSHM_VERSION	3
+#define STSHM_ZONELEN	256
+struct stshm {
+  char sh_magic[8];		/* STSHM_MAGIC, set last when ready */
+  unsigned sh_version;		/* STSHM_VERSION */
+  unsigned sh_size;		/* size of the whole segment */
+  unsigned sh_nzones;		/* number of zones */
+  unsigned sh_nshards;		/* number of counter shards */
+  unsigned sh_zoneoff;		/* offset of zone names */
+  unsigned sh_shardoff;		/* offset of the first shard */
+  unsigned sh_cntsize;		/* size of one counter (dnscnt_t) */
+  unsigned sh_ncnt;		/* number of counters in struct dnsstats */
+  dnscnt_t sh_pid;		/* pid of the main process */
+  dnscnt_t sh_start;		/* time the counting started */
+  dnscnt_t sh_reset;		/* time of the last reset (SIGUSR2), or 0 */
+  dnscnt_t sh_resets;		/* number of resets so far */
+};
+
+/* Dataset hits: every worker counts replies found in each dataset of
+ * a zone (answers from the -R cache are not counted), and keeps the
+ * keys matched most often (query IP address for IP datasets, name
+ * relative to the zone otherwise) in a space-saving sketch of HIT_TOPN
+ * entries.  Only every HIT_SAMPLE-th hit of a dataset goes to the
+ * sketch, so the cost per query stays at a counter increment. */
+#define HIT_SAMPLE	16	/* power of 2 */
+#define HIT_TOPN	16
+#define HIT_IP4		1	/* he_type */
+#define HIT_IP6		2
+#define HIT_DN		3
+struct hitent {
+  dnscnt_t he_cnt;		/* sampled hits, may be overestimated.. */
+  dnscnt_t he_err;		/* ..by at most this */
+  unsigned char he_type;	/* HIT_XXX, 0 if the entry is unused */
+  unsigned char he_len;		/* length of he_key */
+  unsigned char he_key[DNS_MAXDN]; /* address, or DN without final 0 */
+};
+struct dshits {
+  dnscnt_t h_hits;		/* number of hits */
+  struct hitent h_top[HIT_TOPN];
 };
-extern struct dnsstats gstats;	/* global statistics counters */
+
+/* Top talkers (-G): queries are counted per client network, /24 for
+ * IPv4 and /56 for IPv6, in a count-min sketch of CLI_DEPTH rows of
+ * CLI_WIDTH counters, which overestimates a network by at most about
+ * e/CLI_WIDTH of all queries (with high probability).  Networks with
+ * the highest estimates are kept in a list of CLI_TOPN entries.  All
+ * sketches use the same hashes, so those of workers are merged by
+ * adding the counters up. */
+#define CLI_DEPTH	4
+#define CLI_WIDTH	2048	/* power of 2 */
+#define CLI_TOPN	32
+struct clitop {
+  dnscnt_t ct_cnt;		/* estimate as of the last query */
+  unsigned char ct_key[8];	/* 4 or 6, then network; all 0 if unused */
+};
+struct clisketch {
+  dnscnt_t cs_queries;		/* number of queries */
+  dnscnt_t cs_cm[CLI_DEPTH][CLI_WIDTH];
+  struct clitop cs_top[CLI_TOPN];
+};
+void clicount(struct clisketch *cs, const struct sockaddr *sa);
+void listclients(FILE *f, struct clisketch *const *wc, int nw);
 #endif /* NO_STATS */
 
 #define MAX_NS 32
@@ -270,8 +400,7 @@ struct zone {	/* zone, list of zones */
   unsigned z_nglue;			/* number of glue records */
   struct zonens *z_zns;			/* pre-packed NS records */
 #ifndef NO_STATS
-  struct dnsstats z_stats;		/* statistic counters */
-  struct dnsstats z_pstats;		/* for stats monitoring: prev values */
+  unsigned z_sidx;			/* index of zone counters in stats */
 #endif
 #ifndef NO_DSO
   void *z_hookdata;			/* data ptr for hooks */
@@ -294,6 +423,42 @@ findqzone(const struct zone *zonelist,
 /* log a reply */
 void logreply(const struct dnspacket *pkt, FILE *flog, int flushlog);
 
+/* query log record, to be formatted later (asynchronous log, -L) */
+struct logrec {
+  time_t lr_time;
+  unsigned char lr_peer[28];	/* struct sockaddr of the client */
+  unsigned lr_peerlen;
+  unsigned short lr_qtype, lr_qclass;
+  unsigned short lr_len;	/* reply length */
+  unsigned char lr_rcode, lr_ancnt;
+  unsigned short lr_id;		/* query ID */
+  unsigned char lr_f1;		/* query opcode and RD flag */
+  unsigned char lr_tcp;		/* query came over TCP */
+  unsigned short lr_wirelen;	/* length of reply copy following the record */
+  unsigned char lr_dn[DNS_MAXDN]; /* query DN as sent by the client */
+};
+#define LOGLINESZ (DNS_MAXDOMAIN + 1100) /* max length of formatted record */
+void logfill(struct logrec *lr, const struct dnspacket *pkt, time_t now);
+/* format a record as one log line, return its length */
+unsigned logformat(char *buf, const struct logrec *lr);
+
+/* dnstap output over Frame Streams (file or "unix:" socket path) */
+struct dnstap;
+struct dnstap *
+dnstap_open(const char *path, const char *ident, const char *version);
+/* queue a reply for writing, wire is a copy of lr_wirelen reply bytes */
+void dnstap_write(struct dnstap *dt, const struct logrec *lr,
+                  const unsigned char *wire);
+void dnstap_flush(struct dnstap *dt);
+/* finish the stream and reopen/reconnect unless last */
+void dnstap_reopen(struct dnstap *dt, int last);
+unsigned long dnstap_drops(const struct dnstap *dt);
+
+/* answer cache, one per worker, for up to `size' answers */
+struct anscache *anscache_new(unsigned size);
+/* generation of cached answers, bump to invalidate all caches */
+extern unsigned anscache_gen;
+
 /* details of DNS packet structure are in rbldnsd_packet.c */
 
 /* add a record into answer section */
@@ -333,7 +498,54 @@ struct zone *newzone(struct zone **zonelist,
                      unsigned char *dn, unsigned dnlen,
                      struct mempool *mp);
 struct dataset *nextdataset2reload(struct dataset *ds);
-int loaddataset(struct dataset *ds);
+/* nextdataset2reload() should only return datasets marked ds_dirty,
+ * not look at stamps of the others */
+extern int reload_dirty;
+struct dataset *finddataset(const char *name);
+void listdatasets(FILE *f);
+int writeprofile(const char *file);
+void metricdatasets(FILE *f);
+#ifndef NO_STATS
+extern unsigned numdatasets;		/* datasets have ds_sidx below this */
+/* hits of every dataset summed over nw workers' counters in wh[] */
+void listhits(FILE *f, struct dshits *const *wh, int nw);
+#endif
+/* write s escaped for a quoted Prometheus label value */
+void fputlabel(FILE *f, const char *s);
+#ifdef HAVE_INOTIFY
+/* watch directories of all data files, return inotify fd or -1 */
+int watchdatasets(void);
+/* read inotify events, mark affected datasets, return # of them */
+int readwatches(int fd);
+#endif
+int loaddatasets(unsigned nthreads);
+/* called every ldslice msec while loading, if set (-Q) */
+extern void (*ldyield)(void);
+extern unsigned ldslice;
+/* call ldyield() if it's time to, from long loops of loading */
+void dsyield(void);
+#define YIELD_LINES 256	/* ..every that many lines or entries */
+/* clock for load profiles, usec */
+unsigned long dsclock(void);
+/* add time since *t to a profile step, and restart *t */
+void dsprofstep(unsigned long *step, unsigned long *t);
+#define MAXLOADERS 64	/* max number of loader threads (-j) */
+void swapdatasets(void);
+int writeimages(const char *dir);
+
+/* binary dataset images, see rbldnsd_image.c */
+extern const char *imgdir;	/* directory with images to use (-i) */
+struct imgw;			/* image being written */
+struct imgr {			/* image being read */
+  const char *ir_p, *ir_e;	/* current position and end */
+};
+/* append len bytes to the image, padded to 8 bytes */
+void img_put(struct imgw *iw, const void *data, unsigned long len);
+/* next len bytes (padded) of the image or NULL if there's no more */
+const void *img_get(struct imgr *ir, unsigned long len);
+int writeimage(const struct dataset *ds, const char *dir);
+int mapimage(struct dataset *ds, struct dsctx *dsc);
+void unmapimage(struct dataset *ds);
 
 struct dsctx {
   struct dataset *dsc_ds;	/* currently loading dataset */
@@ -342,6 +554,8 @@ struct dsctx {
   int dsc_lineno;		/* current line number */
   int dsc_warns;		/* number of warnings so far */
   unsigned dsc_ip4maxrange;	/* max IP4 range allowed */
+  int dsc_delta;		/* reading a delta file */
+  unsigned dsc_seq;		/* $SEQ of the delta file */
 };
 
 void PRINTFLIKE(3,4) dslog(int level, struct dsctx *dsc, const char *fmt, ...);
@@ -352,11 +566,23 @@ zlog(int level, const struct zone *zone, const char *fmt, ...);
 
 /* from rbldnsd_combined.c, special routine used inside ds_special() */
 int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc);
+/* delta files: collect one +entry (del=0) or -entry line, build
+ * updated data off to the side, drop the pending changes, and put
+ * updated data in place (with queries paused), folding it into the
+ * main data right after a full load (fold=1) */
+int ds_ip4set_deltaline(struct dataset *ds, char *s, int del,
+                        struct dsctx *dsc);
+int ds_ip4set_deltafinish(struct dataset *ds, struct dsctx *dsc);
+void ds_ip4set_deltadrop(struct dsdata *dsd);
+void ds_ip4set_deltaswap(struct dataset *ds, int fold);
+int ds_ip4set_saveimg(const struct dataset *ds, struct imgw *iw);
+int ds_ip4set_mapimg(struct dataset *ds, struct imgr *ir, struct dsctx *dsc);
 
 extern unsigned def_ttl, min_ttl, max_ttl;
 extern const char def_rr[5];
 extern int accept_in_cidr;
 extern int nouncompress;
+extern int tcp_enabled;		/* TCP listener active: truncate UDP replies */
 extern struct dataset *g_dsacl;	/* global acl */
 
 extern const char *show_version; /* version.bind CH TXT */
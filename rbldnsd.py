@@ -3,7 +3,9 @@
 
 """
 import errno
+import os
 from itertools import count
+import socket
 import subprocess
 from tempfile import NamedTemporaryFile, TemporaryFile
 import time
@@ -48,6 +50,31 @@ class ZoneFile(object):
         self._file.writelines("%s\n" % line for line in lines)
         self._file.flush()
 
+def has_option(flag, daemon_bin='./rbldnsd'):
+    """ Was rbldnsd compiled with support for the given option?
+
+    Options which are not compiled in are not described in the help
+    message.
+    """
+    proc = subprocess.Popen([daemon_bin, '-h'], stdout=subprocess.PIPE)
+    help_message = proc.communicate()[0]
+    return ('\n %s ' % flag).encode('ascii') in help_message
+
+def control(path, command):
+    """ Send a command to the control socket (-S), return the reply """
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        s.connect(path)
+        s.sendall((command + '\n').encode('ascii'))
+        reply = b''
+        while True:
+            data = s.recv(4096)
+            if not data:
+                return reply.decode('ascii')
+            reply += data
+    finally:
+        s.close()
+
 class DaemonError(Exception):
     """ Various errors having to do with the execution of the daemon.
     """
@@ -61,9 +88,10 @@ class Rbldnsd(object):
     def __init__(self, datasets=None,
                  daemon_addr='localhost', daemon_port=5300,
                  daemon_bin='./rbldnsd',
-                 stderr=None):
+                 stderr=None, options=()):
         self._daemon = None
         self.datasets = []
+        self.options = list(options)
         self.daemon_addr = daemon_addr
         self.daemon_port = daemon_port
         self.daemon_bin = daemon_bin
@@ -83,14 +111,14 @@ class Rbldnsd(object):
         if self._daemon:
             self._stop_daemon()
 
-    def query(self, name, qtype='TXT'):
+    def query(self, name, qtype='TXT', protocol='udp'):
         if not self._daemon:
             raise DaemonError("daemon not running")
         elif self._daemon.poll() is not None:
             raise DaemonError("daemon has died with code %d"
                               % self._daemon.returncode)
 
-        req = DNS.Request(name=name, qtype=qtype, rd=0)
+        req = DNS.Request(name=name, qtype=qtype, rd=0, protocol=protocol)
         resp = req.req(server=self.daemon_addr, port=self.daemon_port)
         status = resp.header['status']
         if status == 'REFUSED':
@@ -103,13 +131,19 @@ class Rbldnsd(object):
             assert len(resp.answers[0]['data']) == 1
             return resp.answers[0]['data'][0]
 
+    def signal(self, signum):
+        """ Send a signal to the running daemon """
+        if not self._daemon:
+            raise DaemonError("daemon not running")
+        os.kill(self._daemon.pid, signum)
+
     def _start_daemon(self):
         if len(self.datasets) == 0:
             raise ValueError("no datasets defined")
 
         cmd = [ self.daemon_bin, '-n',
                 '-b', '%s/%u' % (self.daemon_addr, self.daemon_port),
-                ]
+                ] + self.options
         for zone, ds_type, file in self.datasets:
             if isinstance(file, basestring):
                 filename = file
@@ -88,7 +88,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
   struct zone *zone;
   unsigned char dn[DNS_MAXDN];
   unsigned dnlen;
-  char *name;
+  char *name, *sp;
 
   ds_combined_finishlast(dsc);
 
@@ -98,7 +98,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
       *p = '\0';
       break;
     }
-  p = strtok(line, space);	/* dataset type */
+  p = strtok_r(line, space, &sp);	/* dataset type */
   if (!p) return 0;
   if ((name = strchr(p, ':')) != NULL)
     *name++ = '\0';
@@ -155,7 +155,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
       return -1;
   }
 
-  if (!(p = strtok(NULL, space)))
+  if (!(p = strtok_r(NULL, space, &sp)))
     dswarn(dsc, "no subzone(s) specified for dataset, data will be ignored");
   else do {
     if (p[0] == '@' && p[1] == '\0') {
@@ -172,7 +172,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
     dsl = mp_talloc(ds->ds_mp, struct dslist);
     if (!zone || !dsl) return -1;
     connectdataset(zone, dssub, dsl);
-  } while((p = strtok(NULL, space)) != NULL);
+  } while((p = strtok_r(NULL, space, &sp)) != NULL);
 
   ++dsd->nds;
   dsc->dsc_subset = dssub;
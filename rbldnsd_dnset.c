@@ -152,7 +152,8 @@ static int ds_dnset_lt(const struct entry *a, const struct entry *b) {
      a->rr < b->rr;
 }
 
-static void ds_dnset_finish_arr(struct dnarr *arr) {
+static void ds_dnset_finish_arr(struct dnarr *arr, struct dsprof *dp) {
+  unsigned long tm = dsclock();
   if (!arr->n) {
     arr->h = 0;
     return;
@@ -166,6 +167,7 @@ static void ds_dnset_finish_arr(struct dnarr *arr) {
 # define QSORT_NELT arr->n
 # define QSORT_LT(a,b) ds_dnset_lt(a,b)
 # include "qsort.c"
+  dsprofstep(&dp->dp_sort, &tm);
 
   /* we make all the same DNs point to one string for faster searches */
   { register struct entry *e, *t;
@@ -175,13 +177,16 @@ static void ds_dnset_finish_arr(struct dnarr *arr) {
   }
 #define dnset_eeq(a,b) a.ldn == b.ldn && rrs_equal(a,b)
   REMOVE_DUPS(struct entry, arr->e, arr->n, dnset_eeq);
+  dsprofstep(&dp->dp_dedup, &tm);
   SHRINK_ARRAY(struct entry, arr->e, arr->n, arr->a);
 }
 
 static void ds_dnset_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
-  ds_dnset_finish_arr(&dsd->p);
-  ds_dnset_finish_arr(&dsd->w);
+  ds_dnset_finish_arr(&dsd->p, &ds->ds_prof);
+  ds_dnset_finish_arr(&dsd->w, &ds->ds_prof);
+  ds->ds_prof.dp_earr = (unsigned long)(dsd->p.a + dsd->w.a) *
+                        sizeof(struct entry);
   dsloaded(dsc, "e/w=%u/%u", dsd->p.n, dsd->w.n);
 }
 
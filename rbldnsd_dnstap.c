@@ -0,0 +1,336 @@
+/* dnstap output: replies encoded as dnstap protobuf messages and
+ * written as Frame Streams, either to a file or to a unix socket.
+ * The encoding is done by hand, dnstap schema is small and stable.
+ * A socket is written in non-blocking mode: what the reader does not
+ * take stays in the buffer, and frames which do not fit there are
+ * dropped and counted, so a stalled reader never stalls the log writer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#include "rbldnsd.h"
+
+#ifndef O_LARGEFILE
+# define O_LARGEFILE 0
+#endif
+
+#define FS_ACCEPT	1	/* frame streams control frame types */
+#define FS_START	2
+#define FS_STOP		3
+#define FS_READY	4
+#define FS_FIELD_CONTENT_TYPE 1
+#define FS_CONTENT_TYPE	"protobuf:dnstap.Dnstap"
+
+#define DT_BUFSZ	65536	/* output batch buffer */
+#define DNS_HDRSIZE	12	/* DNS packet header */
+/* max size of one data frame: our fields plus query and reply */
+#define DT_FRAMESZ	(768 + DNS_MAXDN + DNS_HDRSIZE + 4 + DNS_EDNS0_MAXPACKET)
+
+struct dnstap {
+  char *dt_path;		/* file name or socket path */
+  int dt_sock;			/* dt_path is a unix socket */
+  int dt_fd;			/* -1 if not open/connected */
+  time_t dt_retry;		/* do not try to reconnect before this */
+  unsigned long dt_drops;	/* frames dropped */
+  unsigned dt_frames;		/* frames in dt_buf */
+  const char *dt_ident, *dt_version;
+  unsigned dt_len;		/* bytes in dt_buf */
+  unsigned char dt_buf[DT_BUFSZ];
+};
+
+static int dt_writeall(int fd, const unsigned char *p, unsigned l) {
+  int r;
+  while(l) {
+    r = write(fd, p, l);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += r; l -= r;
+  }
+  return 0;
+}
+
+static unsigned char *put32(unsigned char *p, unsigned v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+  return p + 4;
+}
+
+/* control frame of the given type, with content type field
+ * except for STOP.  Returns its length */
+static unsigned dt_control(unsigned char *buf, unsigned type) {
+  unsigned l = type == FS_STOP ? 4 : 4 + 8 + sizeof(FS_CONTENT_TYPE) - 1;
+  unsigned char *p = put32(put32(put32(buf, 0), l), type);
+  if (type != FS_STOP) {
+    p = put32(put32(p, FS_FIELD_CONTENT_TYPE), sizeof(FS_CONTENT_TYPE) - 1);
+    memcpy(p, FS_CONTENT_TYPE, sizeof(FS_CONTENT_TYPE) - 1);
+  }
+  return l + 8;
+}
+
+static void dt_disconnect(struct dnstap *dt) {
+  if (dt->dt_fd >= 0)
+    close(dt->dt_fd);
+  dt->dt_fd = -1;
+  dt->dt_retry = time(NULL) + 1;
+}
+
+/* bidirectional handshake: READY, wait for ACCEPT, START */
+static int dt_handshake(struct dnstap *dt) {
+  unsigned char buf[64];
+  unsigned l = dt_control(buf, FS_READY);
+  unsigned got = 0;
+  struct timeval tv;
+  int r;
+
+  tv.tv_sec = 1; tv.tv_usec = 0;
+  setsockopt(dt->dt_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (dt_writeall(dt->dt_fd, buf, l) < 0)
+    return -1;
+  /* escape, length, type: we only look at the type */
+  while(got < 12) {
+    r = read(dt->dt_fd, buf + got, sizeof(buf) - got);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    got += r;
+  }
+  if (buf[8] || buf[9] || buf[10] || buf[11] != FS_ACCEPT)
+    return -1;
+  l = dt_control(buf, FS_START);
+  return dt_writeall(dt->dt_fd, buf, l);
+}
+
+/* (re)open or (re)connect output, return 0 on success */
+static int dt_connect(struct dnstap *dt) {
+  if (time(NULL) < dt->dt_retry)
+    return -1;
+  if (dt->dt_sock) {
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, dt->dt_path, sizeof(un.sun_path) - 1);
+    dt->dt_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (dt->dt_fd < 0 ||
+        connect(dt->dt_fd, (struct sockaddr *)&un, sizeof(un)) < 0 ||
+        dt_handshake(dt) < 0) {
+      if (!dt->dt_retry)	/* complain only once */
+        dslog(LOG_WARNING, 0, "unable to connect to dnstap socket `%.50s': %s",
+              dt->dt_path, strerror(errno));
+      dt_disconnect(dt);
+      return -1;
+    }
+    fcntl(dt->dt_fd, F_SETFL, fcntl(dt->dt_fd, F_GETFL) | O_NONBLOCK);
+    dslog(LOG_INFO, 0, "connected to dnstap socket `%.50s'", dt->dt_path);
+  }
+  else {
+    unsigned char buf[64];
+    dt->dt_fd = open(dt->dt_path,
+                     O_WRONLY|O_APPEND|O_CREAT|O_NONBLOCK|O_LARGEFILE, 0644);
+    if (dt->dt_fd < 0 ||
+        dt_writeall(dt->dt_fd, buf, dt_control(buf, FS_START)) < 0) {
+      dslog(LOG_WARNING, 0, "error (re)opening dnstap file `%.50s': %s",
+            dt->dt_path, strerror(errno));
+      dt_disconnect(dt);
+      dt->dt_retry = (time_t)-1 >> 1;	/* wait for SIGHUP */
+      return -1;
+    }
+  }
+  dt->dt_retry = 0;
+  return 0;
+}
+
+struct dnstap *
+dnstap_open(const char *path, const char *ident, const char *version) {
+  struct dnstap *dt = tmalloc(struct dnstap);
+  dt->dt_sock = strncmp(path, "unix:", 5) == 0;
+  dt->dt_path = estrdup(dt->dt_sock ? path + 5 : path);
+  dt->dt_fd = -1;
+  dt->dt_retry = 0;
+  dt->dt_drops = 0;
+  dt->dt_frames = 0;
+  dt->dt_ident = ident;
+  dt->dt_version = version;
+  dt->dt_len = 0;
+  dt_connect(dt);
+  return dt;
+}
+
+/* write out as much of the buffer as the output takes now.
+ * A partly written frame stays at the start of the buffer */
+void dnstap_flush(struct dnstap *dt) {
+  unsigned off = 0;
+  int r;
+  if (!dt->dt_len)
+    return;
+  if (dt->dt_fd < 0 && dt_connect(dt) < 0)
+    goto drop;
+  while(off < dt->dt_len) {
+    r = write(dt->dt_fd, dt->dt_buf + off, dt->dt_len - off);
+    if (r > 0)
+      off += r;
+    else if (r < 0 && errno == EINTR)
+      continue;
+    else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* reader is slow: keep the rest for the next time */
+      memmove(dt->dt_buf, dt->dt_buf + off, dt->dt_len - off);
+      dt->dt_len -= off;
+      return;
+    }
+    else {
+      if (dt->dt_sock)
+        dslog(LOG_WARNING, 0, "dnstap socket `%.50s': %s, reconnecting",
+              dt->dt_path, strerror(errno));
+      dt_disconnect(dt);
+      if (!dt->dt_sock)
+        dt->dt_retry = (time_t)-1 >> 1;
+      goto drop;
+    }
+  }
+  dt->dt_len = dt->dt_frames = 0;
+  return;
+drop:
+  /* a new connection starts a new stream, partial frames go too */
+  dt->dt_drops += dt->dt_frames;
+  dt->dt_len = dt->dt_frames = 0;
+}
+
+/* finish current stream and start a new one (reopening the file) */
+void dnstap_reopen(struct dnstap *dt, int last) {
+  unsigned char buf[16];
+  dnstap_flush(dt);
+  if (dt->dt_fd >= 0 && !dt->dt_len)
+    dt_writeall(dt->dt_fd, buf, dt_control(buf, FS_STOP));
+  dt->dt_drops += dt->dt_frames;
+  dt->dt_len = dt->dt_frames = 0;
+  dt_disconnect(dt);
+  dt->dt_retry = 0;
+  if (!last)
+    dt_connect(dt);
+}
+
+unsigned long dnstap_drops(const struct dnstap *dt) {
+  return dt->dt_drops;
+}
+
+/* protobuf encoding, just what is needed for dnstap */
+
+static unsigned char *pb_varint(unsigned char *p, unsigned long long v) {
+  while(v >= 0x80) {
+    *p++ = (unsigned char)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (unsigned char)v;
+  return p;
+}
+
+#define pb_tag(p, field, wt) pb_varint(p, ((field) << 3) | (wt))
+#define PB_VARINT	0
+#define PB_BYTES	2
+
+static unsigned char *
+pb_bytes(unsigned char *p, unsigned field, const void *v, unsigned l) {
+  p = pb_varint(pb_tag(p, field, PB_BYTES), l);
+  memcpy(p, v, l);
+  return p + l;
+}
+
+static unsigned char *pb_uint(unsigned char *p, unsigned field,
+                              unsigned long long v) {
+  return pb_varint(pb_tag(p, field, PB_VARINT), v);
+}
+
+/* dnstap.Message fields */
+#define DTM_TYPE		1
+#define DTM_SOCKET_FAMILY	2
+#define DTM_SOCKET_PROTOCOL	3
+#define DTM_QUERY_ADDRESS	4
+#define DTM_QUERY_PORT		6
+#define DTM_QUERY_TIME_SEC	8
+#define DTM_QUERY_MESSAGE	10
+#define DTM_RESPONSE_TIME_SEC	12
+#define DTM_RESPONSE_MESSAGE	14
+#define DTM_AUTH_RESPONSE	2
+
+/* dnstap.Dnstap fields */
+#define DT_IDENTITY	1
+#define DT_VERSION	2
+#define DT_MESSAGE	14
+#define DT_TYPE		15
+#define DT_TYPE_MESSAGE	1
+
+void dnstap_write(struct dnstap *dt, const struct logrec *lr,
+                  const unsigned char *wire) {
+  unsigned char msg[DT_FRAMESZ], q[DNS_HDRSIZE + DNS_MAXDN + 4];
+  unsigned char *m = msg, *p, *f;
+  const struct sockaddr *sa = (const struct sockaddr *)lr->lr_peer;
+  unsigned ql;
+
+  if (dt->dt_len + DT_FRAMESZ + 16 > sizeof(dt->dt_buf)) {
+    dnstap_flush(dt);
+    if (dt->dt_len + DT_FRAMESZ + 16 > sizeof(dt->dt_buf)) {
+      ++dt->dt_drops;
+      return;
+    }
+  }
+
+  m = pb_uint(m, DTM_TYPE, DTM_AUTH_RESPONSE);
+  if (sa->sa_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+    m = pb_uint(m, DTM_SOCKET_FAMILY, 1);
+    m = pb_uint(m, DTM_SOCKET_PROTOCOL, lr->lr_tcp ? 2 : 1);
+    m = pb_bytes(m, DTM_QUERY_ADDRESS, &sin->sin_addr, 4);
+    m = pb_uint(m, DTM_QUERY_PORT, ntohs(sin->sin_port));
+  }
+#ifndef NO_IPv6
+  else if (sa->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+    m = pb_uint(m, DTM_SOCKET_FAMILY, 2);
+    m = pb_uint(m, DTM_SOCKET_PROTOCOL, lr->lr_tcp ? 2 : 1);
+    m = pb_bytes(m, DTM_QUERY_ADDRESS, &sin6->sin6_addr, 16);
+    m = pb_uint(m, DTM_QUERY_PORT, ntohs(sin6->sin6_port));
+  }
+#endif
+  m = pb_uint(m, DTM_QUERY_TIME_SEC, lr->lr_time);
+
+  /* the query itself is overwritten by the reply; rebuild it from the
+   * header and question: opcode and RD bit from the reply, one question */
+  memset(q, 0, DNS_HDRSIZE);
+  q[0] = lr->lr_id >> 8; q[1] = lr->lr_id;
+  q[2] = lr->lr_f1;
+  q[5] = 1;
+  ql = dns_dnlen(lr->lr_dn);
+  memcpy(q + DNS_HDRSIZE, lr->lr_dn, ql);
+  p = q + DNS_HDRSIZE + ql;
+  p[0] = lr->lr_qtype >> 8; p[1] = lr->lr_qtype;
+  p[2] = lr->lr_qclass >> 8; p[3] = lr->lr_qclass;
+  m = pb_bytes(m, DTM_QUERY_MESSAGE, q, p + 4 - q);
+
+  m = pb_uint(m, DTM_RESPONSE_TIME_SEC, lr->lr_time);
+  if (wire && lr->lr_wirelen)
+    m = pb_bytes(m, DTM_RESPONSE_MESSAGE, wire, lr->lr_wirelen);
+
+  /* frame: length, then Dnstap message wrapping the Message */
+  f = p = dt->dt_buf + dt->dt_len + 4;
+  if (dt->dt_ident)
+    p = pb_bytes(p, DT_IDENTITY, dt->dt_ident, strlen(dt->dt_ident));
+  if (dt->dt_version)
+    p = pb_bytes(p, DT_VERSION, dt->dt_version, strlen(dt->dt_version));
+  p = pb_bytes(p, DT_MESSAGE, msg, m - msg);
+  p = pb_uint(p, DT_TYPE, DT_TYPE_MESSAGE);
+  put32(f - 4, p - f);
+  dt->dt_len = p - dt->dt_buf;
+  ++dt->dt_frames;
+}
@@ -167,6 +167,7 @@ static int ds_generic_lt(const struct entry *a, const struct entry *b) {
 
 static void ds_generic_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
+  unsigned long tm = dsclock();
   if (dsd->n) {
 
 #   define QSORT_TYPE struct entry
@@ -174,6 +175,7 @@ static void ds_generic_finish(struct dataset *ds, struct dsctx *dsc) {
 #   define QSORT_NELT dsd->n
 #   define QSORT_LT(a,b) ds_generic_lt(a,b)
 #   include "qsort.c"
+    dsprofstep(&ds->ds_prof.dp_sort, &tm);
 
     /* collect all equal DNs to point to the same place */
     { struct entry *e, *t;
@@ -183,6 +185,7 @@ static void ds_generic_finish(struct dataset *ds, struct dsctx *dsc) {
     }
     SHRINK_ARRAY(struct entry, dsd->e, dsd->n, dsd->a);
   }
+  ds->ds_prof.dp_earr = (unsigned long)dsd->a * sizeof(struct entry);
   dsloaded(dsc, "e=%u", dsd->n);
 }
 
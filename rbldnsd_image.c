@@ -0,0 +1,385 @@
+/* Binary images of loaded datasets: written by `rbldnsd -I dir' after
+ * loading data files, and mapped read-only (-i dir) instead of parsing
+ * the files again when the files did not change since.
+ *
+ * An image is a header followed by a list of source files with their
+ * timestamps and sizes, the dataset-wide data ($SOA, $NS, $TTL, $n
+ * substitutions and $TIMESTAMP) and type-specific data which is used
+ * in place.  Every item is padded to 8 bytes.  There are no pointers
+ * in an image, only offsets, but the layout is that of the host which
+ * wrote it, so images are rejected on hosts with different byte order
+ * or word size.  Besides the checksum, every name and offset is checked
+ * against the size of the image when it is mapped, so that a damaged
+ * image is rejected instead of being read past its end at query time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include "rbldnsd.h"
+
+#define IMG_MAGIC	"RBLDIMG"
+#define IMG_VERSION	1
+#define IMG_ORDER	0x01020304u
+
+const char *imgdir;
+
+struct imghdr {
+  char ih_magic[8];		/* IMG_MAGIC */
+  unsigned ih_version;		/* IMG_VERSION */
+  unsigned ih_order;		/* IMG_ORDER as seen by the writer */
+  unsigned ih_wordsize;		/* sizeof(void*) of the writer */
+  unsigned ih_nfiles;		/* number of data files */
+  char ih_type[16];		/* dataset type name */
+  unsigned long ih_size;	/* size of the image after the header */
+  unsigned long ih_sum1, ih_sum2; /* checksum of the same */
+};
+
+struct imgfile {		/* one data file the image was made from */
+  time_t if_stamp;
+  off_t if_size;
+  unsigned if_namelen;		/* length of the name which follows */
+};
+
+struct imgds {			/* dataset-wide data */
+  time_t id_stamp, id_expires;
+  unsigned id_ttl, id_nsttl;
+  unsigned id_soa;		/* dssoa and 2 DNs follow if set */
+  unsigned id_nns;		/* number of NS DNs following */
+  unsigned id_subst[11];	/* length of substitution strings + 1 */
+};
+
+struct imgw {
+  FILE *f;
+  unsigned long size;
+  unsigned long sum1, sum2;
+};
+
+#define IMG_PAD(len) (((len) + 7) & ~7ul)
+
+/* Fletcher-like checksum, cheap to verify on every load.  Detects
+ * damaged or truncated images, not deliberate modifications. */
+static void
+imgsum(const unsigned char *p, unsigned long len,
+       unsigned long *sum1, unsigned long *sum2) {
+  unsigned long a = *sum1, b = *sum2;
+  const unsigned char *e = p + len;
+  while(p < e) {
+    a += *p++;
+    b += a;
+  }
+  *sum1 = a; *sum2 = b;
+}
+
+void img_put(struct imgw *iw, const void *data, unsigned long len) {
+  static const char zeros[8];
+  unsigned long pad = IMG_PAD(len) - len;
+  imgsum((const unsigned char*)data, len, &iw->sum1, &iw->sum2);
+  imgsum((const unsigned char*)zeros, pad, &iw->sum1, &iw->sum2);
+  fwrite(data, 1, len, iw->f);
+  fwrite(zeros, 1, pad, iw->f);
+  iw->size += len + pad;
+}
+
+const void *img_get(struct imgr *ir, unsigned long len) {
+  const char *p = ir->ir_p;
+  if (len > (unsigned long)(ir->ir_e - p) ||
+      IMG_PAD(len) > (unsigned long)(ir->ir_e - p))
+    return NULL;
+  ir->ir_p = p + IMG_PAD(len);
+  return p;
+}
+
+/* next domain name in the image, which must be well-formed and end
+ * before the image does, with its length in *lenp; NULL if it is not */
+static const unsigned char *img_getdn(struct imgr *ir, unsigned *lenp) {
+  const unsigned char *dn = (const unsigned char*)ir->ir_p;
+  const unsigned char *e = (const unsigned char*)ir->ir_e;
+  const unsigned char *p = dn;
+  while(p < e && *p) {
+    if (*p > DNS_MAXLABEL)
+      return NULL;
+    p += *p + 1;
+  }
+  if (p >= e || p + 1 - dn > DNS_MAXDN)
+    return NULL;
+  *lenp = p + 1 - dn;
+  return (const unsigned char*)img_get(ir, *lenp);
+}
+
+/* dataset types which can be saved in an image */
+static const struct imgtype {
+  const struct dstype *it_type;
+  int (*it_save)(const struct dataset *ds, struct imgw *iw);
+  int (*it_map)(struct dataset *ds, struct imgr *ir, struct dsctx *dsc);
+} imgtypes[] = {
+  { dstype(ip4set), ds_ip4set_saveimg, ds_ip4set_mapimg },
+  { NULL, NULL, NULL }
+};
+
+static const struct imgtype *imgtype(const struct dstype *dst) {
+  const struct imgtype *it;
+  for(it = imgtypes; it->it_type; ++it)
+    if (it->it_type == dst)
+      return it;
+  return NULL;
+}
+
+/* image file name: dir/type:spec.img with slashes in spec replaced */
+static void imgname(char *buf, unsigned bufsz,
+                    const char *dir, const struct dataset *ds) {
+  char *p;
+  unsigned l = ssprintf(buf, bufsz, "%s/%s:", dir, ds->ds_type->dst_name);
+  ssprintf(buf + l, bufsz - l, "%s.img", ds->ds_spec);
+  for(p = buf + l; *p; ++p)
+    if (*p == '/')
+      *p = '_';
+}
+
+int writeimage(const struct dataset *ds, const char *dir) {
+  const struct imgtype *it = imgtype(ds->ds_type);
+  char name[1024], tmp[1040];
+  struct imghdr ih;
+  struct imgw iw;
+  struct imgds id;
+  struct dsfile *dsf;
+  struct dsns *dsns;
+  struct dsctx dsc;
+  unsigned i;
+  int r;
+
+  memset(&dsc, 0, sizeof(dsc));
+  dsc.dsc_ds = (struct dataset *)ds;
+  if (!it) {
+    dslog(LOG_INFO, &dsc, "images are not supported for this type, skipping");
+    return 1;
+  }
+  imgname(name, sizeof(name), dir, ds);
+  ssprintf(tmp, sizeof(tmp), "%s.tmp", name);
+  if (!(iw.f = fopen(tmp, "wb"))) {
+    dslog(LOG_ERR, &dsc, "unable to create %s: %s", tmp, strerror(errno));
+    return 0;
+  }
+  iw.size = iw.sum1 = iw.sum2 = 0;
+
+  memset(&ih, 0, sizeof(ih));
+  fwrite(&ih, sizeof(ih), 1, iw.f);	/* filled in when done */
+
+  for(dsf = ds->ds_dsf, i = 0; dsf; dsf = dsf->dsf_next, ++i) {
+    struct imgfile imf;
+    memset(&imf, 0, sizeof(imf));
+    imf.if_stamp = dsf->dsf_stamp;
+    imf.if_size = dsf->dsf_size;
+    imf.if_namelen = strlen(dsf->dsf_name);
+    img_put(&iw, &imf, sizeof(imf));
+    img_put(&iw, dsf->dsf_name, imf.if_namelen);
+  }
+
+  memset(&id, 0, sizeof(id));
+  id.id_stamp = ds->ds_stamp;
+  id.id_expires = ds->ds_expires;
+  id.id_ttl = ds->ds_ttl;
+  id.id_nsttl = ds->ds_nsttl;
+  id.id_soa = ds->ds_dssoa != NULL;
+  for(dsns = ds->ds_dsns; dsns; dsns = dsns->dsns_next)
+    ++id.id_nns;
+  for(r = 0; r < 11; ++r)
+    if (ds->ds_subst[r])
+      id.id_subst[r] = strlen(ds->ds_subst[r]) + 1;
+  img_put(&iw, &id, sizeof(id));
+  if (ds->ds_dssoa) {
+    struct dssoa dssoa = *ds->ds_dssoa;
+    dssoa.dssoa_odn = dssoa.dssoa_pdn = NULL;
+    img_put(&iw, &dssoa, sizeof(dssoa));
+    img_put(&iw, ds->ds_dssoa->dssoa_odn, dns_dnlen(ds->ds_dssoa->dssoa_odn));
+    img_put(&iw, ds->ds_dssoa->dssoa_pdn, dns_dnlen(ds->ds_dssoa->dssoa_pdn));
+  }
+  for(dsns = ds->ds_dsns; dsns; dsns = dsns->dsns_next)
+    img_put(&iw, dsns->dsns_dn, dns_dnlen(dsns->dsns_dn));
+  for(r = 0; r < 11; ++r)
+    if (ds->ds_subst[r])
+      img_put(&iw, ds->ds_subst[r], id.id_subst[r]);
+
+  r = it->it_save(ds, &iw);
+
+  memcpy(ih.ih_magic, IMG_MAGIC, sizeof(IMG_MAGIC));
+  ih.ih_version = IMG_VERSION;
+  ih.ih_order = IMG_ORDER;
+  ih.ih_wordsize = sizeof(void*);
+  ih.ih_nfiles = i;
+  strncpy(ih.ih_type, ds->ds_type->dst_name, sizeof(ih.ih_type) - 1);
+  ih.ih_size = iw.size;
+  ih.ih_sum1 = iw.sum1;
+  ih.ih_sum2 = iw.sum2;
+  if (r) {
+    rewind(iw.f);
+    fwrite(&ih, sizeof(ih), 1, iw.f);
+    fflush(iw.f);
+    r = !ferror(iw.f);
+  }
+  if (fclose(iw.f) != 0)
+    r = 0;
+  if (!r || rename(tmp, name) < 0) {
+    dslog(LOG_ERR, &dsc, "unable to write %s: %s", tmp,
+          r ? strerror(errno) : "write error");
+    unlink(tmp);
+    return 0;
+  }
+  dslog(LOG_INFO, &dsc, "image written to %s, %lu bytes",
+        name, ih.ih_size + sizeof(ih));
+  return 1;
+}
+
+/* check the image for ds and map it, filling in everything but
+ * type-specific data which is up to the type.  Return 1 if loaded,
+ * 0 if there's no usable image (and the files should be read). */
+int mapimage(struct dataset *ds, struct dsctx *dsc) {
+  const struct imgtype *it = imgtype(ds->ds_type);
+  char name[1024];
+  const struct imghdr *ih;
+  const struct imgds *id;
+  struct imgr ir;
+  struct dsfile *dsf;
+  struct stat st;
+  unsigned long sum1 = 0, sum2 = 0;
+  const char *why;
+  char *img;
+  int fd, r;
+
+  if (!it)
+    return 0;
+  imgname(name, sizeof(name), imgdir, ds);
+  if ((fd = open(name, O_RDONLY)) < 0) {
+    if (errno != ENOENT)
+      dslog(LOG_WARNING, dsc, "unable to open %s: %s", name, strerror(errno));
+    return 0;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*ih))
+    img = MAP_FAILED;
+  else
+    img = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (img == MAP_FAILED) {
+    dslog(LOG_WARNING, dsc, "unable to map %s", name);
+    return 0;
+  }
+  ds->ds_img = img;
+  ds->ds_imgsz = st.st_size;
+
+#define bad(msg) do { why = msg; goto bad; } while(0)
+  ih = (const struct imghdr *)img;
+  if (memcmp(ih->ih_magic, IMG_MAGIC, sizeof(IMG_MAGIC)) != 0)
+    bad("not an image");
+  if (ih->ih_version != IMG_VERSION || ih->ih_order != IMG_ORDER ||
+      ih->ih_wordsize != sizeof(void*))
+    bad("image made by incompatible version or host");
+  if (strncmp(ih->ih_type, ds->ds_type->dst_name, sizeof(ih->ih_type)) != 0)
+    bad("image of another dataset type");
+  if (ih->ih_size != st.st_size - sizeof(*ih))
+    bad("image is truncated");
+  ir.ir_p = img + sizeof(*ih);
+  ir.ir_e = ir.ir_p + ih->ih_size;
+  imgsum((const unsigned char*)ir.ir_p, ih->ih_size, &sum1, &sum2);
+  if (sum1 != ih->ih_sum1 || sum2 != ih->ih_sum2)
+    bad("checksum mismatch");
+
+  /* the image is for the same files, and they did not change since */
+  for(dsf = ds->ds_dsf, r = 0; dsf; dsf = dsf->dsf_next, ++r) {
+    const struct imgfile *imf = img_get(&ir, sizeof(*imf));
+    const char *fname;
+    if (!imf || !(fname = img_get(&ir, imf->if_namelen)) ||
+        imf->if_namelen != strlen(dsf->dsf_name) ||
+        memcmp(fname, dsf->dsf_name, imf->if_namelen) != 0)
+      bad("image is for other data files");
+    if (stat(dsf->dsf_name, &st) < 0 ||
+        st.st_mtime != imf->if_stamp || st.st_size != imf->if_size) {
+      dslog(LOG_INFO, dsc, "%s is out of date, reading data files", name);
+      goto fail;
+    }
+  }
+  if (r != (int)ih->ih_nfiles)
+    bad("image is for other data files");
+
+  if (!(id = img_get(&ir, sizeof(*id))))
+    bad("image is truncated");
+  if (id->id_soa) {
+    const struct dssoa *dssoa = img_get(&ir, sizeof(*dssoa));
+    const unsigned char *odn, *pdn;
+    unsigned odnlen, pdnlen;
+    if (!dssoa ||
+        !(odn = img_getdn(&ir, &odnlen)) ||
+        !(pdn = img_getdn(&ir, &pdnlen)))
+      bad("image is damaged");
+    if (!(ds->ds_dssoa = mp_talloc(ds->ds_mp, struct dssoa)) ||
+        !(ds->ds_dssoa->dssoa_odn = mp_memdup(ds->ds_mp, odn, odnlen)) ||
+        !(ds->ds_dssoa->dssoa_pdn = mp_memdup(ds->ds_mp, pdn, pdnlen)))
+      goto nomem;
+    ds->ds_dssoa->dssoa_ttl = dssoa->dssoa_ttl;
+    ds->ds_dssoa->dssoa_serial = dssoa->dssoa_serial;
+    memcpy(ds->ds_dssoa->dssoa_n, dssoa->dssoa_n, sizeof(dssoa->dssoa_n));
+  }
+  if (id->id_nns) {
+    struct dsns **dsnsp = &ds->ds_dsns, *dsns;
+    for(r = 0; r < (int)id->id_nns; ++r) {
+      unsigned dnlen;
+      const unsigned char *dn = img_getdn(&ir, &dnlen);
+      if (!dn)
+        bad("image is damaged");
+      dsns = (struct dsns*)
+        mp_alloc(ds->ds_mp, sizeof(struct dsns) + dnlen - 1, 1);
+      if (!dsns)
+        goto nomem;
+      memcpy(dsns->dsns_dn, dn, dnlen);
+      *dsnsp = dsns;
+      dsnsp = &dsns->dsns_next;
+      *dsnsp = NULL;
+    }
+  }
+  for(r = 0; r < 11; ++r) {
+    const char *s;
+    if (!id->id_subst[r])
+      continue;
+    if (!(s = img_get(&ir, id->id_subst[r])) || s[id->id_subst[r] - 1])
+      bad("image is damaged");
+    if (!(ds->ds_subst[r] = mp_strdup(ds->ds_mp, s)))
+      goto nomem;
+  }
+  ds->ds_stamp = id->id_stamp;
+  ds->ds_expires = id->id_expires;
+  ds->ds_ttl = id->id_ttl;
+  ds->ds_nsttl = id->id_nsttl;
+
+  if (!it->it_map(ds, &ir, dsc))
+    bad("image is damaged");
+
+  ir.ir_p = img + sizeof(*ih);
+  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
+    const struct imgfile *imf = img_get(&ir, sizeof(*imf));
+    img_get(&ir, imf->if_namelen);
+    dsf->dsf_stamp = imf->if_stamp;
+    dsf->dsf_size = imf->if_size;
+  }
+  return 1;
+#undef bad
+
+nomem:
+  why = "out of memory";
+bad:
+  dslog(LOG_WARNING, dsc, "%s: %s, reading data files", name, why);
+fail:
+  return 0;
+}
+
+void unmapimage(struct dataset *ds) {
+  if (ds->ds_img) {
+    munmap(ds->ds_img, ds->ds_imgsz);
+    ds->ds_img = NULL;
+  }
+}
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <syslog.h>
 #include "rbldnsd.h"
 
 struct entry {
@@ -18,8 +19,28 @@ struct dsdata {
   unsigned h[4];	/* hint, how much to allocate next time */
   struct entry *e[4];	/* entries */
   const char *def_rr;	/* default A and TXT RRs */
+  const char *rrs;	/* RRs of data mapped from an image, see below */
+  struct entry *o[4];	/* overlays with changes made by deltas, */
+  unsigned on[4];	/* ..their sizes */
+  struct dsdata *dadd, *ddel; /* entries added/removed by a delta file */
+  struct entry *ne[4];	/* new overlays with the delta applied, */
+  unsigned nn[4];	/* ..their sizes */
+  unsigned nlev;	/* ..and bitmask of levels they replace */
 };
 
+/* Entries mapped from an image (-i) keep offsets of their RRs from
+ * dsd->rrs instead of pointers, with 0 still meaning exclusion. */
+#define entrr(dsd, e) \
+  ((e)->rr && (dsd)->rrs ? (dsd)->rrs + (size_t)(e)->rr : (e)->rr)
+
+/* RR of overlay entries which hide all entries of the main array
+ * at their address */
+static const char delrr[1];
+#define DELRR delrr
+
+#define hasoverlay(dsd) \
+  ((dsd)->on[E32] || (dsd)->on[E24] || (dsd)->on[E16] || (dsd)->on[E08])
+
 /* indexes */
 #define E32 0
 #define E24 1
@@ -35,11 +56,20 @@ struct dsdata {
 #define M08 0xff000000u
 #define H08 0x00ffffffu
 
-definedstype(ip4set, DSTF_IP4REV, "set of (ip4 range, value) pairs");
+definedmergeable(ip4set, DSTF_IP4REV, "set of (ip4 range, value) pairs");
 
 static void ds_ip4set_reset(struct dsdata *dsd, int UNUSED unused_freeall) {
   unsigned r;
+  ds_ip4set_deltadrop(dsd);
+  if (dsd->rrs) {	/* arrays are in the image */
+    memset(dsd->e, 0, sizeof(dsd->e));
+    memset(dsd->n, 0, sizeof(dsd->n));
+    dsd->rrs = NULL;
+  }
   for (r = 0; r < 4; ++r) {
+    free(dsd->o[r]);
+    dsd->o[r] = NULL;
+    dsd->on[r] = 0;
     if (!dsd->e[r]) continue;
     free(dsd->e[r]);
     dsd->e[r] = NULL;
@@ -168,9 +198,80 @@ ds_ip4set_line(struct dataset *ds, char *s, struct dsctx *dsc) {
 
 }
 
+static int ds_ip4set_merge(struct dataset *ds, struct dataset *part) {
+  struct dsdata *dsd = ds->ds_dsd, *pd = part->ds_dsd;
+  struct entry *e;
+  unsigned r;
+  for(r = 0; r < 4; ++r) {
+    if (!pd->n[r])
+      continue;
+    if (!dsd->n[r]) {	/* just take the array */
+      if (dsd->e[r]) free(dsd->e[r]);
+      dsd->e[r] = pd->e[r];
+      dsd->n[r] = pd->n[r];
+      dsd->a[r] = pd->a[r];
+      pd->e[r] = NULL;
+      pd->n[r] = pd->a[r] = 0;
+      continue;
+    }
+    e = trealloc(struct entry, dsd->e[r], dsd->n[r] + pd->n[r]);
+    if (!e)
+      return 0;
+    memcpy(e + dsd->n[r], pd->e[r], pd->n[r] * sizeof(*e));
+    dsd->e[r] = e;
+    dsd->a[r] = dsd->n[r] += pd->n[r];
+  }
+  return 1;
+}
+
+#define ip4set_lt(a,b) \
+  ((a)->addr < (b)->addr ? 1 : \
+   (a)->addr > (b)->addr ? 0 : \
+   (a)->rr < (b)->rr)
+
+/* With time-sliced loading (-Q), large arrays are sorted in runs of
+ * SORT_RUN entries which are merged then, so that queries may be
+ * answered between the steps.  This needs a temporary copy of the
+ * array; without memory for it, sort the array in one go. */
+#define SORT_RUN 32768
+
+/* merge sorted runs of e[n], using t[n] */
+static void mergeruns(struct entry *e, unsigned n, struct entry *t) {
+  struct entry *src = e, *dst = t, *x, *tmp;
+  unsigned w, i, j, k, mid, end, c = 0;
+
+  for(w = SORT_RUN; w < n; w <<= 1) {
+    for(i = 0; i < n; i += w << 1) {
+      mid = n - i > w ? i + w : n;
+      end = n - mid > w ? mid + w : n;
+      x = dst + i;
+      for(j = i, k = mid; j < mid && k < end; ) {
+        *x++ = ip4set_lt(&src[k], &src[j]) ? src[k++] : src[j++];
+        if (!(++c % YIELD_LINES))
+          dsyield();
+      }
+      memcpy(x, src + j, (mid - j) * sizeof(*x));
+      x += mid - j;
+      memcpy(x, src + k, (end - k) * sizeof(*x));
+    }
+    tmp = src, src = dst, dst = tmp;
+  }
+  if (src != e)
+    memcpy(e, src, n * sizeof(*e));
+}
+
+/* memory taken by the entry arrays and overlays */
+static unsigned long earrsize(const struct dsdata *dsd) {
+  return (unsigned long)(dsd->a[E32] + dsd->a[E24] + dsd->a[E16] +
+                         dsd->a[E08] + dsd->on[E32] + dsd->on[E24] +
+                         dsd->on[E16] + dsd->on[E08]) * sizeof(struct entry);
+}
+
 static void ds_ip4set_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
-  unsigned r;
+  struct entry *b, *t;
+  unsigned r, i, m, k;
+  unsigned long tm;
   for(r = 0; r < 4; ++r) {
     if (!dsd->n[r]) {
       dsd->h[r] = 0;
@@ -180,23 +281,87 @@ static void ds_ip4set_finish(struct dataset *ds, struct dsctx *dsc) {
     while((dsd->h[r] >> 1) >= dsd->n[r])
       dsd->h[r] >>= 1;
 
-#   define QSORT_TYPE struct entry
-#   define QSORT_BASE dsd->e[r]
-#   define QSORT_NELT dsd->n[r]
-#   define QSORT_LT(a,b) \
-       a->addr < b->addr ? 1 : \
-       a->addr > b->addr ? 0 : \
-       a->rr < b->rr
-#   include "qsort.c"
+    tm = dsclock();
+    t = NULL;
+    if (ldyield && dsd->n[r] > SORT_RUN)
+      t = (struct entry *)malloc(dsd->n[r] * sizeof(*t));
+    m = t ? SORT_RUN : dsd->n[r];
+    for(i = 0; i < dsd->n[r]; i += m) {
+      b = dsd->e[r] + i;
+      k = dsd->n[r] - i < m ? dsd->n[r] - i : m;
+#     define QSORT_TYPE struct entry
+#     define QSORT_BASE b
+#     define QSORT_NELT k
+#     define QSORT_LT(a,b) ip4set_lt(a,b)
+#     include "qsort.c"
+      dsyield();
+    }
+    if (t) {
+      mergeruns(dsd->e[r], dsd->n[r], t);
+      free(t);
+    }
+    dsprofstep(&ds->ds_prof.dp_sort, &tm);
 
 #define ip4set_eeq(a,b) a.addr == b.addr && rrs_equal(a,b)
     REMOVE_DUPS(struct entry, dsd->e[r], dsd->n[r], ip4set_eeq);
+    dsprofstep(&ds->ds_prof.dp_dedup, &tm);
     SHRINK_ARRAY(struct entry, dsd->e[r], dsd->n[r], dsd->a[r]);
   }
+  ds->ds_prof.dp_earr = earrsize(dsd);
   dsloaded(dsc, "e32/24/16/8=%u/%u/%u/%u",
            dsd->n[E32], dsd->n[E24], dsd->n[E16], dsd->n[E08]);
 }
 
+/* Delta files: entries of `+' lines are collected in dsd->dadd and
+ * of `-' lines in dsd->ddel, parsed the same way as regular lines.
+ * Changes are not made to the (possibly large, or mapped from an image)
+ * main arrays but kept in a small sorted overlay for every level: all
+ * entries at an address found in the overlay replace those of the main
+ * array, and a DELRR entry says there are none.  Queries look into the
+ * overlay first.  ds_ip4set_deltafinish() builds new overlays while the
+ * current ones are still in use, merging the changed addresses into
+ * them, so it takes time proportional to the size of the overlay and
+ * the delta, not of the whole data.  Entries at an address which is
+ * being removed are all dropped, then entries being added are inserted,
+ * so a `-' line together with a `+' line replace the value.
+ * ds_ip4set_deltaswap() puts the new overlays in place, and after a
+ * full load of the dataset folds them into the main arrays. */
+
+void ds_ip4set_deltadrop(struct dsdata *dsd) {
+  unsigned r;
+  struct dsdata *pd[2];
+  pd[0] = dsd->dadd; pd[1] = dsd->ddel;
+  for(r = 0; r < 4; ++r) {
+    if (pd[0]) free(pd[0]->e[r]);
+    if (pd[1]) free(pd[1]->e[r]);
+    if (dsd->nlev & (1u << r)) free(dsd->ne[r]);
+    dsd->ne[r] = NULL;
+    dsd->nn[r] = 0;
+  }
+  free(pd[0]);
+  free(pd[1]);
+  dsd->dadd = dsd->ddel = NULL;
+  dsd->nlev = 0;
+}
+
+int ds_ip4set_deltaline(struct dataset *ds, char *s, int del,
+                        struct dsctx *dsc) {
+  struct dsdata *dsd = ds->ds_dsd;
+  struct dsdata **pd = del ? &dsd->ddel : &dsd->dadd;
+  struct dataset tds;
+  if (*s == ':') {
+    dswarn(dsc, "default value can not be changed by a delta");
+    return 1;
+  }
+  if (!*pd) {
+    *pd = tzalloc(struct dsdata);
+    (*pd)->def_rr = dsd->def_rr ? dsd->def_rr : def_rr;
+  }
+  tds = *ds;
+  tds.ds_dsd = *pd;
+  return ds_ip4set_line(&tds, s, dsc);
+}
+
 static const struct entry *
 ds_ip4set_find(const struct entry *e, int b, ip4addr_t q) {
   int a = 0, m;
@@ -214,6 +379,411 @@ ds_ip4set_find(const struct entry *e, int b, ip4addr_t q) {
   return NULL;
 }
 
+/* first entry in e[a..b) with address >= q */
+static unsigned
+ds_ip4set_lbound(const struct entry *e, unsigned a, unsigned b, ip4addr_t q) {
+  while(a < b) {
+    unsigned m = (a + b) >> 1;
+    if (e[m].addr < q) a = m + 1;
+    else b = m;
+  }
+  return a;
+}
+
+/* make room for n entries in e allocated for *a */
+static struct entry *
+ds_ip4set_grow(struct entry *e, unsigned *a, unsigned n) {
+  if (n > *a) {
+    while(n > *a)
+      *a <<= 1;
+    e = trealloc(struct entry, e, *a);
+  }
+  return e;
+}
+
+int ds_ip4set_deltafinish(struct dataset *ds, struct dsctx *dsc) {
+  struct dsdata *dsd = ds->ds_dsd;
+  unsigned r, added = 0, removed = 0;
+
+  for(r = 0; r < 4; ++r) {
+    const struct entry *o = dsd->o[r], *a, *d, *c, *t;
+    unsigned on = dsd->on[r], na, nd, i, j, k, m, g, p, alloc;
+    struct entry *ne;
+    int ov;
+
+    na = dsd->dadd ? dsd->dadd->n[r] : 0;
+    nd = dsd->ddel ? dsd->ddel->n[r] : 0;
+    if (!na && !nd)
+      continue;		/* unchanged level */
+#   undef QSORT_TYPE
+#   undef QSORT_BASE
+#   undef QSORT_NELT
+#   undef QSORT_LT
+#   define QSORT_TYPE struct entry
+#   define QSORT_LT(a,b) a->addr < b->addr
+    if (na) {
+#     define QSORT_BASE dsd->dadd->e[r]
+#     define QSORT_NELT na
+#     include "qsort.c"
+#     undef QSORT_BASE
+#     undef QSORT_NELT
+    }
+    if (nd) {
+#     define QSORT_BASE dsd->ddel->e[r]
+#     define QSORT_NELT nd
+#     include "qsort.c"
+    }
+    a = na ? dsd->dadd->e[r] : NULL;
+    d = nd ? dsd->ddel->e[r] : NULL;
+
+    alloc = on + na + nd;
+    ne = trealloc(struct entry, NULL, alloc);
+    i = j = k = m = 0;
+    for(;;) {
+      ip4addr_t q;
+      int del = 0;
+      /* next address where something changes */
+      if (j < na && (k >= nd || a[j].addr <= d[k].addr))
+        q = a[j].addr;
+      else if (k < nd)
+        q = d[k].addr;
+      else
+        break;
+      /* overlay entries before it are copied as is */
+      p = ds_ip4set_lbound(o, i, on, q);
+      ne = ds_ip4set_grow(ne, &alloc, m + p - i);
+      memcpy(ne + m, o + i, (p - i) * sizeof(*ne));
+      m += p - i;
+      i = p;
+      while(k < nd && d[k].addr == q)
+        ++k, del = 1;
+      /* current entries at q are in the overlay or in the main array */
+      if (i < on && o[i].addr == q) {
+        c = o + i;
+        while(i < on && o[i].addr == q)
+          ++i;
+        t = o + i;
+        ov = 1;
+      }
+      else {
+        c = dsd->n[r] ? ds_ip4set_find(dsd->e[r], dsd->n[r], q) : NULL;
+        t = dsd->e[r] + dsd->n[r];
+        ov = 0;
+      }
+      for(g = m; c && c < t && c->addr == q; ++c) {
+        if (ov && c->rr == DELRR)
+          continue;
+        if (del) {
+          ++removed;
+          continue;
+        }
+        ne = ds_ip4set_grow(ne, &alloc, m + 1);
+        ne[m].addr = q;
+        ne[m++].rr = ov ? c->rr : entrr(dsd, c);
+      }
+      for(; j < na && a[j].addr == q; ++j) {
+        for(p = g; p < m; ++p)
+          if (a[j].rr ? ne[p].rr && rrs_equal(a[j], ne[p]) : !ne[p].rr)
+            break;
+        if (p == m) {
+          ne = ds_ip4set_grow(ne, &alloc, m + 1);
+          if (a[j].rr)
+            ne[m] = a[j];
+          else {	/* exclusion goes first, as after sorting */
+            memmove(ne + g + 1, ne + g, (m - g) * sizeof(*ne));
+            ne[g] = a[j];
+          }
+          ++m, ++added;
+        }
+      }
+      /* nothing left at q: hide entries of the main array */
+      if (m == g && dsd->n[r] && ds_ip4set_find(dsd->e[r], dsd->n[r], q)) {
+        ne = ds_ip4set_grow(ne, &alloc, m + 1);
+        ne[m].addr = q;
+        ne[m++].rr = DELRR;
+      }
+    }
+    ne = ds_ip4set_grow(ne, &alloc, m + on - i);
+    memcpy(ne + m, o + i, (on - i) * sizeof(*ne));
+    m += on - i;
+
+    dsd->ne[r] = ne;
+    dsd->nn[r] = m;
+    dsd->nlev |= 1u << r;
+  }
+
+  if (dsd->dadd || dsd->ddel)
+    dslog(LOG_INFO, dsc, "delta: %u entries added, %u removed",
+          added, removed);
+  for(r = 0; r < 4; ++r) {
+    if (dsd->dadd) free(dsd->dadd->e[r]);
+    if (dsd->ddel) free(dsd->ddel->e[r]);
+  }
+  free(dsd->dadd);
+  free(dsd->ddel);
+  dsd->dadd = dsd->ddel = NULL;
+  return 1;
+}
+
+/* entries of level r with the overlay applied, RRs being pointers */
+static struct entry *
+ds_ip4set_mergelevel(const struct dsdata *dsd, unsigned r, unsigned *np) {
+  const struct entry *e = dsd->e[r], *et = e + dsd->n[r];
+  const struct entry *o = dsd->o[r], *ot = o + dsd->on[r];
+  struct entry *m, *p;
+  ip4addr_t q;
+
+  m = p = (struct entry*)emalloc((dsd->n[r] + dsd->on[r]) * sizeof(*m) + 1);
+  while(e < et || o < ot)
+    if (o < ot && (e >= et || o->addr <= e->addr)) {
+      q = o->addr;
+      for(; o < ot && o->addr == q; ++o)
+        if (o->rr != DELRR)
+          *p++ = *o;
+      while(e < et && e->addr == q)
+        ++e;
+    }
+    else {
+      p->addr = e->addr;
+      p->rr = entrr(dsd, e);
+      ++p, ++e;
+    }
+  *np = p - m;
+  return m;
+}
+
+/* copy of the data with the overlays applied, for dump and images */
+static void ds_ip4set_flatten(const struct dsdata *dsd, struct dsdata *fd) {
+  unsigned r;
+  memset(fd, 0, sizeof(*fd));
+  for(r = 0; r < 4; ++r)
+    fd->e[r] = ds_ip4set_mergelevel(dsd, r, &fd->n[r]);
+}
+
+static void ds_ip4set_flatfree(struct dsdata *fd) {
+  unsigned r;
+  for(r = 0; r < 4; ++r)
+    free(fd->e[r]);
+}
+
+void ds_ip4set_deltaswap(struct dataset *ds, int fold) {
+  struct dsdata *dsd = ds->ds_dsd;
+  struct entry *e;
+  unsigned r;
+  int l;
+  for(r = 0; r < 4; ++r) {
+    if (dsd->nlev & (1u << r)) {
+      free(dsd->o[r]);
+      dsd->o[r] = dsd->ne[r];
+      dsd->on[r] = dsd->nn[r];
+      dsd->ne[r] = NULL;
+      dsd->nn[r] = 0;
+    }
+    /* the whole data has just been loaded, so merging costs nothing
+     * new; arrays mapped from an image are left alone */
+    if (fold && dsd->on[r] && !dsd->rrs) {
+      e = ds_ip4set_mergelevel(dsd, r, &dsd->n[r]);
+      free(dsd->e[r]);
+      dsd->e[r] = e;
+      dsd->a[r] = dsd->n[r];
+      free(dsd->o[r]);
+      dsd->o[r] = NULL;
+      dsd->on[r] = 0;
+    }
+  }
+  dsd->nlev = 0;
+  ds->ds_prof.dp_earr = earrsize(dsd);
+  l = ssprintf(ds->ds_info, sizeof(ds->ds_info),
+               "e32/24/16/8=%u/%u/%u/%u%s",
+               dsd->n[E32], dsd->n[E24], dsd->n[E16], dsd->n[E08],
+               dsd->rrs ? " (image)" : "");
+  if (hasoverlay(dsd))
+    ssprintf(ds->ds_info + l, sizeof(ds->ds_info) - l,
+             " delta=%u/%u/%u/%u",
+             dsd->on[E32], dsd->on[E24], dsd->on[E16], dsd->on[E08]);
+}
+
+/* Image of the data: counts, the 4 entry arrays with RRs replaced by
+ * offsets, and the RRs themselves, each distinct RR stored once. */
+
+struct rrtab {		/* interned RRs */
+  char *buf;		/* RRs, after a 0 byte so no RR is at offset 0 */
+  unsigned long len, alloc;
+  unsigned long *hash;	/* offsets in buf, open addressing */
+  unsigned hsize, hcnt;
+};
+
+static unsigned rrlen(const char *rr) {
+  return 4 + strlen(rr + 4) + 1;
+}
+
+static unsigned rrhash(const char *rr, unsigned len) {
+  unsigned h = 2166136261u;
+  while(len--)
+    h = (h ^ (unsigned char)*rr++) * 16777619u;
+  return h;
+}
+
+/* offset of rr in t, adding it if not there, or 0 if out of memory */
+static unsigned long rrintern(struct rrtab *t, const char *rr) {
+  unsigned len = rrlen(rr), i;
+  unsigned long off;
+
+  if (t->hcnt * 2 >= t->hsize) {
+    unsigned hsize = t->hsize ? t->hsize << 1 : 1024;
+    unsigned long *hash = (unsigned long*)calloc(hsize, sizeof(*hash));
+    if (!hash)
+      return 0;
+    for(i = 0; i < t->hsize; ++i) {
+      unsigned j;
+      if (!(off = t->hash[i]))
+        continue;
+      j = rrhash(t->buf + off, rrlen(t->buf + off)) & (hsize - 1);
+      while(hash[j])
+        j = (j + 1) & (hsize - 1);
+      hash[j] = off;
+    }
+    free(t->hash);
+    t->hash = hash;
+    t->hsize = hsize;
+  }
+
+  i = rrhash(rr, len) & (t->hsize - 1);
+  while((off = t->hash[i]) != 0) {
+    if (rrlen(t->buf + off) == len && memcmp(t->buf + off, rr, len) == 0)
+      return off;
+    i = (i + 1) & (t->hsize - 1);
+  }
+
+  if (t->len + len > t->alloc) {
+    unsigned long alloc = t->alloc ? t->alloc : 4096;
+    char *buf;
+    while(t->len + len > alloc)
+      alloc <<= 1;
+    if (!(buf = (char*)realloc(t->buf, alloc)))
+      return 0;
+    t->buf = buf;
+    t->alloc = alloc;
+  }
+  off = t->len;
+  memcpy(t->buf + off, rr, len);
+  t->len += len;
+  t->hash[i] = off;
+  ++t->hcnt;
+  return off;
+}
+
+int ds_ip4set_saveimg(const struct dataset *ds, struct imgw *iw) {
+  const struct dsdata *dsd = ds->ds_dsd;
+  struct dsdata fd;
+  struct entry *ea[4];
+  struct rrtab t;
+  unsigned r, i;
+  int ok = 1;
+
+  memset(&t, 0, sizeof(t));
+  memset(ea, 0, sizeof(ea));
+  if (!(t.buf = (char*)malloc(t.alloc = 4096)))
+    return 0;
+  if (hasoverlay(dsd)) {	/* save the data with deltas applied */
+    ds_ip4set_flatten(dsd, &fd);
+    dsd = &fd;
+  }
+  t.buf[0] = '\0';
+  t.len = 1;
+
+  for(r = 0; r < 4 && ok; ++r) {
+    if (!dsd->n[r])
+      continue;
+    /* zeroed so padding in entries does not make images differ */
+    if (!(ea[r] = (struct entry*)calloc(dsd->n[r], sizeof(struct entry)))) {
+      ok = 0;
+      break;
+    }
+    for(i = 0; i < dsd->n[r]; ++i) {
+      const struct entry *e = dsd->e[r] + i;
+      unsigned long off = e->rr ? rrintern(&t, entrr(dsd, e)) : 0;
+      if (e->rr && !off) {
+        ok = 0;
+        break;
+      }
+      ea[r][i].addr = e->addr;
+      ea[r][i].rr = (const char *)off;
+    }
+  }
+
+  if (ok) {
+    img_put(iw, dsd->n, sizeof(dsd->n));
+    for(r = 0; r < 4; ++r)
+      img_put(iw, ea[r], dsd->n[r] * sizeof(struct entry));
+    img_put(iw, &t.len, sizeof(t.len));
+    img_put(iw, t.buf, t.len);
+  }
+
+  for(r = 0; r < 4; ++r)
+    free(ea[r]);
+  if (dsd == &fd)
+    ds_ip4set_flatfree(&fd);
+  free(t.buf);
+  free(t.hash);
+  return ok;
+}
+
+int ds_ip4set_mapimg(struct dataset *ds, struct imgr *ir, struct dsctx *dsc) {
+  struct dsdata *dsd = ds->ds_dsd;
+  const unsigned *n = (const unsigned*)img_get(ir, sizeof(dsd->n));
+  const struct entry *e[4];
+  const unsigned long *len;
+  const char *rrs;
+  unsigned r;
+
+  if (!n)
+    return 0;
+  for(r = 0; r < 4; ++r)
+    if (!(e[r] = (const struct entry*)
+                 img_get(ir, (unsigned long)n[r] * sizeof(struct entry))))
+      return 0;
+  if (!(len = (const unsigned long*)img_get(ir, sizeof(*len))) || !*len ||
+      !(rrs = (const char*)img_get(ir, *len)) || rrs[*len - 1])
+    return 0;
+  /* every RR is an A value and a TXT string: since the table ends
+   * with a zero byte, an offset leaving room for the A value is enough
+   * for all of it to be within the table */
+  for(r = 0; r < 4; ++r) {
+    const struct entry *p, *t = e[r] + n[r];
+    for(p = e[r]; p < t; ++p)
+      if (p->rr && (size_t)p->rr + 4 >= *len)
+        return 0;
+  }
+
+  dsd->rrs = rrs;
+  for(r = 0; r < 4; ++r) {
+    dsd->e[r] = (struct entry*)e[r];
+    dsd->n[r] = n[r];
+  }
+  dsloaded(dsc, "e32/24/16/8=%u/%u/%u/%u (image)",
+           dsd->n[E32], dsd->n[E24], dsd->n[E16], dsd->n[E08]);
+  return 1;
+}
+
+/* find entries for f on level r: e is the first, t the end of the
+ * array, *ov tells whether they are in the overlay */
+static const struct entry *
+ds_ip4set_level(const struct dsdata *dsd, unsigned r, ip4addr_t f,
+                const struct entry **t, int *ov) {
+  const struct entry *e;
+  if (dsd->on[r] && (e = ds_ip4set_find(dsd->o[r], dsd->on[r], f)) != NULL) {
+    *t = dsd->o[r] + dsd->on[r];
+    *ov = 1;
+    return e->rr == DELRR ? NULL : e;
+  }
+  if (!dsd->n[r])
+    return NULL;
+  *t = dsd->e[r] + dsd->n[r];
+  *ov = 0;
+  return ds_ip4set_find(dsd->e[r], dsd->n[r], f);
+}
+
 static int
 ds_ip4set_query(const struct dataset *ds, const struct dnsqinfo *qi,
                 struct dnspacket *pkt) {
@@ -222,14 +792,13 @@ ds_ip4set_query(const struct dataset *ds, const struct dnsqinfo *qi,
   ip4addr_t f;
   const struct entry *e, *t;
   const char *ipsubst;
+  int ov;
 
   if (!qi->qi_ip4valid) return 0;
   check_query_overwrites(qi);
 
 #define try(i,mask) \
- (dsd->n[i] && \
-  (t = dsd->e[i] + dsd->n[i], \
-   e = ds_ip4set_find(dsd->e[i], dsd->n[i], (f = q & mask))) != NULL)
+ ((e = ds_ip4set_level(dsd, i, (f = q & mask), &t, &ov)) != NULL)
 
   if (!try(E32, M32) &&
       !try(E24, M24) &&
@@ -240,7 +809,7 @@ ds_ip4set_query(const struct dataset *ds, const struct dnsqinfo *qi,
   if (!e->rr) return 0;		/* exclusion */
 
   ipsubst = (qi->qi_tflag & NSQUERY_TXT) ? ip4atos(q) : NULL;
-  do addrr_a_txt(pkt, qi->qi_tflag, e->rr, ipsubst, ds);
+  do addrr_a_txt(pkt, qi->qi_tflag, ov ? e->rr : entrr(dsd, e), ipsubst, ds);
   while(++e < t && e->addr == f);
 
   return NSQUERY_FOUND;
@@ -292,7 +861,8 @@ ds_ip4set_dump_group(const struct dumpdata *dd,
                      const struct entry *e, const struct entry *t) {
   ip4addr_t addr = e->addr;
   do
-    dump_ip4range(saddr, saddr | hmask, e->rr, dd->ds, dd->f);
+    dump_ip4range(saddr, saddr | hmask, entrr(dd->ds->ds_dsd, e),
+                  dd->ds, dd->f);
   while(++e < t && e->addr == addr);
   return e;
 }
@@ -337,7 +907,7 @@ ds_ip4set_dump32(struct dumpdata *dd, ip4addr_t last,
         ds_ip4set_dump_group(dd, m24, H24, u16, dd->t[E16]);
       /* else nothing: the upper-upper /16 is an exclusion anyway */
     }
-    dump_ip4(e->addr, e->rr, dd->ds, dd->f);
+    dump_ip4(e->addr, entrr(dd->ds->ds_dsd, e), dd->ds, dd->f);
     ++e;
   }
   dd->e[E32] = e;
@@ -434,12 +1004,23 @@ ds_ip4set_dump(const struct dataset *ds,
                const unsigned char UNUSED *unused_odn,
                FILE *f) {
   struct dumpdata dd;
+  struct dataset fds;
+  struct dsdata fd;
   const struct dsdata *dsd = ds->ds_dsd;
   unsigned i;
+  if (hasoverlay(dsd)) {	/* dump the data with deltas applied */
+    ds_ip4set_flatten(dsd, &fd);
+    fds = *ds;
+    fds.ds_dsd = &fd;
+    ds = &fds;
+    dsd = &fd;
+  }
   for(i = 0; i < 4; ++i)
     dd.t[i] = (dd.e[i] = dsd->e[i]) + dsd->n[i];
   dd.ds = ds;
   dd.f = f;
   ds_ip4set_dump08(&dd);
+  if (dsd == &fd)
+    ds_ip4set_flatfree(&fd);
 }
 #endif /* NO_MASTER_DUMP */
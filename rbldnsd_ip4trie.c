@@ -94,6 +94,7 @@ ds_ip4trie_line(struct dataset *ds, char *s, struct dsctx *dsc) {
 }
 
 static void ds_ip4trie_finish(struct dataset *ds, struct dsctx *dsc) {
+  ds->ds_prof.dp_trie = btrie_size(ds->ds_dsd->btrie);
   dsloaded(dsc, "%s", btrie_stats(ds->ds_dsd->btrie));
 }
 
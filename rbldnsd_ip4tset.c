@@ -73,6 +73,7 @@ static void ds_ip4tset_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
   ip4addr_t *e = dsd->e;
   unsigned n = dsd->n;
+  unsigned long tm = dsclock();
 
   if (!n)
     dsd->h = 0;
@@ -86,14 +87,17 @@ static void ds_ip4tset_finish(struct dataset *ds, struct dsctx *dsc) {
 #   define QSORT_NELT n
 #   define QSORT_LT(a,b) *a < *b
 #   include "qsort.c"
+    dsprofstep(&ds->ds_prof.dp_sort, &tm);
 
 #define ip4tset_eeq(a,b) a == b
     REMOVE_DUPS(ip4addr_t, e, n, ip4tset_eeq);
+    dsprofstep(&ds->ds_prof.dp_dedup, &tm);
     SHRINK_ARRAY(ip4addr_t, e, n, dsd->a);
     dsd->e = e;
     dsd->n = n;
   }
 
+  ds->ds_prof.dp_earr = (unsigned long)dsd->a * sizeof(ip4addr_t);
   if (!dsd->def_rr) dsd->def_rr = def_rr;
   dsloaded(dsc, "cnt=%u", n);
 }
@@ -95,6 +95,7 @@ ds_ip6trie_line(struct dataset *ds, char *s, struct dsctx *dsc)
 static void
 ds_ip6trie_finish(struct dataset *ds, struct dsctx *dsc)
 {
+  ds->ds_prof.dp_trie = btrie_size(ds->ds_dsd->btrie);
   dsloaded(dsc, "%s", btrie_stats(ds->ds_dsd->btrie));
 }
 
@@ -110,6 +110,7 @@ ds_ip6tset_line(struct dataset *ds, char *s, struct dsctx *dsc) {
 static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
   unsigned n;
+  unsigned long tm;
 
 #define ip6tset_eeq(a,b) memcmp(&a, &b, sizeof(a)) == 0
 #define QSORT_LT(a,b) (memcmp(a, b, sizeof(*a)) < 0)
@@ -125,6 +126,7 @@ static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
     while((dsd->a_hnt >> 1) >= n)
       dsd->a_hnt >>= 1;
 
+    tm = dsclock();
 #   define QSORT_TYPE struct ip6half
 #   define QSORT_BASE a
 #   define QSORT_NELT n
@@ -132,8 +134,10 @@ static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
 #   undef QSORT_NELT
 #   undef QSORT_BASE
 #   undef QSORT_TYPE
+    dsprofstep(&ds->ds_prof.dp_sort, &tm);
 
     REMOVE_DUPS(struct ip6half, a, n, ip6tset_eeq);
+    dsprofstep(&ds->ds_prof.dp_dedup, &tm);
     SHRINK_ARRAY(struct ip6half, a, n, dsd->a_alc);
     dsd->a = a;
     dsd->a_cnt = n;
@@ -150,6 +154,7 @@ static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
     while((dsd->e_hnt >> 1) >= n)
       dsd->e_hnt >>= 1;
 
+    tm = dsclock();
 #   define QSORT_TYPE struct ip6full
 #   define QSORT_BASE e
 #   define QSORT_NELT n
@@ -157,13 +162,17 @@ static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
 #   undef QSORT_NELT
 #   undef QSORT_BASE
 #   undef QSORT_TYPE
+    dsprofstep(&ds->ds_prof.dp_sort, &tm);
 
     REMOVE_DUPS(struct ip6full, e, n, ip6tset_eeq);
-    SHRINK_ARRAY(struct ip6full, e, n, dsd->a_alc);
+    dsprofstep(&ds->ds_prof.dp_dedup, &tm);
+    SHRINK_ARRAY(struct ip6full, e, n, dsd->e_alc);
     dsd->e = e;
     dsd->e_cnt = n;
   }
 
+  ds->ds_prof.dp_earr = (unsigned long)dsd->a_alc * sizeof(struct ip6half) +
+                        (unsigned long)dsd->e_alc * sizeof(struct ip6full);
   if (!dsd->def_rr) dsd->def_rr = def_rr;
   dsloaded(dsc, "cnt=%u exl=%u", dsd->a_cnt, dsd->e_cnt);
 }
@@ -2,6 +2,7 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <time.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -11,6 +12,9 @@
 #include <netdb.h>
 #include <syslog.h>
 #include "rbldnsd.h"
+#ifndef NO_STDINT_H
+# include <inttypes.h>	/* PRI_DNSCNT */
+#endif
 
 #ifndef NO_IPv6
 # ifndef NI_MAXHOST
@@ -25,6 +29,7 @@
 #define MAX_GLUE (MAX_NS*2)
 
 static int addrr_soa(struct dnspacket *pkt, const struct zone *zone, int auth);
+static int addrr_negsoa(struct dnspacket *pkt, const struct zone *zone);
 static int addrr_ns(struct dnspacket *pkt, const struct zone *zone, int auth);
 static int version_req(struct dnspacket *pkt, const struct dnsquery *qry);
 
@@ -59,6 +64,9 @@ static int version_req(struct dnspacket *pkt, const struct dnsquery *qry);
 #define p_arcnt1 10
 #define p_arcnt2 11
 #define p_hdrsize 12	/* size of packet header */
+
+/* TCP packets have larger buffer; replies are not limited by UDP size */
+#define istcp(pkt) ((pkt)->p_bufsz > DNS_EDNS0_MAXPACKET)
 /* next is a DN name, a series of labels with first byte is label's length,
  *  terminated by zero-length label (i.e. at least one zero byte is here)
  * next two bytes are query type (A, SOA etc)
@@ -70,7 +78,7 @@ parsequery(struct dnspacket *pkt, unsigned qlen,
            struct dnsquery *qry) {
 
   /* parsing incoming query.  Untrusted data read directly from the network.
-   * pkt->p_buf is a buffer - data that was read (DNS_EDNS0_MAXPACKET max).
+   * pkt->p_buf is a buffer - data that was read (pkt->p_bufsz max).
    * qlen is number of bytes actually read (packet length)
    * first p_hdrsize bytes is header, next is query DN,
    * next are QTYPE and QCLASS (2x2 bytes).
@@ -85,6 +93,9 @@ parsequery(struct dnspacket *pkt, unsigned qlen,
    * for non-EDNS0-aware clients it's pkt->p_buf+DNS_MAXPACKET, and
    * if a vaild EDNS0 UDPsize is given, it will be pkt->p_buf+UDPsize-11,
    * with the 11 bytes needed for a minimal OPT record.
+   * For TCP (pkt->p_bufsz > DNS_EDNS0_MAXPACKET), it's the end of the
+   * buffer, minus the same 11 bytes if the query had an OPT record.
+   * So there's room for an OPT record iff p_endp is before buffer end.
    * In replypacket() we check whenever all our answers fits in standard
    * UDP buffer size (DNS_MAXPACKET), and if not (which means we're replying
    * to EDNS0-aware client due to the above rules), we just add proper OPT
@@ -144,16 +155,19 @@ parsequery(struct dnspacket *pkt, unsigned qlen,
       q[1] == (DNS_T_OPT>>8) && q[2] == (DNS_T_OPT&255)) {
     qlen = (((unsigned)q[3]) << 8) | q[4];
     /* 11 bytes are needed to encode minimal EDNS0 OPT record */
-    if (qlen < DNS_MAXPACKET + 11)
+    if (istcp(pkt) || qlen > pkt->p_bufsz - 11)
+      qlen = pkt->p_bufsz - 11;
+    else if (qlen < DNS_MAXPACKET + 11)
       qlen = DNS_MAXPACKET;
-    else if (qlen > sizeof(pkt->p_buf) - 11)
-      qlen = sizeof(pkt->p_buf) - 11;
     else
       qlen -= 11;
     pkt->p_endp = d + qlen;
+    qry->q_edns = 1;
+  }
+  else {
+    pkt->p_endp = d + (istcp(pkt) ? pkt->p_bufsz : DNS_MAXPACKET);
+    qry->q_edns = 0;
   }
-  else
-    pkt->p_endp = d + DNS_MAXPACKET;
 
   return 1;
 }
@@ -272,22 +286,247 @@ findqzone(const struct zone *zone,
 # define do_stats(x)
 #else
 # define do_stats(x) x
+/* counters are kept in per-worker shards, see rbldnsd.c */
+# define gstats (pkt->p_stats[0])
+# define zstats (pkt->p_stats[zone->z_sidx])
+
+/* put the key of a dataset hit into the space-saving sketch: count it
+ * if it's there, or else let it replace the least counted entry, which
+ * it could have been at most (rbldnsd.h) */
+static void
+hitsample(struct dshits *h, const struct dataset *ds,
+          const struct dnsqinfo *qi) {
+  unsigned char ip4[4];
+  const unsigned char *key;
+  unsigned type, len;
+  struct hitent *e, *m;
+
+  if ((ds->ds_type->dst_flags & DSTF_IP4REV) && qi->qi_ip4valid) {
+    PACK32(ip4, qi->qi_ip4);
+    type = HIT_IP4, key = ip4, len = 4;
+  }
+  else if ((ds->ds_type->dst_flags & DSTF_IP6REV) && qi->qi_ip6valid)
+    type = HIT_IP6, key = qi->qi_ip6, len = IP6ADDR_FULL;
+  else
+    type = HIT_DN, key = qi->qi_dn, len = qi->qi_dnlen0;
+
+  for(e = m = h->h_top; e < h->h_top + HIT_TOPN; ++e) {
+    if (e->he_type == type && e->he_len == len &&
+        memcmp(e->he_key, key, len) == 0) {
+      e->he_cnt += 1;
+      return;
+    }
+    if (e->he_cnt < m->he_cnt)
+      m = e;
+  }
+  m->he_err = m->he_cnt;
+  m->he_cnt += 1;
+  m->he_type = type;
+  m->he_len = len;
+  memcpy(m->he_key, key, len);
+}
+
+/* count result of an ACL lookup */
+# define aclstats(st, f) \
+    ((f) & NSQUERY_IGNORE ? ++(st).a_ignore : \
+     (f) & NSQUERY_REFUSE ? ++(st).a_refuse : \
+     (f) & NSQUERY_EMPTY ? ++(st).a_empty : \
+     (f) & NSQUERY_ALWAYS ? ++(st).a_always : ++(st).a_pass)
+
+/* count a hit of a dataset, sampling it for the sketch */
+# define dshit(ds) do { \
+    struct dshits *h_ = &pkt->p_hits[(ds)->ds_sidx]; \
+    if (!(++h_->h_hits & (HIT_SAMPLE - 1))) \
+      hitsample(h_, ds, &qi); \
+  } while(0)
+#endif
+
+/* Answer cache.
+ * Complete answers to repeated queries are kept in a direct-mapped
+ * table, one per worker, so no locking is needed.  The key is
+ * lowercased query DN, type, class and the reply size limit as set up
+ * by parsequery() (which covers both EDNS0 size and TCP); the zone is
+ * implied by the query DN.  The header (except of ID) and everything
+ * after the question section is stored, so that a hit copies it after
+ * the question from the query (with original letter case) and keeps ID.
+ * Only answers which do not depend on the client are cached: no ACLs,
+ * no extension hooks and no "$=" (client address) substitution.
+ * Datasets of the zone which matched are remembered as a bitmask of
+ * their positions in z_dsl, and a hit counts them again for -W; when
+ * one of them is due to be sampled, the hit is turned into a miss so
+ * that the full lookup samples the key (answers of zones with more
+ * than 32 datasets, of which a later one matched, are not cached).
+ * All entries are invalidated by bumping anscache_gen on reload. */
+
+unsigned anscache_gen = 1;
+
+struct ansent {
+  unsigned ae_hash;
+  unsigned ae_gen;		/* anscache_gen when stored */
+  const struct zone *ae_zone;	/* zone this answer is from */
+  unsigned ae_qtype, ae_qclass;
+  unsigned ae_limit;		/* reply size limit: p_endp - p_buf */
+  unsigned ae_dnlen;		/* length of query DN */
+  unsigned ae_len;		/* length of answer after question */
+  int ae_trunc;			/* some data did not fit (p_trunc) */
+  unsigned ae_dsmask;		/* datasets which matched, by z_dsl position */
+  unsigned ae_size;		/* allocated size of ae_data */
+  unsigned char ae_hdr[p_hdrsize-2]; /* header, except of ID */
+  unsigned char ae_data[1];	/* query DN, then answer */
+};
+
+struct anscache {
+  unsigned ac_mask;		/* table size - 1 */
+  struct ansent **ac_tab;
+};
+
+struct anscache *anscache_new(unsigned size) {
+  struct anscache *ac = tmalloc(struct anscache);
+  unsigned n = 1;
+  while(n < size)
+    n <<= 1;
+  ac->ac_mask = n - 1;
+  ac->ac_tab = (struct ansent **)ezalloc(n * sizeof(struct ansent *));
+  return ac;
+}
+
+static unsigned
+anscache_hash(const struct dnsquery *qry, unsigned limit) {
+  const unsigned char *p = qry->q_dn, *e = p + qry->q_dnlen;
+  unsigned h = 2166136261u;	/* FNV-1a */
+  while(p < e)
+    h = (h ^ *p++) * 16777619u;
+  h = (h ^ qry->q_type) * 16777619u;
+  h = (h ^ qry->q_class) * 16777619u;
+  return (h ^ limit) * 16777619u;
+}
+
+#define ae_match(e, qry, hash, limit) \
+  ((e)->ae_hash == (hash) && (e)->ae_gen == anscache_gen && \
+   (e)->ae_qtype == (qry)->q_type && (e)->ae_qclass == (qry)->q_class && \
+   (e)->ae_limit == (limit) && (e)->ae_dnlen == (qry)->q_dnlen && \
+   memcmp((e)->ae_data, (qry)->q_dn, (qry)->q_dnlen) == 0)
+
+/* look up cached answer, return its length or 0 */
+static unsigned
+anscache_get(struct dnspacket *pkt, const struct dnsquery *qry,
+             unsigned hash, unsigned UNUSED qlen) {
+  const struct ansent *e =
+    pkt->p_cache->ac_tab[hash & pkt->p_cache->ac_mask];
+  const unsigned limit = pkt->p_endp - pkt->p_buf;
+  unsigned char *h = pkt->p_buf;
+#ifndef NO_STATS
+  const struct zone *zone;
+  const struct dslist *dsl;
+  unsigned m;
+#endif
+
+  if (!e || !ae_match(e, qry, hash, limit)) {
+    do_stats(gstats.c_miss += 1);
+    return 0;
+  }
+#ifndef NO_STATS
+  /* let a hit which would be sampled go the full way */
+  dsl = e->ae_zone->z_dsl;
+  for(m = e->ae_dsmask; m; m >>= 1, dsl = dsl->dsl_next)
+    if ((m & 1) &&
+        !((pkt->p_hits[dsl->dsl_ds->ds_sidx].h_hits + 1) & (HIT_SAMPLE - 1))) {
+      gstats.c_miss += 1;
+      return 0;
+    }
+  dsl = e->ae_zone->z_dsl;
+  for(m = e->ae_dsmask; m; m >>= 1, dsl = dsl->dsl_next)
+    if (m & 1)
+      pkt->p_hits[dsl->dsl_ds->ds_sidx].h_hits += 1;
+#endif
+  /* keep RD flag of the query */
+  h[p_f1] = (e->ae_hdr[0] & ~pf1_rd) | (h[p_f1] & pf1_rd);
+  memcpy(h + p_f2, e->ae_hdr + 1, sizeof(e->ae_hdr) - 1);
+  memcpy(pkt->p_sans, e->ae_data + e->ae_dnlen, e->ae_len);
+  pkt->p_cur = pkt->p_sans + e->ae_len;
+  do_stats(zone = e->ae_zone;
+           pkt->p_sidx = zone->z_sidx; pkt->p_trunc = e->ae_trunc;
+           gstats.c_hit += 1;
+           zstats.b_in += qlen; zstats.b_out += pkt->p_cur - h;
+           if (h[p_f2] == DNS_R_NXDOMAIN) zstats.q_nxd += 1;
+           else zstats.q_ok += 1);
+  return pkt->p_cur - h;
+}
+
+/* remember an answer in the cache */
+static void
+anscache_put(struct dnspacket *pkt, const struct dnsquery *qry,
+             unsigned hash, const struct zone *zone, unsigned dsmask) {
+  struct ansent **ep = &pkt->p_cache->ac_tab[hash & pkt->p_cache->ac_mask];
+  struct ansent *e = *ep;
+  const unsigned limit = pkt->p_endp - pkt->p_buf;
+  unsigned len = pkt->p_cur - pkt->p_sans;
+  unsigned size = qry->q_dnlen + len;
+
+#ifndef NO_STATS
+  if (e && e->ae_gen == anscache_gen && !ae_match(e, qry, hash, limit))
+    gstats.c_evict += 1;
+#endif
+  if (!e || e->ae_size < size) {
+    free(e);
+    *ep = e = (struct ansent *)malloc(sizeof(*e) + size);
+    if (!e)
+      return;
+    e->ae_size = size;
+  }
+  e->ae_hash = hash;
+  e->ae_gen = anscache_gen;
+  e->ae_zone = zone;
+  e->ae_qtype = qry->q_type;
+  e->ae_qclass = qry->q_class;
+  e->ae_limit = limit;
+  e->ae_dnlen = qry->q_dnlen;
+  e->ae_len = len;
+  do_stats(e->ae_trunc = pkt->p_trunc);
+  e->ae_dsmask = dsmask;
+  memcpy(e->ae_hdr, pkt->p_buf + p_f1, sizeof(e->ae_hdr));
+  memcpy(e->ae_data, qry->q_dn, qry->q_dnlen);
+  memcpy(e->ae_data + qry->q_dnlen, pkt->p_sans, len);
+}
+
+#undef ae_match
+
+/* minimal EDNS0 OPT record we add to long replies */
+static const unsigned char optrr[11] = {
+  0,				/* empty (root) DN */
+  DNS_T_OPT >> 8, DNS_T_OPT & 255,
+  DNS_EDNS0_MAXPACKET >> 8, DNS_EDNS0_MAXPACKET & 255,
+  0, 0,				/* RCODE and version */
+  0, 0,				/* rest of the TTL field */
+  0, 0				/* RDLEN */
+};
+
+#ifndef NO_DSO
+# define hooked() (hook_query_access || hook_query_result)
+#else
+# define hooked() 0
 #endif
 
 /* construct reply to a query. */
-int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
+static int
+doreply(struct dnspacket *pkt, unsigned qlen, struct zone *zone,
+        struct dnsquery *qry) {
 
-  struct dnsquery qry;			/* query structure */
   struct dnsqinfo qi;			/* query info structure */
   unsigned char *h = pkt->p_buf;	/* packet's header */
   const struct dslist *dsl;
-  int found;
+  int found, r;
+  int cache = 0;			/* answer may be cached */
+  unsigned dsbit, dsmask = 0;		/* datasets which matched, for it */
+  unsigned hash = 0;			/* its hash in the answer cache */
   extern int lazy; /*XXX hack*/
 
   pkt->p_substrr = 0;
+  do_stats(pkt->p_sidx = 0);
   /* check global ACL */
   if (g_dsacl && g_dsacl->ds_stamp) {
     found = ds_acl_query(g_dsacl, pkt);
+    do_stats(aclstats(gstats, found));
     if (found & NSQUERY_IGNORE) {
       do_stats(gstats.q_err += 1; gstats.b_in += qlen);
       return 0;
@@ -296,7 +535,7 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
   else
     found = 0;
 
-  if (!parsequery(pkt, qlen, &qry)) {
+  if (!parsequery(pkt, qlen, qry)) {
     do_stats(gstats.q_err += 1; gstats.b_in += qlen);
     return 0;
   }
@@ -324,17 +563,27 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
     refuse(DNS_R_NOTIMPL);
   }
   h[p_f1] |= pf1_qr;
-  if (qry.q_class == DNS_C_IN)
+
+  if (pkt->p_cache && !(g_dsacl && g_dsacl->ds_stamp) && !hooked() &&
+      (qry->q_class == DNS_C_IN || qry->q_class == DNS_C_ANY)) {
+    unsigned r;
+    hash = anscache_hash(qry, pkt->p_endp - h);
+    if ((r = anscache_get(pkt, qry, hash, qlen)) != 0)
+      return r;
+    cache = 1;
+  }
+
+  if (qry->q_class == DNS_C_IN)
     h[p_f1] |= pf1_aa;
-  else if (qry.q_class != DNS_C_ANY) {
-    if (version_req(pkt, &qry)) {
+  else if (qry->q_class != DNS_C_ANY) {
+    if (version_req(pkt, qry)) {
       do_stats(gstats.q_ok += 1; gstats.b_in += qlen; gstats.b_out += rlen());
       return rlen();
     }
     else
       refuse(DNS_R_REFUSED);
   }
-  switch(qry.q_type) {
+  switch(qry->q_type) {
   case DNS_T_ANY: qi.qi_tflag = NSQUERY_ANY; break;
   case DNS_T_A:   qi.qi_tflag = NSQUERY_A;   break;
   case DNS_T_TXT: qi.qi_tflag = NSQUERY_TXT; break;
@@ -342,7 +591,7 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
   case DNS_T_SOA: qi.qi_tflag = NSQUERY_SOA; break;
   case DNS_T_MX:  qi.qi_tflag = NSQUERY_MX;  break;
   default:
-    if (qry.q_type >= DNS_T_TSIG)
+    if (qry->q_type >= DNS_T_TSIG)
       refuse(DNS_R_NOTIMPL);
     qi.qi_tflag = NSQUERY_OTHER;
   }
@@ -351,17 +600,19 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
 
   /* find matching zone */
   zone = (struct zone*)
-      findqzone(zone, qry.q_dnlen, qry.q_dnlab, qry.q_lptr, &qi);
+      findqzone(zone, qry->q_dnlen, qry->q_dnlab, qry->q_lptr, &qi);
   if (!zone) /* not authoritative */
     refuse(DNS_R_REFUSED);
 
   /* found matching zone */
 #undef refuse
 #define refuse(code)  _refuse(code, err_z)
-  do_stats(zone->z_stats.b_in += qlen);
+  do_stats(pkt->p_sidx = zone->z_sidx; zstats.b_in += qlen);
 
   if (zone->z_dsacl && zone->z_dsacl->ds_stamp) {
-    qi.qi_tflag |= ds_acl_query(zone->z_dsacl, pkt);
+    r = ds_acl_query(zone->z_dsacl, pkt);
+    do_stats(aclstats(zstats, r));
+    qi.qi_tflag |= r;
     if (qi.qi_tflag & NSQUERY_IGNORE) {
       do_stats(gstats.q_err += 1);
       return 0;
@@ -400,8 +651,16 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
     found = 0;
 
   /* search the datasets */
-  for(dsl = zone->z_dsl; dsl; dsl = dsl->dsl_next)
-    found |= dsl->dsl_queryfn(dsl->dsl_ds, &qi, pkt);
+  for(dsl = zone->z_dsl, dsbit = 1; dsl; dsl = dsl->dsl_next, dsbit <<= 1) {
+    r = dsl->dsl_queryfn(dsl->dsl_ds, &qi, pkt);
+    if (r) {
+      do_stats(dshit(dsl->dsl_ds));
+      if (!dsbit)
+        cache = 0;
+      dsmask |= dsbit;
+    }
+    found |= r;
+  }
 
   if (found & NSQUERY_ADDPEER) {
 #ifdef NO_IPv6
@@ -421,36 +680,34 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
   /* addrr_ns(auth=1) should be called last as it fills in
    * both AUTH and ADDITIONAL sections */
   if (!found) {			/* negative result */
-    addrr_soa(pkt, zone, 1);	/* add SOA if any to AUTHORITY */
+    addrr_negsoa(pkt, zone);	/* add SOA if any to AUTHORITY */
     h[p_f2] = DNS_R_NXDOMAIN;
-    do_stats(zone->z_stats.q_nxd += 1);
+    do_stats(zstats.q_nxd += 1);
   }
   else {
     if (!h[p_ancnt2]) {	/* positive reply, no answers */
-      addrr_soa(pkt, zone, 1);	/* add SOA if any to AUTHORITY */
+      addrr_negsoa(pkt, zone);	/* add SOA if any to AUTHORITY */
     }
     else if (zone->z_nns &&
              /* (!(qi.qi_tflag & NSQUERY_NS) || qi.qi_dnlab) && */
              !lazy)
       addrr_ns(pkt, zone, 1); /* add nameserver records to positive reply */
-    do_stats(zone->z_stats.q_ok += 1);
+    do_stats(zstats.q_ok += 1);
   }
   (void)call_hook(query_result, (pkt->p_peer, zone, &qi, found));
-  if (rlen() > DNS_MAXPACKET) {	/* add OPT record for long replies */
-    /* as per parsequery(), we always have 11 bytes for minimal OPT record at
-     * the end of our reply packet, OR rlen() does not exceed DNS_MAXPACKET */
+  if (rlen() > DNS_MAXPACKET &&	/* add OPT record for long replies */
+      pkt->p_endp < pkt->p_buf + pkt->p_bufsz) {
+    /* as per parsequery(), we have 11 bytes for minimal OPT record at
+     * the end of our reply packet if the query had one */
     h[p_arcnt2] += 1;		/* arcnt is limited to 254 records */
-    h = pkt->p_cur;
-    *h++ = 0;			/* empty (root) DN */
-    PACK16S(h, DNS_T_OPT);
-    PACK16S(h, DNS_EDNS0_MAXPACKET);
-    *h++ = 0; *h++ = 0;		/* RCODE and version */
-    *h++ = 0; *h++ = 0;		/* rest of the TTL field */
-    *h++ = 0; *h++ = 0;		/* RDLEN */
-    pkt->p_cur = h;
-    h = pkt->p_buf;		/* restore for rlen() to work */
-  }
-  do_stats(zone->z_stats.b_out += rlen());
+    memcpy(pkt->p_cur, optrr, sizeof(optrr));
+    pkt->p_cur += sizeof(optrr);
+  }
+  if (cache && !(found & NSQUERY_ADDPEER) &&
+      !(zone->z_dsacl && zone->z_dsacl->ds_stamp) &&
+      rlen() <= DNS_EDNS0_MAXPACKET)
+    anscache_put(pkt, qry, hash, zone, dsmask);
+  do_stats(zstats.b_out += rlen());
   return rlen();
 
 err_nz:
@@ -458,10 +715,42 @@ err_nz:
   return rlen();
 
 err_z:
-  do_stats(zone->z_stats.q_err += 1; zone->z_stats.b_out += rlen());
+  do_stats(zstats.q_err += 1; zstats.b_out += rlen());
   return rlen();
 }
 
+/* construct reply to a query, and count it by type, rcode and so on
+ * in stats of the zone it ended up in (p_sidx), if it was parsed at all */
+int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
+  struct dnsquery qry;			/* query structure */
+  int r;
+
+  qry.q_dnlen = 0;
+  do_stats(pkt->p_trunc = 0);
+  do_stats(if (pkt->p_clients) clicount(pkt->p_clients, pkt->p_peer));
+  r = doreply(pkt, qlen, zone, &qry);
+#ifndef NO_STATS
+  if (qry.q_dnlen) {
+    struct dnsstats *st = &pkt->p_stats[pkt->p_sidx];
+    switch(qry.q_type) {
+    case DNS_T_A:   st->t_a += 1;     break;
+    case DNS_T_TXT: st->t_txt += 1;   break;
+    case DNS_T_ANY: st->t_any += 1;   break;
+    default:        st->t_other += 1; break;
+    }
+    if (qry.q_edns) st->e_edns += 1;
+    else st->e_plain += 1;
+    if (r) switch(pkt->p_buf[p_f2] & pf2_rcode) {
+    case DNS_R_SERVFAIL: st->r_servfail += 1; break;
+    case DNS_R_NOTIMPL:  st->r_notimpl += 1;  break;
+    case DNS_R_REFUSED:  st->r_refused += 1;  break;
+    }
+    if (pkt->p_trunc) st->r_trunc += 1;
+  }
+#endif
+  return r;
+}
+
 #define fit(pkt, c, bytes) ((c) + (bytes) <= (pkt)->p_endp)
 
 
@@ -488,7 +777,7 @@ err_z:
  */
 
 struct dnjump {	/* one DN "jump": */
-  unsigned char *pos;	/* position in precomputed packet where the jump is */
+  unsigned pos;		/* position of the jump relative to start of the RRs */
   int off;		/* jump offset relative to beginning of the RRs */
 };
 
@@ -545,7 +834,7 @@ dnc_add(struct dncompr *compr, unsigned char *cpos, const unsigned char *dn) {
         continue;
       /* found one, make a jump to it */
       if (cpos + 2 >= compr->bend) return NULL;
-      compr->jump->pos = cpos;
+      compr->jump->pos = cpos - compr->buf;
       compr->jump->off = ptr->off;
       ++compr->jump;
       return cpos + 2;
@@ -585,18 +874,23 @@ dnc_final(struct dnspacket *pkt,
   const unsigned qoff = (pkt->p_sans - pkt->p_buf) + 0xc000;
   const unsigned coff = (pkt->p_cur - pkt->p_buf) + 0xc000;
   unsigned pos;
-  if (!fit(pkt, pkt->p_cur, dsize))
+  unsigned char *c = pkt->p_cur;
+  if (!fit(pkt, c, dsize))
     return 0;
-  /* first, adjust offsets - in cached data anyway */
+  /* compression pointers can only reach the first 16KB of a (TCP) packet */
+  if (jump < jend && coff + dsize > 0xffff)
+    return 0;
+  /* copy the RRs into answer packet */
+  memcpy(c, data, dsize);
+  /* and adjust offsets there: cached data is shared by all threads
+   * and is never modified after update_zone_soa()/update_zone_ns() */
   while(jump < jend) {
     /* jump to either query section or this very RRs */
     pos = jump->off + (jump->off < 0 ? qoff : coff);
-    PACK16(jump->pos, pos);
+    PACK16(c + jump->pos, pos);
     ++jump;
   }
-  /* and finally, copy the RRs into answer packet */
-  memcpy(pkt->p_cur, data, dsize);
-  pkt->p_cur += dsize;
+  pkt->p_cur = c + dsize;
   return 1;
 }
 
@@ -608,6 +902,10 @@ struct zonesoa {	/* cached SOA RR */
   struct dnjump jump[3];	/* jumps to fix: 3 max (qdn, odn, pdn) */
   struct dnjump *jend;		/* last jump */
   unsigned char data[CACHEBUF_SIZE];
+  /* complete SOA RRs for AUTHORITY section of negative replies, one for
+   * every possible query DN length (starting at zone DN length), to be
+   * placed right after the question: jumps are resolved, TTL is minttl */
+  unsigned char *neg;
 };
 
 struct zonens {		/* cached NS RRs */
@@ -626,7 +924,7 @@ void init_zones_caches(struct zone *zonelist) {
       dns_dntop(zonelist->z_dn, name, sizeof(name));
       error(0, "missing data for zone `%s'", name);
     }
-    zonelist->z_zsoa = tmalloc(struct zonesoa);
+    zonelist->z_zsoa = tzalloc(struct zonesoa);
     /* for NS RRs, we allocate MAX_NS caches:
      * each stores one variant of NS rotation */
     zonelist->z_zns = (struct zonens *)emalloc(sizeof(struct zonens) * MAX_NS);
@@ -640,8 +938,9 @@ int update_zone_soa(struct zone *zone, const struct dssoa *dssoa) {
    struct zonesoa *zsoa;
    unsigned char *cpos;
    struct dncompr compr;
-   unsigned t;
+   unsigned t, i, n;
    unsigned char *sizep;
+   const struct dnjump *jump;
 
    zsoa = zone->z_zsoa;
    zsoa->size = 0;
@@ -669,6 +968,18 @@ int update_zone_soa(struct zone *zone, const struct dssoa *dssoa) {
    PACK16(sizep, t);
    dnc_finish(&compr, cpos, &zsoa->size, &zsoa->jend);
 
+   /* pre-serialize negative reply variants */
+   n = DNS_MAXDN - zone->z_dnlen + 1;
+   zsoa->neg = (unsigned char *)erealloc(zsoa->neg, n * zsoa->size);
+   for(i = 0, cpos = zsoa->neg; i < n; ++i, cpos += zsoa->size) {
+     /* answers start after header, query DN, qtype and qclass */
+     t = p_hdrsize + zone->z_dnlen + i + 4 + 0xc000;
+     memcpy(cpos, zsoa->data, zsoa->size);
+     for(jump = zsoa->jump; jump < zsoa->jend; ++jump)
+       PACK16(cpos + jump->pos, jump->off + t);
+     memcpy(cpos + zsoa->ttloff, zsoa->minttl, 4);
+   }
+
    return 1;
 }
 
@@ -691,6 +1002,23 @@ static int addrr_soa(struct dnspacket *pkt, const struct zone *zone, int auth) {
   return 1;
 }
 
+/* add SOA into AUTHORITY section of a negative reply.
+ * Right after the question, just copy pre-serialized RR. */
+static int addrr_negsoa(struct dnspacket *pkt, const struct zone *zone) {
+  const struct zonesoa *zsoa = zone->z_zsoa;
+  unsigned qdnlen;
+  if (pkt->p_cur != pkt->p_sans)
+    return addrr_soa(pkt, zone, 1);
+  if (!zone->z_dssoa || !zsoa->size || !fit(pkt, pkt->p_cur, zsoa->size))
+    return 0;
+  qdnlen = pkt->p_sans - pkt->p_buf - p_hdrsize - 4;
+  memcpy(pkt->p_cur, zsoa->neg + (qdnlen - zone->z_dnlen) * zsoa->size,
+         zsoa->size);
+  pkt->p_cur += zsoa->size;
+  pkt->p_buf[p_nscnt2]++;
+  return 1;
+}
+
 static unsigned char *
 find_glue(struct zone *zone, const unsigned char *nsdn,
           struct dnspacket *pkt, const struct zone *zonelist) {
@@ -741,8 +1069,11 @@ int update_zone_ns(struct zone *zone, const struct dsns *dsns, unsigned ttl,
   unsigned char *nsrrs[MAX_NS], *nsrre[MAX_NS];
   unsigned nglue;
   struct dnspacket pkt;
+  unsigned char buf[DNS_MAXPACKET];
 
   memset(&pkt, 0, sizeof(pkt));
+  pkt.p_buf = buf;
+  pkt.p_bufsz = sizeof(buf);
   pkt.p_sans = pkt.p_cur = pkt.p_buf + p_hdrsize;
   pkt.p_endp = pkt.p_buf + CACHEBUF_SIZE + p_hdrsize;
 
@@ -826,7 +1157,9 @@ int update_zone_ns(struct zone *zone, const struct dsns *dsns, unsigned ttl,
 }
 
 static int addrr_ns(struct dnspacket *pkt, const struct zone *zone, int auth) {
-  unsigned cns = zone->z_cns;
+  /* z_cns is shared by all query threads: a lost update only
+   * repeats one NS ordering, but the read must not tear */
+  unsigned cns = __atomic_load_n(&zone->z_cns, __ATOMIC_RELAXED);
   const struct zonens *zns = zone->z_zns + cns;
   if (!zone->z_nns)
     return 0;
@@ -849,7 +1182,7 @@ static int addrr_ns(struct dnspacket *pkt, const struct zone *zone, int auth) {
   ++cns;
   if (cns >= zone->z_nns)
     cns = 0;
-  ((struct zone *)zone)->z_cns = cns;
+  __atomic_store_n(&((struct zone *)zone)->z_cns, cns, __ATOMIC_RELAXED);
   return 1;
 }
 
@@ -911,7 +1244,8 @@ checkrr_present(register unsigned char *c, register unsigned char *e,
 }
 
 /* add a new record into answer, check for dups.
- * We just ignore any data that exceeds packet size */
+ * Data that exceeds UDP packet size is dropped and the reply is marked
+ * truncated if we also listen on TCP, so the client may retry there. */
 void addrr_any(struct dnspacket *pkt, unsigned dtp,
                const void *data, unsigned dsz,
                unsigned ttl) {
@@ -920,7 +1254,11 @@ void addrr_any(struct dnspacket *pkt, unsigned dtp,
   if (!ttl) return; /* if RR is already present, do nothing */
 
   if (!fit(pkt, c, 12 + dsz) || pkt->p_buf[p_ancnt2] == 255) {
-    setnonauth(pkt->p_buf); /* non-auth answer as we can't fit the record */
+    do_stats(pkt->p_trunc = 1);
+    if (tcp_enabled && !istcp(pkt) && pkt->p_buf[p_ancnt2] != 255)
+      pkt->p_buf[p_f1] |= pf1_tc;
+    else
+      setnonauth(pkt->p_buf); /* non-auth answer as we can't fit the record */
     return;
   }
   *c++ = 192; *c++ = p_hdrsize;	/* jump after header: query DN */
@@ -975,32 +1313,207 @@ static int version_req(struct dnspacket *pkt, const struct dnsquery *qry) {
   return 1;
 }
 
-void logreply(const struct dnspacket *pkt, FILE *flog, int flushlog) {
-  char cbuf[DNS_MAXDOMAIN + IPSIZE + 50];
-  char *cp = cbuf;
+void logfill(struct logrec *lr, const struct dnspacket *pkt, time_t now) {
   const unsigned char *const q = pkt->p_sans - 4;
+  unsigned l = pkt->p_peerlen;
+  lr->lr_time = now;
+  if (l > sizeof(lr->lr_peer))
+    l = sizeof(lr->lr_peer);
+  memcpy(lr->lr_peer, pkt->p_peer, l);
+  lr->lr_peerlen = l;
+  lr->lr_qtype = ((unsigned)q[0]<<8)|q[1];
+  lr->lr_qclass = ((unsigned)q[2]<<8)|q[3];
+  lr->lr_len = pkt->p_cur - pkt->p_buf;
+  lr->lr_rcode = pkt->p_buf[p_f2] & pf2_rcode;
+  lr->lr_ancnt = pkt->p_buf[p_ancnt2];
+  lr->lr_id = ((unsigned)pkt->p_buf[0]<<8)|pkt->p_buf[1];
+  lr->lr_f1 = pkt->p_buf[p_f1] & (pf1_opcode | pf1_rd);
+  lr->lr_tcp = istcp(pkt);
+  lr->lr_wirelen = 0;
+  memcpy(lr->lr_dn, pkt->p_buf + p_hdrsize, q - (pkt->p_buf + p_hdrsize));
+}
 
-  cp += sprintf(cp, "%lu ", (unsigned long)time(NULL));
+unsigned logformat(char *buf, const struct logrec *lr) {
+  char *cp = buf;
 #ifndef NO_IPv6
-  if (getnameinfo(pkt->p_peer, pkt->p_peerlen,
+  struct sockaddr_storage sa;
+#else
+  struct sockaddr_in sa;
+#endif
+
+  memcpy(&sa, lr->lr_peer, lr->lr_peerlen);
+  cp += sprintf(cp, "%lu ", (unsigned long)lr->lr_time);
+#ifndef NO_IPv6
+  if (getnameinfo((struct sockaddr *)&sa, lr->lr_peerlen,
                   cp, NI_MAXHOST, NULL, 0,
                   NI_NUMERICHOST) == 0)
     cp += strlen(cp);
   else
     *cp++ = '?';
 #else
-  strcpy(cp, inet_ntoa(((struct sockaddr_in*)pkt->p_peer)->sin_addr));
+  strcpy(cp, inet_ntoa(sa.sin_addr));
   cp += strlen(cp);
 #endif
   *cp++ = ' ';
-  cp += dns_dntop(pkt->p_buf + p_hdrsize, cp, DNS_MAXDOMAIN);
-  cp += sprintf(cp, " %s %s: %s/%u/%d\n",
-      dns_typename(((unsigned)q[0]<<8)|q[1]),
-      dns_classname(((unsigned)q[2]<<8)|q[3]),
-      dns_rcodename(pkt->p_buf[p_f2] & pf2_rcode),
-      pkt->p_buf[p_ancnt2], (int)(pkt->p_cur - pkt->p_buf));
+  cp += dns_dntop(lr->lr_dn, cp, DNS_MAXDOMAIN);
+  cp += sprintf(cp, " %s %s: %s/%u/%u\n",
+      dns_typename(lr->lr_qtype),
+      dns_classname(lr->lr_qclass),
+      dns_rcodename(lr->lr_rcode),
+      lr->lr_ancnt, lr->lr_len);
+  return cp - buf;
+}
+
+void logreply(const struct dnspacket *pkt, FILE *flog, int flushlog) {
+  char cbuf[LOGLINESZ];
+  struct logrec lr;
+  unsigned l;
+
+  logfill(&lr, pkt, time(NULL));
+  l = logformat(cbuf, &lr);
   if (flushlog)
-    write(fileno(flog), cbuf, cp - cbuf);
+    write(fileno(flog), cbuf, l);
   else
-    fwrite(cbuf, cp - cbuf, 1, flog);
+    fwrite(cbuf, l, 1, flog);
 }
+
+#ifndef NO_STATS
+
+/* client network of a query (rbldnsd.h), return 0 if none */
+static int clikey(unsigned char key[8], const struct sockaddr *sa) {
+  const unsigned char *a;
+  memset(key, 0, 8);
+  if (sa->sa_family == AF_INET) {
+    a = (const unsigned char *)&((const struct sockaddr_in *)sa)->sin_addr;
+    key[0] = 4;
+    memcpy(key + 1, a, 3);
+    return 1;
+  }
+#ifndef NO_IPv6
+  if (sa->sa_family == AF_INET6) {
+    a = ((const struct sockaddr_in6 *)sa)->sin6_addr.s6_addr;
+    if (memcmp(a, ip6mapped_pfx, sizeof(ip6mapped_pfx)) == 0) {
+      key[0] = 4;
+      memcpy(key + 1, a + 12, 3);
+    }
+    else {
+      key[0] = 6;
+      memcpy(key + 1, a, 7);
+    }
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+/* rows of the count-min sketch are indexed by h1 + row * h2 */
+static void clihash(const unsigned char key[8], unsigned *h1, unsigned *h2) {
+  unsigned h = 2166136261u, i;	/* FNV-1a */
+  for(i = 0; i < 8; ++i)
+    h = (h ^ key[i]) * 16777619u;
+  *h1 = h;
+  *h2 = ((h >> 16) | (h << 16)) * 2654435761u | 1;
+}
+
+#define clicell(cs, r, h1, h2) \
+  ((cs)->cs_cm[r][((h1) + (r) * (h2)) & (CLI_WIDTH - 1)])
+
+/* count a query from sa, and put its network into the top list if it
+ * is estimated higher than the least one there */
+void clicount(struct clisketch *cs, const struct sockaddr *sa) {
+  unsigned char key[8];
+  unsigned h1, h2, r;
+  dnscnt_t c, est = 0;
+  struct clitop *t, *m;
+
+  if (!clikey(key, sa))
+    return;
+  cs->cs_queries += 1;
+  clihash(key, &h1, &h2);
+  for(r = 0; r < CLI_DEPTH; ++r) {
+    c = ++clicell(cs, r, h1, h2);
+    if (!r || c < est)
+      est = c;
+  }
+  for(t = m = cs->cs_top; t < cs->cs_top + CLI_TOPN; ++t) {
+    if (memcmp(t->ct_key, key, 8) == 0) {
+      t->ct_cnt = est;
+      return;
+    }
+    if (t->ct_cnt < m->ct_cnt)
+      m = t;
+  }
+  if (est > m->ct_cnt) {
+    m->ct_cnt = est;
+    memcpy(m->ct_key, key, 8);
+  }
+}
+
+static int clicmp(const void *a, const void *b) {
+  const struct clitop *x = (const struct clitop *)a;
+  const struct clitop *y = (const struct clitop *)b;
+  return x->ct_cnt < y->ct_cnt ? 1 : x->ct_cnt > y->ct_cnt ? -1 : 0;
+}
+
+/* Number of queries, then a line for every client network with the
+ * highest estimated number of queries.  Sketches of workers are added
+ * up, and networks on the top list of any worker are estimated from
+ * the sum */
+void listclients(FILE *f, struct clisketch *const *wc, int nw) {
+  struct clisketch *cs;
+  struct clitop *top;
+  const struct clitop *t;
+  unsigned char a[8];
+  unsigned h1, h2, r, i, j, n = 0;
+  dnscnt_t c;
+  int w;
+
+  cs = (struct clisketch *)malloc(sizeof(*cs));
+  top = (struct clitop *)malloc(nw * CLI_TOPN * sizeof(*top));
+  if (!cs || !top) {
+    free(cs);
+    free(top);
+    return;
+  }
+  *cs = *wc[0];
+  for(w = 1; w < nw; ++w) {
+    cs->cs_queries += wc[w]->cs_queries;
+    for(r = 0; r < CLI_DEPTH; ++r)
+      for(i = 0; i < CLI_WIDTH; ++i)
+        cs->cs_cm[r][i] += wc[w]->cs_cm[r][i];
+  }
+  for(w = 0; w < nw; ++w)
+    for(t = wc[w]->cs_top; t < wc[w]->cs_top + CLI_TOPN; ++t) {
+      if (!t->ct_key[0])
+        continue;
+      for(j = 0; j < n && memcmp(top[j].ct_key, t->ct_key, 8); ++j)
+        ;
+      if (j < n)
+        continue;
+      top[n] = *t;
+      clihash(t->ct_key, &h1, &h2);
+      for(r = 0; r < CLI_DEPTH; ++r) {
+        c = clicell(cs, r, h1, h2);
+        if (!r || c < top[n].ct_cnt)
+          top[n].ct_cnt = c;
+      }
+      ++n;
+    }
+  qsort(top, n, sizeof(*top), clicmp);
+  fprintf(f, "queries=%" PRI_DNSCNT "\n", cs->cs_queries);
+  for(i = 0; i < n && i < CLI_TOPN; ++i) {
+    memset(a, 0, sizeof(a));
+    memcpy(a, top[i].ct_key + 1, 7);
+    if (top[i].ct_key[0] == 4)
+      fprintf(f, "%s/24", ip4atos(unpack32(a)));
+    else
+      fprintf(f, "%s/56", ip6atos(a, sizeof(a)));
+    fprintf(f, " queries=%" PRI_DNSCNT "\n", top[i].ct_cnt);
+  }
+  free(cs);
+  free(top);
+}
+
+#undef clicell
+
+#endif /* NO_STATS */
@@ -162,7 +162,7 @@ char *parse_dn(char *s, unsigned char *dn, unsigned *dnlenp) {
 int parse_a_txt(char *str, const char **rrp, const char *def_rr,
                 struct dsctx *dsc) {
   char *rr;
-  static char rrbuf[4+256];	/*XXX static buffer */
+  static __thread char rrbuf[4+256];	/*XXX static buffer */
   if (*str == ':') {
     ip4addr_t a;
     int bits = ip4addr(str + 1, &a, &str);
@@ -460,6 +460,16 @@ dump_a_txt(const char *name, const char *rr,
 
 #endif
 
+void fputlabel(FILE *f, const char *s) {
+  for(; *s; ++s)
+    if (*s == '\\' || *s == '"')
+      fprintf(f, "\\%c", *s);
+    else if (*s == '\n')
+      fputs("\\n", f);
+    else
+      putc(*s, f);
+}
+
 char *emalloc(size_t size) {
   void *ptr = malloc(size);
   if (!ptr)
@@ -588,9 +598,10 @@ void dsloaded(struct dsctx *dsc, const char *fmt, ...) {
   if (dsc->dsc_subset)
      vdslog(LOG_INFO, dsc, fmt, ap);
   else {
-    struct tm *tm = gmtime(&dsc->dsc_ds->ds_stamp);
+    struct tm tmb, *tm = gmtime_r(&dsc->dsc_ds->ds_stamp, &tmb);
     char buf[128];
     vssprintf(buf, sizeof(buf), fmt, ap);
+    ssprintf(dsc->dsc_ds->ds_info, sizeof(dsc->dsc_ds->ds_info), "%s", buf);
     dslog(LOG_INFO, dsc, "%04d%02d%02d %02d%02d%02d: %s",
           tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
           tm->tm_hour, tm->tm_min, tm->tm_sec,
@@ -11,11 +11,40 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/time.h>
+#ifndef NO_THREADS
+# include <pthread.h>
+# include <signal.h>
+# include <sys/mman.h>
+#endif
 #include "rbldnsd.h"
 #include "istream.h"
+#ifndef NO_STDINT_H
+# include <inttypes.h>	/* PRI_DNSCNT */
+#endif
+#ifdef HAVE_INOTIFY
+# include <sys/inotify.h>
+#endif
 
 static struct dataset *ds_list;
 struct dataset *g_dsacl;
+#ifndef NO_STATS
+unsigned numdatasets;
+#endif
+
+/* dataset types which can be updated by a delta file */
+#define hasdelta(dst) isdstype(dst, ip4set)
+
+/* allocate type-specific data of a dataset together with its memory
+ * pool, so both can be replaced at once on reload */
+static void newdsdata(struct dataset *ds) {
+  ds->ds_mp = (struct mempool*)ezalloc(sizeof(struct mempool) +
+                                       ds->ds_type->dst_size);
+  ds->ds_dsd = (struct dsdata*)(ds->ds_mp + 1);
+  mp_init(ds->ds_mp);
+  ds->ds_type->dst_resetfn(ds->ds_dsd, 0);
+  ds->ds_ttl = def_ttl;
+}
 
 static struct dataset *newdataset(char *spec) {
   /* type:file,file,file... */
@@ -39,13 +68,13 @@ static struct dataset *newdataset(char *spec) {
   while(strcmp(spec, (*dstp)->dst_name))
     if (!*++dstp)
       error(0, "unknown dataset type `%.60s'", spec);
-  ds = (struct dataset*)ezalloc(sizeof(struct dataset) +
-                                     sizeof(struct mempool) +
-                                     (*dstp)->dst_size);
+  ds = tzalloc(struct dataset);
   ds->ds_type = *dstp;
-  ds->ds_mp = (struct mempool*)(ds + 1);
-  ds->ds_dsd = (struct dsdata*)(ds->ds_mp + 1);
+  newdsdata(ds);
   ds->ds_spec = estrdup(f);
+#ifndef NO_STATS
+  ds->ds_sidx = numdatasets++;
+#endif
 
   ds->ds_next = NULL;
   *dsp = ds;
@@ -54,6 +83,17 @@ static struct dataset *newdataset(char *spec) {
   for (f = strtok(f, delims); f; f = strtok(NULL, delims)) {
     dsf = tmalloc(struct dsfile);
     dsf->dsf_stamp = 0;
+    dsf->dsf_size = 0;
+    if (*f == '+') {		/* delta file */
+      if (!hasdelta(ds->ds_type))
+        error(0, "delta files are not supported for %s datasets", spec);
+      if (ds->ds_delta)
+        error(0, "more than one delta file for %s dataset", spec);
+      dsf->dsf_name = estrdup(f + 1);
+      dsf->dsf_next = NULL;
+      ds->ds_delta = dsf;
+      continue;
+    }
     dsf->dsf_name = estrdup(f);
     *dsfp = dsf;
     dsfp = &dsf->dsf_next;
@@ -163,6 +203,14 @@ struct zone *addzone(struct zone *zonelist, const char *spec) {
 static int ds_special(struct dataset *ds, char *line, struct dsctx *dsc) {
   char *w;
 
+  if (dsc->dsc_delta) {
+    /* delta files have nothing but a sequence number */
+    if (!(w = firstword_lc(line, "seq")) ||
+        !(w = parse_uint32(w, &dsc->dsc_seq)) || *w)
+      return 0;
+    return 1;
+  }
+
   if ((w = firstword_lc(line, "soa"))) {
     /* SOA record */
     struct dssoa dssoa;
@@ -312,13 +360,84 @@ static int ds_special(struct dataset *ds, char *line, struct dsctx *dsc) {
   return 0;
 }
 
+/* a line of a delta file: +entry or -entry */
+static int deltaline(struct dataset *ds, char *line, struct dsctx *dsc) {
+  int del;
+  if (*line == '+')
+    del = 0;
+  else if (*line == '-')
+    del = 1;
+  else {
+    dswarn(dsc, "delta entry should start with + or -");
+    return 1;
+  }
+  ++line;
+  SKIPSPACE(line);
+  return ds_ip4set_deltaline(ds, line, del, dsc);
+}
+
+/* Time-sliced loading (-Q).  The thread which started loading stops
+ * parsing every ldslice msec and calls ldyield() to answer queries
+ * which came in meanwhile, from the current data.  Data being loaded
+ * goes into shadow copies, so queries see no changes until swap. */
+void (*ldyield)(void);
+unsigned ldslice;
+static unsigned long ldnext;	/* time to yield at, msec */
+static unsigned long ldyusec;	/* time spent in ldyield() so far */
+#ifndef NO_THREADS
+static pthread_t ldself;	/* the thread which may yield */
+#endif
+
+static unsigned long usecnow(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* time spent answering queries in between is not loading */
+unsigned long dsclock(void) {
+#ifndef NO_THREADS
+  if (!pthread_equal(pthread_self(), ldself))
+    return usecnow();
+#endif
+  return usecnow() - ldyusec;
+}
+
+void dsprofstep(unsigned long *step, unsigned long *t) {
+  unsigned long now = dsclock();
+  *step += now - *t;
+  *t = now;
+}
+
+static unsigned long msecnow(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void dsyield(void) {
+  if (!ldyield)
+    return;
+#ifndef NO_THREADS
+  if (!pthread_equal(pthread_self(), ldself))
+    return;
+#endif
+  if (msecnow() >= ldnext) {
+    unsigned long t = usecnow();
+    ldyield();
+    ldyusec += usecnow() - t;
+    ldnext = msecnow() + ldslice;
+  }
+}
+
 static int
 readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
   char *line, *eol;
   int r;
   int noeol = 0;
   struct dataset *dscur = ds;
-  ds_linefn_t *linefn = dscur->ds_type->dst_linefn;
+  ds_linefn_t *linefn =
+    dsc->dsc_delta ? deltaline : dscur->ds_type->dst_linefn;
 
   while((r = istream_getline(sp, &line, '\n')) > 0) {
     eol = line + r - 1;
@@ -327,7 +446,8 @@ readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
         noeol = 0;
       continue;
     }
-    ++dsc->dsc_lineno;
+    if (!(++dsc->dsc_lineno % YIELD_LINES))
+      dsyield();
     if (*eol == '\n')
       --eol;
     else {
@@ -345,8 +465,10 @@ readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
         dswarn(dsc, "invalid or unrecognized special entry");
       else if (r < 0)
         return 0;
-      dscur = dsc->dsc_subset ? dsc->dsc_subset : ds;
-      linefn = dscur->ds_type->dst_linefn;
+      if (!dsc->dsc_delta) {
+        dscur = dsc->dsc_subset ? dsc->dsc_subset : ds;
+        linefn = dscur->ds_type->dst_linefn;
+      }
       continue;
     }
     if (line[0] && !ISCOMMENT(line[0]))
@@ -360,18 +482,330 @@ readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
   return 1;
 }
 
+#ifndef NO_THREADS
+
+/* Large files of dataset types which can merge data (dst_mergefn) are
+ * split at line boundaries and parsed by several threads, each into its
+ * own copy of the dataset, which are merged afterwards.  $-specials are
+ * applied in order by a sequential pre-scan (which only looks at the
+ * first character of every line), which also records, for every chunk,
+ * the line number, $MAXRANGE4 value and the last `:default' line in
+ * effect at its start, so entries are parsed exactly as in one pass. */
+
+static unsigned ldthreads = 1;	/* threads to use for one file */
+#define SPLIT_MINSIZE (8u << 20) /* do not split files smaller than this */
+#define SPLIT_MAXLINE (ISTREAM_BUFSIZE / 2)
+
+struct dschunk {
+  struct dataset *dc_ds;	/* own copy of the dataset being loaded */
+  const char *dc_beg, *dc_end;	/* lines of this chunk */
+  const char *dc_def;		/* last :default line before dc_beg */
+  struct dsctx dc_dsc;
+  int dc_r;			/* result as of readdslines() */
+};
+
+/* copy a line into buf (truncating it if too long) and trim it */
+static char *splitline(char *buf, const char *p, const char *e) {
+  char *line = buf, *eol;
+  if (e - p >= SPLIT_MAXLINE)
+    e = p + SPLIT_MAXLINE - 1;
+  memcpy(buf, p, e - p);
+  eol = buf + (e - p) - 1;
+  SKIPSPACE(line);
+  while(eol >= line && ISSPACE(*eol))
+    --eol;
+  eol[1] = '\0';
+  return line;
+}
+
+#define isspecial(line) \
+  ((line)[0] == '$' || \
+   ((ISCOMMENT((line)[0]) || (line)[0] == ':') && (line)[1] == '$'))
+
+static void *parsechunk(void *arg) {
+  struct dschunk *dc = (struct dschunk *)arg;
+  struct dataset *ds = dc->dc_ds;
+  ds_linefn_t *linefn = ds->ds_type->dst_linefn;
+  const char *p, *e;
+  char buf[SPLIT_MAXLINE], *line;
+
+  ds->ds_type->dst_startfn(ds);
+  if (dc->dc_def) {
+    e = memchr(dc->dc_def, '\n', dc->dc_beg - dc->dc_def);
+    line = splitline(buf, dc->dc_def, e);
+    if (!linefn(ds, line, &dc->dc_dsc)) {
+      dc->dc_r = 0;
+      return NULL;
+    }
+  }
+  for(p = dc->dc_beg; p < dc->dc_end; p = e + 1) {
+    if (!(e = memchr(p, '\n', dc->dc_end - p)))
+      e = dc->dc_end;
+    if (!(++dc->dc_dsc.dsc_lineno % YIELD_LINES))
+      dsyield();
+    if (e - p >= SPLIT_MAXLINE)
+      dswarn(&dc->dc_dsc, "long line (truncated)");
+    line = splitline(buf, p, e);
+    if (isspecial(line)) {
+      /* already applied by the pre-scan, except for our own context */
+      line += line[0] == '$' ? 1 : 2;
+      if (firstword_lc(line, "maxrange4"))
+        ds_special(ds, line, &dc->dc_dsc);
+      continue;
+    }
+    if (line[0] && !ISCOMMENT(line[0]) && !linefn(ds, line, &dc->dc_dsc)) {
+      dc->dc_r = 0;
+      return NULL;
+    }
+  }
+  dc->dc_r = 1;
+  return NULL;
+}
+
+/* run fn(args[i]) for i in 0..n-1, in n-1 new threads and this one */
+static void runparallel(unsigned n, void *(*fn)(void *),
+                        char *args, unsigned argsz) {
+  pthread_t tids[MAXLOADERS];
+  sigset_t ss, oss;
+  unsigned t, i;
+
+  /* all signals are handled by the main thread */
+  sigfillset(&ss);
+  pthread_sigmask(SIG_SETMASK, &ss, &oss);
+  for (t = 1; t < n && t < MAXLOADERS; ++t)
+    if (pthread_create(&tids[t], NULL, fn, args + t * argsz) != 0)
+      break;
+  pthread_sigmask(SIG_SETMASK, &oss, NULL);
+  for (i = t; i < n; ++i)	/* if we were unable to create some */
+    fn(args + i * argsz);
+  fn(args);
+  for (i = 1; i < t; ++i)
+    pthread_join(tids[i], NULL);
+}
+
+static struct dataset *newdscopy(const struct dataset *ds0);
+static void freedataset(struct dataset *ds);
+
+static int
+readsplit(int fd, size_t size, struct dataset *ds, struct dsctx *dsc) {
+  struct dschunk dcs[MAXLOADERS], *dc;
+  unsigned n = ldthreads, i;
+  char *map, buf[SPLIT_MAXLINE], *line;
+  const char *p, *e, *end, *next, *def = NULL;
+  int r = 1;
+
+  map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;	/* read it as usual */
+  end = map + size;
+  if (n > MAXLOADERS)
+    n = MAXLOADERS;
+
+  /* pre-scan: apply specials and find chunk boundaries */
+  dc = dcs;
+  dc->dc_beg = map;
+  dc->dc_def = NULL;
+  dc->dc_dsc = *dsc;
+  next = map + size / n;
+  for(p = map; p < end; p = e + 1) {
+    if (!(e = memchr(p, '\n', end - p)))
+      e = end;
+    if (p >= next && dc < dcs + n - 1) {
+      dc->dc_end = p;
+      ++dc;
+      dc->dc_beg = p;
+      dc->dc_def = def;
+      dc->dc_dsc = *dsc;
+      next = map + size / n * (dc - dcs + 1);
+    }
+    ++dsc->dsc_lineno;
+    while(p < e && ISSPACE(*p))
+      ++p;
+    if (p == e || (*p != '$' && *p != ':' && !ISCOMMENT(*p)))
+      continue;
+    line = splitline(buf, p, e);
+    if (isspecial(line)) {
+      int sr = ds_special(ds, line[0] == '$' ? line + 1 : line + 2, dsc);
+      if (!sr)
+        dswarn(dsc, "invalid or unrecognized special entry");
+      else if (sr < 0) {
+        r = 0;
+        goto done;
+      }
+    }
+    else if (line[0] == ':')
+      def = p;
+  }
+  dc->dc_end = end;
+  n = dc - dcs + 1;
+
+  for(i = 0; i < n; ++i) {
+    dcs[i].dc_ds = newdscopy(ds);
+    dcs[i].dc_dsc.dsc_ds = dcs[i].dc_ds;
+    dcs[i].dc_dsc.dsc_warns = 0;
+  }
+  runparallel(n, parsechunk, (char *)dcs, sizeof(*dcs));
+
+  for(i = 0; i < n; ++i) {
+    dc = &dcs[i];
+    dsc->dsc_warns += dc->dc_dsc.dsc_warns;
+    if (!dc->dc_r)
+      r = 0;
+    else if (r && !ds->ds_type->dst_mergefn(ds, dc->dc_ds))
+      r = 0;
+    else
+      mp_merge(ds->ds_mp, dc->dc_ds->ds_mp);
+    freedataset(dc->dc_ds);
+  }
+
+done:
+  munmap(map, size);
+  return r;
+}
+
+#endif /* NO_THREADS */
+
+/* free a shadow copy of a dataset together with its data */
 static void freedataset(struct dataset *ds) {
-  ds->ds_type->dst_resetfn(ds->ds_dsd, 0);
+  ds->ds_type->dst_resetfn(ds->ds_dsd, 1);
+  unmapimage(ds);
   mp_free(ds->ds_mp);
-  ds->ds_dssoa = NULL;
-  ds->ds_ttl = def_ttl;
-  ds->ds_dsns = NULL;
-  ds->ds_nsttl = 0;
-  ds->ds_expires = 0;
-  memset(ds->ds_subst, 0, sizeof(ds->ds_subst));
+  free(ds->ds_mp);
+  free(ds);
 }
 
-int loaddataset(struct dataset *ds) {
+/* new empty copy of a dataset, to load data into */
+static struct dataset *newdscopy(const struct dataset *ds0) {
+  struct dataset *ds = tzalloc(struct dataset);
+  ds->ds_type = ds0->ds_type;
+  ds->ds_spec = ds0->ds_spec;
+  ds->ds_dsf = ds0->ds_dsf;
+  ds->ds_delta = ds0->ds_delta;
+  ds->ds_sidx = ds0->ds_sidx;
+  newdsdata(ds);
+  return ds;
+}
+
+/* wall clock and CPU time of the calling thread, in msec */
+static void loadclock(unsigned long *etm, unsigned long *utm) {
+  struct timeval tv;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    *utm = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  else
+#endif
+    *utm = clock() / (CLOCKS_PER_SEC / 1000);
+  gettimeofday(&tv, NULL);
+  *etm = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* check if any of the files changed since they were read */
+static int dsfchanged(const struct dsfile *dsf, int delta) {
+  struct stat st;
+  for(; dsf; dsf = dsf->dsf_next)
+    if (stat(dsf->dsf_name, &st) < 0) {
+      if (!delta || dsf->dsf_stamp)	/* no delta file is no changes */
+        return 1;
+    }
+    else if (dsf->dsf_stamp != st.st_mtime ||
+             dsf->dsf_size  != st.st_size)
+      return 1;
+  return 0;
+}
+
+/* Read the delta file of ds into pending changes of the data, and
+ * prepare updated data to be put in place.  Return 1 if there are
+ * changes, -1 if there's no delta or it is applied already, 0 on error. */
+static int readdelta(struct dataset *ds, struct dsctx *dsc) {
+  struct dsfile *dsf = ds->ds_delta;
+  struct istream is;
+  struct stat st;
+  int fd, r;
+
+  dsc->dsc_fname = dsf->dsf_name;
+  dsc->dsc_delta = 1;
+  dsc->dsc_seq = 0;
+  fd = open(dsf->dsf_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    r = errno == ENOENT ? -1 : 0;
+    if (r == 0)
+      dslog(LOG_ERR, dsc, "unable to open file: %s", strerror(errno));
+    if (fd >= 0) close(fd);
+    dsf->dsf_stamp = 0;
+    dsf->dsf_size = 0;
+    goto done;
+  }
+  /* a bad delta is not read again until it changes */
+  dsf->dsf_stamp = st.st_mtime;
+  dsf->dsf_size = st.st_size;
+  istream_init_fd(&is, fd);
+  if (istream_compressed(&is)) {
+    dslog(LOG_ERR, dsc, "delta files can not be compressed");
+    r = 0;
+  }
+  else if ((r = readdslines(&is, ds, dsc)) < 0)
+    dslog(LOG_ERR, dsc, "error reading file: %s", strerror(errno));
+  dsc->dsc_lineno = 0;
+  istream_destroy(&is);
+  close(fd);
+  if (r <= 0)
+    r = 0;
+  else if (dsc->dsc_seq && ds->ds_seq && dsc->dsc_seq <= ds->ds_seq) {
+    dslog(LOG_INFO, dsc, "delta %u is applied already", dsc->dsc_seq);
+    r = -1;
+  }
+  else {
+    if (dsc->dsc_seq && ds->ds_seq && dsc->dsc_seq != ds->ds_seq + 1)
+      dslog(LOG_WARNING, dsc, "deltas %u to %u are missing",
+            ds->ds_seq + 1, dsc->dsc_seq - 1);
+    if (!(r = ds_ip4set_deltafinish(ds, dsc)))
+      dslog(LOG_ERR, dsc, "unable to apply delta");
+    else if (dsc->dsc_seq)
+      ds->ds_seq = dsc->dsc_seq;
+  }
+  if (r <= 0)
+    ds_ip4set_deltadrop(ds->ds_dsd);
+
+done:
+  dsc->dsc_fname = NULL;
+  dsc->dsc_delta = 0;
+  return r;
+}
+
+/* dataset timestamp: the latest of all its files */
+static time_t dsstamp(const struct dataset *ds) {
+  const struct dsfile *dsf;
+  time_t stamp = ds->ds_delta ? ds->ds_delta->dsf_stamp : 0;
+  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next)
+    if (dsf->dsf_stamp > stamp)
+      stamp = dsf->dsf_stamp;
+  return stamp;
+}
+
+/* Only the delta file of a loaded dataset changed: prepare updated
+ * data from the current one, to be put in place by swapdatasets(). */
+static int loaddelta(struct dataset *ds) {
+  struct dsctx dsc;
+  unsigned long etm0, utm0, etm, utm;
+  int r;
+
+  loadclock(&etm0, &utm0);
+  memset(&dsc, 0, sizeof(dsc));
+  dsc.dsc_ds = ds;
+  if ((r = readdelta(ds, &dsc)) > 0)
+    ds->ds_dpending = 1;
+  loadclock(&etm, &utm);
+  ds->ds_etime = etm - etm0;
+  ds->ds_utime = utm - utm0;
+  return r != 0;
+}
+
+/* Load dataset files into a fresh copy of the dataset, the shadow.
+ * Queries are answered from the current data meanwhile; the shadow
+ * is swapped in by swapdatasets() when everything is loaded.  If
+ * loading fails, the current data stays in use. */
+static int loaddataset(struct dataset *ds0) {
   struct dsfile *dsf;
   time_t stamp = 0;
   struct istream is;
@@ -379,14 +813,31 @@ int loaddataset(struct dataset *ds) {
   int r;
   struct stat st0, st1;
   struct dsctx dsc;
+  struct dataset *ds;
+  struct dsprof *dp;
+  unsigned long etm0, utm0, etm, utm, t0, t1, rd;
 
-  freedataset(ds);
+  if (ds0->ds_delta && ds0->ds_stamp && !dsfchanged(ds0->ds_dsf, 0))
+    return loaddelta(ds0);
+
+  ds = newdscopy(ds0);
+  loadclock(&etm0, &utm0);
 
   memset(&dsc, 0, sizeof(dsc));
   dsc.dsc_ds = ds;
 
+  if (imgdir) {
+    if (mapimage(ds, &dsc))
+      goto loaded;
+    /* start over with the files */
+    freedataset(ds);
+    dsc.dsc_ds = ds = newdscopy(ds0);
+  }
+
+  dp = &ds->ds_prof;
   for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
     dsc.dsc_fname = dsf->dsf_name;
+    t0 = dsclock();
     fd = open(dsf->dsf_name, O_RDONLY);
     if (fd < 0 || fstat(fd, &st0) < 0) {
       dslog(LOG_ERR, &dsc, "unable to open file: %s", strerror(errno));
@@ -395,6 +846,7 @@ int loaddataset(struct dataset *ds) {
     }
     ds->ds_type->dst_startfn(ds);
     istream_init_fd(&is, fd);
+    t1 = dsclock();
     if (istream_compressed(&is)) {
       if (nouncompress) {
         dslog(LOG_ERR, &dsc, "file is compressed, decompression disabled");
@@ -411,10 +863,21 @@ int loaddataset(struct dataset *ds) {
 #endif
       }
     }
+#ifndef NO_THREADS
+    /* large uncompressed file, parse it in several threads if we can */
+    else if (ldthreads > 1 && ds->ds_type->dst_mergefn &&
+             st0.st_size >= SPLIT_MINSIZE &&
+             (r = readsplit(fd, st0.st_size, ds, &dsc)) >= 0)
+      r = r ? 2 : 0;
+#endif
     else
       r = 1;
-    if (r > 0) r = readdslines(&is, ds, &dsc);
+    if (r == 1) r = readdslines(&is, ds, &dsc);
     if (r > 0) r = fstat(fd, &st1) < 0 ? -1 : 1;
+    rd = is.rdusec;
+    dp->dp_read += t1 - t0 + rd;
+    dp->dp_parse += dsclock() - t1 - rd;
+    dp->dp_lines += dsc.dsc_lineno;
     dsc.dsc_lineno = 0;
     istream_destroy(&is);
     close(fd);
@@ -441,33 +904,524 @@ int loaddataset(struct dataset *ds) {
   ds->ds_stamp = stamp;
   dsc.dsc_fname = NULL;
 
+  /* steps of dst_finishfn() which are not timed are shrink */
+  t0 = dsclock();
+  t1 = dp->dp_sort + dp->dp_dedup;
   ds->ds_type->dst_finishfn(ds, &dsc);
+  dp->dp_shrink += dsclock() - t0 - (dp->dp_sort + dp->dp_dedup - t1);
+  dsyield();
 
+loaded:
+  if (ds->ds_delta) {
+    if (readdelta(ds, &dsc) > 0)
+      ds_ip4set_deltaswap(ds, 1);
+    ds->ds_stamp = dsstamp(ds);
+  }
+  ds->ds_prof.dp_pool = ds->ds_mp->mp_datasz;
+  ds->ds_prof.dp_chunks = ds->ds_mp->mp_nchunks;
+  if (ds0->ds_shadow)
+    freedataset(ds0->ds_shadow);
+  ds0->ds_shadow = ds;
+  loadclock(&etm, &utm);
+  ds->ds_etime = ds0->ds_etime = etm - etm0;
+  ds->ds_utime = ds0->ds_utime = utm - utm0;
   return 1;
 
 fail:
   freedataset(ds);
-  for (dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next)
+  for (dsf = ds0->ds_dsf; dsf; dsf = dsf->dsf_next)
     dsf->dsf_stamp = 0;
-  ds->ds_stamp = 0;
+  if (ds0->ds_stamp) {
+    dsc.dsc_ds = ds0;
+    dsc.dsc_fname = NULL;
+    dsc.dsc_subset = NULL;
+    dslog(LOG_WARNING, &dsc, "keeping previously loaded data");
+  }
+  loadclock(&etm, &utm);
+  ds0->ds_etime = etm - etm0;
+  ds0->ds_utime = utm - utm0;
   return 0;
 }
 
+#define usec2sec(t) (t) / 1000000, (t) % 1000000 / 1000
+#define kb(b) (((b) + 512) >> 10)
+
+/* log where the load time went and memory the new data takes */
+static void logprofile(struct dsctx *dsc, const struct dsprof *dp) {
+  unsigned long t = dp->dp_read + dp->dp_parse;
+  dslog(LOG_INFO, dsc, "read/parse %lu.%03lu/%lu.%03lu sec, %lu lines "
+        "(%lu lines/sec), sort/dedup/shrink %lu.%03lu/%lu.%03lu/%lu.%03lu sec",
+        usec2sec(dp->dp_read), usec2sec(dp->dp_parse), dp->dp_lines,
+        t ? (unsigned long)(dp->dp_lines * 1000000.0 / t) : 0,
+        usec2sec(dp->dp_sort), usec2sec(dp->dp_dedup),
+        usec2sec(dp->dp_shrink));
+  dslog(LOG_INFO, dsc, "memory: entries %luK, pool %luK in %u chunks, "
+        "trie %luK", kb(dp->dp_earr), kb(dp->dp_pool), dp->dp_chunks,
+        kb(dp->dp_trie));
+}
+
+/* datasets to load, taken by loader threads one by one */
+static struct dataset **ldq;
+static unsigned ldn, ldi;	/* number of datasets, next to take */
+static int ldr;			/* result, 0 if any load failed */
+
+#ifndef NO_THREADS
+
+static pthread_mutex_t ldlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *loader(void UNUSED *arg) {
+  struct dataset *ds;
+  for(;;) {
+    pthread_mutex_lock(&ldlock);
+    ds = ldi < ldn ? ldq[ldi++] : NULL;
+    pthread_mutex_unlock(&ldlock);
+    if (!ds)
+      return NULL;
+    if (!loaddataset(ds)) {
+      pthread_mutex_lock(&ldlock);
+      ldr = 0;
+      pthread_mutex_unlock(&ldlock);
+    }
+  }
+}
+
+/* run loader() in nthreads threads including the calling one */
+static void runloaders(unsigned nthreads) {
+  pthread_t tids[MAXLOADERS];
+  sigset_t ss, oss;
+  unsigned n, i;
+
+  /* all signals are handled by the main thread */
+  sigfillset(&ss);
+  pthread_sigmask(SIG_SETMASK, &ss, &oss);
+  for (n = 0; n + 1 < nthreads && n + 1 < MAXLOADERS; ++n)
+    if (pthread_create(&tids[n], NULL, loader, NULL) != 0)
+      break;
+  pthread_sigmask(SIG_SETMASK, &oss, NULL);
+  loader(NULL);
+  for (i = 0; i < n; ++i)
+    pthread_join(tids[i], NULL);
+}
+
+#endif
+
+/* load every dataset which needs reloading, independent datasets in
+ * parallel using up to nthreads threads, and log time spent on each.
+ * Return 0 if any load failed */
+int loaddatasets(unsigned UNUSED nthreads) {
+  struct dataset *ds;
+  struct dsctx dsc;
+  unsigned n = 0;
+
+  for (ds = ds_list; ds; ds = ds->ds_next)
+    ++n;
+  ldq = (struct dataset **)emalloc(n * sizeof(*ldq));
+#ifndef NO_THREADS
+  ldthreads = nthreads;
+  ldself = pthread_self();
+#endif
+  ldnext = msecnow() + ldslice;
+  ldn = ldi = 0;
+  ldr = 1;
+  /* datasets marked dirty meanwhile (by inotify while this pass runs)
+   * stay marked for the next one */
+  for (ds = nextdataset2reload(NULL); ds; ds = nextdataset2reload(ds)) {
+    ldq[ldn++] = ds;
+    ds->ds_dirty = 0;
+  }
+
+#ifndef NO_THREADS
+  if (nthreads > 1 && ldn > 1)
+    runloaders(nthreads < ldn ? nthreads : ldn);
+  else
+#endif
+  for (; ldi < ldn; ++ldi)
+    if (!loaddataset(ldq[ldi]))
+      ldr = 0;
+
+  memset(&dsc, 0, sizeof(dsc));
+  for (n = 0; n < ldn; ++n) {
+    dsc.dsc_ds = ds = ldq[n];
+    dslog(LOG_INFO, &dsc, "load time %lu.%02lue/%lu.%02luu sec",
+          ds->ds_etime / 1000, ds->ds_etime % 1000 / 10,
+          ds->ds_utime / 1000, ds->ds_utime % 1000 / 10);
+    if (ds->ds_shadow)
+      logprofile(&dsc, &ds->ds_shadow->ds_prof);
+  }
+  free(ldq);
+  return ldr;
+}
+
+/* replace data of every dataset which has been loaded by loaddataset()
+ * with the new data, and free the old.  Query workers must be paused */
+void swapdatasets(void) {
+  struct dataset *ds, *nds, old;
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    if (ds->ds_dpending) {
+      ds_ip4set_deltaswap(ds, 0);
+      ds->ds_stamp = dsstamp(ds);
+      ds->ds_dpending = 0;
+    }
+    if (!(nds = ds->ds_shadow))
+      continue;
+    nds->ds_next = ds->ds_next;
+    old = *ds;
+    *ds = *nds;
+    *nds = old;
+    ds->ds_shadow = nds->ds_shadow = NULL;
+    freedataset(nds);
+  }
+}
+
+/* write images of all loaded datasets into dir, return 0 on errors */
+int writeimages(const char *dir) {
+  struct dataset *ds;
+  int r = 1;
+  for (ds = ds_list; ds; ds = ds->ds_next)
+    if (!writeimage(ds, dir))
+      r = 0;
+  return r;
+}
+
+int reload_dirty;
+
 /* find next dataset which needs reloading */
 struct dataset *nextdataset2reload(struct dataset *ds) {
-  struct dsfile *dsf;
   for (ds = ds ? ds->ds_next : ds_list; ds; ds = ds->ds_next)
-    for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
-      struct stat st;
-      if (stat(dsf->dsf_name, &st) < 0)
-        return ds;
-      if (dsf->dsf_stamp != st.st_mtime ||
-          dsf->dsf_size  != st.st_size)
-        return ds;
-    }
+    if (ds->ds_dirty)
+      /* trust inotify or the control socket,
+       * stamps may not change for quick updates */
+      return ds;
+    else if (reload_dirty)
+      continue;
+    else if (dsfchanged(ds->ds_dsf, 0) ||
+        (ds->ds_delta && dsfchanged(ds->ds_delta, 1)))
+      return ds;
+  return NULL;
+}
+
+/* find a dataset by its type:spec name */
+struct dataset *finddataset(const char *name) {
+  struct dataset *ds;
+  unsigned l;
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    l = strlen(ds->ds_type->dst_name);
+    if (strncmp(name, ds->ds_type->dst_name, l) == 0 && name[l] == ':' &&
+        strcmp(name + l + 1, ds->ds_spec) == 0)
+      return ds;
+  }
   return NULL;
 }
 
+/* one line for every dataset: name, timestamp, last load time,
+ * summary of the data as logged when loaded and size of its memory pool */
+void listdatasets(FILE *f) {
+  const struct dataset *ds;
+  struct tm tmb, *tm;
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    fprintf(f, "%s:%s", ds->ds_type->dst_name, ds->ds_spec);
+    if (!ds->ds_stamp) {
+      fprintf(f, " not loaded\n");
+      continue;
+    }
+    tm = gmtime_r(&ds->ds_stamp, &tmb);
+    fprintf(f, " %04d%02d%02d %02d%02d%02d",
+            tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+            tm->tm_hour, tm->tm_min, tm->tm_sec);
+    if (ds->ds_seq)
+      fprintf(f, " seq=%u", ds->ds_seq);
+    fprintf(f, " load=%lu.%02lue/%lu.%02luu %s pool=%uK",
+            ds->ds_etime / 1000, ds->ds_etime % 1000 / 10,
+            ds->ds_utime / 1000, ds->ds_utime % 1000 / 10,
+            ds->ds_info, (ds->ds_mp->mp_datasz + 512) >> 10);
+    if (ds->ds_img)
+      fprintf(f, " image=%luK", (ds->ds_imgsz + 512) >> 10);
+    fprintf(f, "\n");
+  }
+}
+
+#ifndef NO_STATS
+
+static int hitsame(const struct hitent *a, const struct hitent *b) {
+  return a->he_type == b->he_type && a->he_len == b->he_len &&
+         memcmp(a->he_key, b->he_key, a->he_len) == 0;
+}
+
+static int hitcmp(const void *a, const void *b) {
+  const struct hitent *x = (const struct hitent *)a;
+  const struct hitent *y = (const struct hitent *)b;
+  return x->he_cnt < y->he_cnt ? 1 : x->he_cnt > y->he_cnt ? -1 : 0;
+}
+
+static const char *hitkey(const struct hitent *e, char *buf) {
+  unsigned char dn[DNS_MAXDN];
+  switch(e->he_type) {
+  case HIT_IP4:
+    return ip4atos(unpack32(e->he_key));
+  case HIT_IP6:
+    return ip6atos(e->he_key, IP6ADDR_FULL);
+  }
+  if (!e->he_len)
+    return "@";
+  memcpy(dn, e->he_key, e->he_len);
+  dn[e->he_len] = '\0';
+  dns_dntop(dn, buf, DNS_MAXDOMAIN+1);
+  return buf;
+}
+
+/* One line per dataset with its number of hits, followed by the keys
+ * matched most often, indented, with estimated number of hits and
+ * maximum overestimation.  Sketches of workers are merged by key, so
+ * a key may be missing if it was not in the top of every worker */
+void listhits(FILE *f, struct dshits *const *wh, int nw) {
+  const struct dataset *ds;
+  const struct hitent *e;
+  struct hitent *top;
+  char name[DNS_MAXDOMAIN+1];
+  dnscnt_t hits;
+  unsigned n, i, j;
+  int w;
+
+  top = (struct hitent *)malloc(nw * HIT_TOPN * sizeof(*top));
+  if (!top)
+    return;
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    hits = 0;
+    n = 0;
+    for (w = 0; w < nw; ++w) {
+      hits += wh[w][ds->ds_sidx].h_hits;
+      for (e = wh[w][ds->ds_sidx].h_top;
+           e < wh[w][ds->ds_sidx].h_top + HIT_TOPN; ++e) {
+        if (!e->he_type)
+          continue;
+        for (j = 0; j < n && !hitsame(&top[j], e); ++j)
+          ;
+        if (j < n) {
+          top[j].he_cnt += e->he_cnt;
+          top[j].he_err += e->he_err;
+        }
+        else
+          top[n++] = *e;
+      }
+    }
+    qsort(top, n, sizeof(*top), hitcmp);
+    fprintf(f, "%s:%s hits=%" PRI_DNSCNT "\n",
+            ds->ds_type->dst_name, ds->ds_spec, hits);
+    for (i = 0; i < n && i < HIT_TOPN; ++i)
+      fprintf(f, " %s hits=%" PRI_DNSCNT " err=%" PRI_DNSCNT "\n",
+              hitkey(&top[i], name),
+              top[i].he_cnt * HIT_SAMPLE, top[i].he_err * HIT_SAMPLE);
+  }
+  free(top);
+}
+
+#endif /* NO_STATS */
+
+/* write load profiles of all datasets into file (replacing it), one
+ * line per dataset: name and key=value pairs, times in usec and sizes
+ * in bytes.  Return 0 on errors */
+int writeprofile(const char *file) {
+  const struct dataset *ds;
+  const struct dsprof *dp;
+  char tmp[1024];
+  FILE *f;
+
+  ssprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  if (!(f = fopen(tmp, "w"))) {
+    dslog(LOG_WARNING, 0, "unable to create %s: %s", tmp, strerror(errno));
+    return 0;
+  }
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    dp = &ds->ds_prof;
+    fprintf(f, "%s:%s stamp=%lu etime=%lu utime=%lu lines=%lu read=%lu "
+            "parse=%lu sort=%lu dedup=%lu shrink=%lu entries=%lu trie=%lu "
+            "pool=%lu chunks=%u image=%lu\n",
+            ds->ds_type->dst_name, ds->ds_spec, (unsigned long)ds->ds_stamp,
+            ds->ds_etime * 1000, ds->ds_utime * 1000, dp->dp_lines,
+            dp->dp_read, dp->dp_parse,
+            dp->dp_sort, dp->dp_dedup, dp->dp_shrink,
+            dp->dp_earr, dp->dp_trie, dp->dp_pool, dp->dp_chunks,
+            ds->ds_img ? ds->ds_imgsz : 0);
+  }
+  if (fclose(f) != 0 || rename(tmp, file) != 0) {
+    dslog(LOG_WARNING, 0, "unable to write %s: %s", file, strerror(errno));
+    unlink(tmp);
+    return 0;
+  }
+  return 1;
+}
+
+/* start a sample of a dataset metric, up to the dataset label */
+static void dsmetric(FILE *f, const char *name, const struct dataset *ds) {
+  fprintf(f, "rbldnsd_dataset_%s{dataset=\"%s:", name, ds->ds_type->dst_name);
+  fputlabel(f, ds->ds_spec);
+  fprintf(f, "\"");
+}
+
+/* dataset gauges for the metrics listener (-H), ctllock held */
+void metricdatasets(FILE *f) {
+  const struct dataset *ds;
+  const struct dsprof *dp;
+
+  fprintf(f, "# HELP rbldnsd_dataset_timestamp_seconds "
+             "Timestamp of dataset data, 0 if not loaded.\n"
+             "# TYPE rbldnsd_dataset_timestamp_seconds gauge\n");
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    dsmetric(f, "timestamp_seconds", ds);
+    fprintf(f, "} %lu\n", (unsigned long)ds->ds_stamp);
+  }
+  fprintf(f, "# HELP rbldnsd_dataset_load_seconds "
+             "Wall clock time of the last dataset load.\n"
+             "# TYPE rbldnsd_dataset_load_seconds gauge\n");
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    dsmetric(f, "load_seconds", ds);
+    fprintf(f, "} %lu.%03lu\n", ds->ds_etime / 1000, ds->ds_etime % 1000);
+  }
+  fprintf(f, "# HELP rbldnsd_dataset_lines Lines read by the last load.\n"
+             "# TYPE rbldnsd_dataset_lines gauge\n");
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    dsmetric(f, "lines", ds);
+    fprintf(f, "} %lu\n", ds->ds_prof.dp_lines);
+  }
+  fprintf(f, "# HELP rbldnsd_dataset_memory_bytes "
+             "Memory taken by dataset data, pool includes trie.\n"
+             "# TYPE rbldnsd_dataset_memory_bytes gauge\n");
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    dp = &ds->ds_prof;
+    dsmetric(f, "memory_bytes", ds);
+    fprintf(f, ",kind=\"entries\"} %lu\n", dp->dp_earr);
+    dsmetric(f, "memory_bytes", ds);
+    fprintf(f, ",kind=\"trie\"} %lu\n", dp->dp_trie);
+    dsmetric(f, "memory_bytes", ds);
+    fprintf(f, ",kind=\"pool\"} %lu\n", dp->dp_pool);
+    dsmetric(f, "memory_bytes", ds);
+    fprintf(f, ",kind=\"image\"} %lu\n", ds->ds_img ? ds->ds_imgsz : 0);
+  }
+}
+
+#ifdef HAVE_INOTIFY
+
+/* Directories of all data files are watched, not files themselves,
+ * to see files replaced by rename(2) too.  An event for a name which
+ * is a data file marks its dataset dirty. */
+
+#define WATCH_MASK \
+  (IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_CREATE|IN_DELETE|IN_ATTRIB)
+
+struct dswatch {
+  int wd;		/* inotify watch descriptor */
+  char *dir;		/* the directory */
+};
+static struct dswatch *dswatches;
+static unsigned ndswatches;
+
+/* split file name into directory (into buf) and base name */
+static const char *dirbase(const char *name, char *buf, unsigned bufsz) {
+  const char *b = strrchr(name, '/');
+  if (!b) {
+    ssprintf(buf, bufsz, ".");
+    return name;
+  }
+  ssprintf(buf, bufsz, "%.*s", b == name ? 1 : (int)(b - name), name);
+  return b + 1;
+}
+
+static void watchfile(int fd, const char *name) {
+  char dir[1024];
+  unsigned i;
+  int wd;
+  dirbase(name, dir, sizeof(dir));
+  for (i = 0; i < ndswatches; ++i)
+    if (strcmp(dswatches[i].dir, dir) == 0)
+      return;
+  if ((wd = inotify_add_watch(fd, dir, WATCH_MASK)) < 0) {
+    dslog(LOG_WARNING, 0, "unable to watch directory %s: %s",
+          dir, strerror(errno));
+    return;
+  }
+  dswatches = trealloc(struct dswatch, dswatches, ndswatches + 1);
+  dswatches[ndswatches].wd = wd;
+  dswatches[ndswatches].dir = estrdup(dir);
+  ++ndswatches;
+}
+
+int watchdatasets(void) {
+  struct dataset *ds;
+  struct dsfile *dsf;
+  int fd = inotify_init1(IN_NONBLOCK);
+  if (fd < 0) {
+    dslog(LOG_WARNING, 0, "inotify: %s", strerror(errno));
+    return -1;
+  }
+  for (ds = ds_list; ds; ds = ds->ds_next) {
+    for (dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next)
+      watchfile(fd, dsf->dsf_name);
+    if (ds->ds_delta)
+      watchfile(fd, ds->ds_delta->dsf_name);
+  }
+  if (!ndswatches) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* check if name in dir is one of the files */
+static int dsfin(const struct dsfile *dsf, const char *dir, const char *name) {
+  char fdir[1024];
+  for (; dsf; dsf = dsf->dsf_next)
+    if (strcmp(dirbase(dsf->dsf_name, fdir, sizeof(fdir)), name) == 0 &&
+        strcmp(fdir, dir) == 0)
+      return 1;
+  return 0;
+}
+
+/* mark datasets with file name in dir dirty */
+static int markdirty(const char *dir, const char *name) {
+  struct dataset *ds;
+  int n = 0;
+  for (ds = ds_list; ds; ds = ds->ds_next)
+    if (!ds->ds_dirty &&
+        (dsfin(ds->ds_dsf, dir, name) || dsfin(ds->ds_delta, dir, name))) {
+      ds->ds_dirty = 1;
+      ++n;
+    }
+  return n;
+}
+
+int readwatches(int fd) {
+  union {
+    struct inotify_event ev;
+    char buf[4096];
+  } u;
+  const struct inotify_event *ev;
+  struct dataset *ds;
+  unsigned i;
+  int len, n = 0;
+
+  while((len = read(fd, u.buf, sizeof(u.buf))) > 0)
+    for (ev = &u.ev; (char*)ev < u.buf + len;
+         ev = (const struct inotify_event *)
+              ((const char *)(ev + 1) + ev->len)) {
+      if (ev->mask & IN_Q_OVERFLOW) {	/* events lost, check everything */
+        for (ds = ds_list; ds; ds = ds->ds_next)
+          ds->ds_dirty = 1;
+        ++n;
+        continue;
+      }
+      if (!ev->len)
+        continue;
+      for (i = 0; i < ndswatches; ++i)
+        if (dswatches[i].wd == ev->wd) {
+          n += markdirty(dswatches[i].dir, ev->name);
+          break;
+        }
+    }
+  return n;
+}
+
+#endif /* HAVE_INOTIFY */
+
 #ifndef NO_MASTER_DUMP
 void dumpzone(const struct zone *z, FILE *f) {
   const struct dslist *dsl;
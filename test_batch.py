@@ -0,0 +1,68 @@
+""" Tests for answering queries in batches (-B)
+"""
+import socket
+import struct
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, ZoneFile, has_option
+
+__all__ = [
+    'TestBatch',
+    ]
+
+def query_packet(qid, name, qtype=16):
+    q = struct.pack('>HHHHHH', qid, 0, 1, 0, 0, 0)
+    for label in name.split('.'):
+        q += struct.pack('B', len(label)) + label.encode('ascii')
+    return q + struct.pack('>BHH', 0, qtype, 1)
+
+def rcode(reply):
+    return struct.unpack('>H', reply[2:4])[0] & 15
+
+def daemon(*options):
+    dnsd = Rbldnsd(options=options)
+    dnsd.add_dataset('ip4set', ZoneFile(["1.2.3.4 :1: Success"]))
+    return dnsd
+
+class BurstTestCase(unittest.TestCase):
+    """ Queries sent one by one and all at once """
+
+    def check_answers(self, dnsd):
+        for i in range(8):
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Success')
+            self.assertEqual(dnsd.query('%d.3.2.1.example.com' % (i + 5)),
+                             None)
+
+    def check_burst(self, dnsd, count=64):
+        # send all queries before reading any reply, so that they queue up
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.settimeout(5)
+        s.connect(('127.0.0.1', dnsd.daemon_port))
+        try:
+            for i in range(count):
+                s.send(query_packet(i, '%d.3.2.1.example.com' % (i % 8)))
+            replies = {}
+            for i in range(count):
+                reply = s.recv(512)
+                replies[struct.unpack('>H', reply[:2])[0]] = rcode(reply)
+        finally:
+            s.close()
+        self.assertEqual(sorted(replies), list(range(count)))
+        for qid, rc in replies.items():
+            self.assertEqual(rc, 0 if qid % 8 == 4 else 3)
+
+class TestBatch(BurstTestCase):
+    def test_single(self):
+        with daemon() as dnsd:
+            self.check_answers(dnsd)
+            self.check_burst(dnsd)
+
+    @skipIf(not has_option('-B'), "no recvmmsg support")
+    def test_batch(self):
+        with daemon('-B', '16') as dnsd:
+            self.check_answers(dnsd)
+            self.check_burst(dnsd)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,99 @@
+""" Tests for the answer cache (-R)
+"""
+import os
+import shutil
+import socket
+import struct
+import tempfile
+import time
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, control, has_option
+from test_batch import query_packet
+from test_control import write_file
+
+__all__ = [
+    'TestCache',
+    ]
+
+def cache_stats(reply):
+    """ Counters of the cache line of the stats command reply """
+    for line in reply.splitlines():
+        if line.startswith('cache '):
+            return dict((k, int(v)) for k, v in
+                        (field.split('=') for field in line.split()[1:]))
+
+@skipIf(not has_option('-R') or not has_option('-S'),
+        "no answer cache or control socket support")
+class TestCache(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.socket = os.path.join(self.tmpdir, 'ctl')
+        self.data = os.path.join(self.tmpdir, 'data')
+        self.mtime = int(time.time()) - 100
+        write_file(self.data, ["1.2.3.4 :1: Old"], self.mtime)
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def daemon(self, *options):
+        dnsd = Rbldnsd(options=['-S', self.socket, '-R', '64'] +
+                       list(options))
+        dnsd.add_dataset('ip4set', self.data)
+        return dnsd
+
+    def test_hits(self):
+        with self.daemon() as dnsd:
+            before = cache_stats(control(self.socket, 'stats'))
+            for i in range(4):
+                self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Old')
+                self.assertEqual(dnsd.query('5.3.2.1.example.com'), None)
+            after = cache_stats(control(self.socket, 'stats'))
+        self.assertEqual(after['hits'] - before['hits'], 6)
+        self.assertEqual(after['misses'] - before['misses'], 2)
+
+    def test_query_id_and_case(self):
+        # a cached answer gets ID and question of the query
+        with self.daemon() as dnsd:
+            s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            s.settimeout(5)
+            s.connect(('127.0.0.1', dnsd.daemon_port))
+            try:
+                replies = []
+                for qid, name in ((1, '4.3.2.1.example.com'),
+                                  (2, '4.3.2.1.EXAMPLE.com'),
+                                  (3, '4.3.2.1.example.COM')):
+                    q = query_packet(qid, name)
+                    s.send(q)
+                    reply = s.recv(512)
+                    self.assertEqual(struct.unpack('>H', reply[:2])[0], qid)
+                    self.assertEqual(reply[12:len(q)], q[12:])
+                    replies.append(reply[len(q):])
+            finally:
+                s.close()
+            self.assertEqual(replies[1], replies[0])
+            self.assertEqual(replies[2], replies[0])
+
+    def check_reload(self, *options):
+        # the cache is flushed on reload
+        with self.daemon(*options) as dnsd:
+            for i in range(2):
+                self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Old')
+                self.assertEqual(dnsd.query('5.3.2.1.example.com'), None)
+            write_file(self.data, ["1.2.3.4 :1: New", "1.2.3.5 :1: Five"],
+                       self.mtime + 1)
+            self.assertEqual(control(self.socket, 'reload'), 'ok\n')
+            for i in range(2):
+                self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'New')
+                self.assertEqual(dnsd.query('5.3.2.1.example.com'), 'Five')
+
+    def test_reload(self):
+        self.check_reload()
+
+    @skipIf(not has_option('-T'), "no threads support")
+    def test_reload_threads(self):
+        self.check_reload('-T', '2')
+
+if __name__ == '__main__':
+    unittest.main()
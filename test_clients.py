@@ -0,0 +1,83 @@
+""" Tests for the client networks file (-G) and the clients command (-S)
+"""
+import os
+import shutil
+import tempfile
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, ZoneFile, control, has_option
+
+__all__ = [
+    'TestClientsFile',
+    ]
+
+def parse_clients(lines):
+    """ Parse client networks into (queries, [(network, queries)]) """
+    queries = int(lines[0].split('=', 1)[1])
+    networks = []
+    for line in lines[1:]:
+        network, count = line.split()
+        networks.append((network, int(count.split('=', 1)[1])))
+    return queries, networks
+
+def read_clients(path):
+    """ Parse the clients file, which starts with a comment line """
+    with open(path) as f:
+        lines = f.read().splitlines()
+    assert lines[0].startswith('# ')
+    return parse_clients(lines[1:])
+
+class TestClientsFile(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def count_clients(self, *options):
+        path = os.path.join(self.tmpdir, 'clients')
+        dnsd = Rbldnsd(options=['-G', path] + list(options))
+        dnsd.add_dataset('ip4set', ZoneFile(["1.2.3.4 :1: Success"]))
+        with dnsd:
+            for i in range(20):
+                dnsd.query('%d.3.2.1.example.com' % i)
+        # the file is written on exit
+        queries, networks = read_clients(path)
+        # and there may be a few more queries made while starting up
+        self.assertTrue(queries >= 20)
+        self.assertEqual(networks, [('127.0.0.0/24', queries)])
+
+    def test_clients(self):
+        self.count_clients()
+
+    @skipIf(not has_option('-T'), "no threads support")
+    def test_threads(self):
+        # sketches of all threads are added up
+        self.count_clients('-T', '3')
+
+    @skipIf(not has_option('-S'), "no control socket support")
+    def test_command(self):
+        socket = os.path.join(self.tmpdir, 'ctl')
+        dnsd = Rbldnsd(options=['-S', socket, '-G',
+                                os.path.join(self.tmpdir, 'clients')])
+        dnsd.add_dataset('ip4set', ZoneFile(["1.2.3.4 :1: Success"]))
+        with dnsd:
+            for i in range(5):
+                dnsd.query('%d.3.2.1.example.com' % i)
+            queries, networks = parse_clients(
+                control(socket, 'clients').splitlines())
+        self.assertTrue(queries >= 5)
+        self.assertEqual(networks, [('127.0.0.0/24', queries)])
+
+    @skipIf(not has_option('-S'), "no control socket support")
+    def test_command_disabled(self):
+        # client networks are only counted with -G
+        socket = os.path.join(self.tmpdir, 'ctl')
+        dnsd = Rbldnsd(options=['-S', socket])
+        dnsd.add_dataset('ip4set', ZoneFile(["1.2.3.4 :1: Success"]))
+        with dnsd:
+            self.assertTrue(control(socket, 'clients').startswith('error: '))
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,129 @@
+""" Tests for the control socket (-S)
+"""
+import os
+import shutil
+import tempfile
+import time
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, DUMMY_ZONE_HEADER, control, has_option
+
+__all__ = [
+    'TestControl',
+    'TestReload',
+    ]
+
+# -S is only there when rbldnsd is compiled with threads support
+no_control = not has_option('-S')
+
+def write_file(path, lines, mtime, header=True):
+    """ Write a data file with the given modification time, which
+    should differ from the previous one for the change to be noticed """
+    with open(path, 'w') as f:
+        if header:
+            f.write(DUMMY_ZONE_HEADER)
+        f.writelines("%s\n" % line for line in lines)
+    os.utime(path, (mtime, mtime))
+
+@skipIf(no_control, "no control socket support")
+class TestControl(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.socket = os.path.join(self.tmpdir, 'ctl')
+        self.data = os.path.join(self.tmpdir, 'data')
+        write_file(self.data, ["1.2.3.4 :1: Success"], time.time())
+        self.dnsd = Rbldnsd(options=['-S', self.socket])
+        self.dnsd.add_dataset('ip4set', self.data)
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def control(self, command):
+        return control(self.socket, command)
+
+    def test_stats(self):
+        with self.dnsd as dnsd:
+            dnsd.query('4.3.2.1.example.com')
+            dnsd.query('5.3.2.1.example.com')
+            lines = self.control('stats').splitlines()
+        zone = [l for l in lines if l.startswith('zone example.com ')]
+        self.assertEqual(len(zone), 1)
+        self.assertTrue(' ok=1 nxd=1 ' in zone[0])
+        self.assertTrue([l for l in lines if l.startswith('total secs=')])
+
+    def test_zones(self):
+        with self.dnsd:
+            lines = self.control('zones').splitlines()
+        self.assertEqual(len(lines), 1)
+        fields = lines[0].split()
+        self.assertEqual(fields[0], 'example.com')
+        self.assertEqual(fields[-1], 'ip4set:' + self.data)
+
+    def test_datasets(self):
+        with self.dnsd:
+            lines = self.control('datasets').splitlines()
+        self.assertEqual(len(lines), 1)
+        self.assertTrue(lines[0].startswith('ip4set:%s ' % self.data))
+        self.assertTrue(' pool=' in lines[0])
+        self.assertFalse(' image=' in lines[0])
+
+    def test_dump(self):
+        with self.dnsd:
+            reply = self.control('dump example.com')
+            self.assertTrue('\n4.3.2.1\t' in reply)
+            self.assertTrue(self.control('dump example.net').
+                            startswith('error: unknown zone'))
+
+    def test_reload(self):
+        with self.dnsd as dnsd:
+            self.assertEqual(self.control('reload'), 'ok\n')
+            self.assertEqual(self.control('reload ip4set:' + self.data),
+                             'ok\n')
+            self.assertTrue(self.control('reload ip4set:nonexistent').
+                            startswith('error: unknown dataset'))
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Success')
+
+    def test_unknown(self):
+        with self.dnsd:
+            self.assertTrue(self.control('frobnicate').
+                            startswith('error: unknown command'))
+
+@skipIf(no_control, "no control socket support")
+class TestReload(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.socket = os.path.join(self.tmpdir, 'ctl')
+        self.data = os.path.join(self.tmpdir, 'data')
+        self.mtime = int(time.time()) - 100
+        write_file(self.data, ["1.2.3.4 :1: Old"], self.mtime)
+        # no periodic checks and no inotify, reload on command only
+        self.dnsd = Rbldnsd(options=['-S', self.socket, '-c', '0'])
+        self.dnsd.add_dataset('ip4set', self.data)
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def test_changed(self):
+        # the reply is sent when the reload is finished
+        with self.dnsd as dnsd:
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Old')
+            write_file(self.data, ["1.2.3.4 :1: New",
+                                   "1.2.3.5 :1: Five"], self.mtime + 1)
+            self.assertEqual(control(self.socket, 'reload'), 'ok\n')
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'New')
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), 'Five')
+
+    def test_dataset(self):
+        # a dataset given by name is reloaded even if its files look the
+        # same, which a plain reload does not notice
+        with self.dnsd as dnsd:
+            write_file(self.data, ["1.2.3.4 :1: New"], self.mtime)
+            self.assertEqual(control(self.socket, 'reload'), 'ok\n')
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Old')
+            self.assertEqual(control(self.socket, 'reload ip4set:' +
+                                     self.data), 'ok\n')
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'New')
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,127 @@
+""" Tests for ip4set delta files
+"""
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, control, has_option
+from test_control import write_file
+
+__all__ = [
+    'TestDelta',
+    ]
+
+@skipIf(not has_option('-S'), "no control socket support")
+class TestDelta(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.socket = os.path.join(self.tmpdir, 'ctl')
+        self.base = os.path.join(self.tmpdir, 'base')
+        self.delta = os.path.join(self.tmpdir, 'delta')
+        self.mtime = int(time.time()) - 100
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def write(self, path, lines, header=True):
+        self.mtime += 1
+        write_file(path, lines, self.mtime, header)
+
+    def write_delta(self, lines):
+        self.write(self.delta, lines, header=False)
+        self.assertEqual(control(self.socket, 'reload'), 'ok\n')
+
+    def check_delta(self, *options):
+        self.write(self.base, ["1.2.3.4 :1: Base", "1.2.3.5 :1: Five",
+                               "1.2.4.0/24 :1: Range"])
+        dnsd = Rbldnsd(options=['-S', self.socket] + list(options))
+        dnsd.add_dataset('ip4set', '%s,+%s' % (self.base, self.delta))
+        with dnsd:
+            for i in range(2):
+                self.assertEqual(dnsd.query('5.3.2.1.example.com'), 'Five')
+                self.assertEqual(dnsd.query('6.3.2.1.example.com'), None)
+
+            # entries are removed, then added
+            self.write_delta(["$SEQ 1", "+1.2.3.6 :1: Six",
+                              "-1.2.3.5", "-1.2.3.4",
+                              "+1.2.3.4 :1: Replaced",
+                              "+1.2.4.7 :1: Host", "-1.2.4.0/24",
+                              "+10.0.0.0/8 :1: Ten"])
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Replaced')
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), None)
+            self.assertEqual(dnsd.query('6.3.2.1.example.com'), 'Six')
+            self.assertEqual(dnsd.query('7.4.2.1.example.com'), 'Host')
+            self.assertEqual(dnsd.query('8.4.2.1.example.com'), None)
+            self.assertEqual(dnsd.query('1.2.3.10.example.com'), 'Ten')
+            self.assertTrue(' seq=1 ' in control(self.socket, 'datasets'))
+
+            # a delta which was applied already is ignored
+            self.write_delta(["$SEQ 1", "+1.2.3.7 :1: Seven"])
+            self.assertEqual(dnsd.query('7.3.2.1.example.com'), None)
+
+            # changes of earlier deltas stay
+            self.write_delta(["$SEQ 2", "+1.2.3.7 :1: Seven",
+                              "-10.0.0.0/8"])
+            self.assertEqual(dnsd.query('7.3.2.1.example.com'), 'Seven')
+            self.assertEqual(dnsd.query('6.3.2.1.example.com'), 'Six')
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), None)
+            self.assertEqual(dnsd.query('1.2.3.10.example.com'), None)
+
+            # the current delta is applied on top of the reloaded base
+            self.write(self.base, ["1.2.3.8 :1: Eight"])
+            self.assertEqual(control(self.socket, 'reload'), 'ok\n')
+            self.assertEqual(dnsd.query('8.3.2.1.example.com'), 'Eight')
+            self.assertEqual(dnsd.query('7.3.2.1.example.com'), 'Seven')
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), None)
+            self.assertEqual(dnsd.query('6.3.2.1.example.com'), None)
+
+    def test_delta(self):
+        self.check_delta()
+
+    @skipIf(not has_option('-R'), "no answer cache support")
+    def test_cached(self):
+        # the answer cache is flushed when a delta is applied
+        self.check_delta('-R', '64')
+
+    def test_image(self):
+        # deltas leave data mapped from an image as is
+        imgdir = os.path.join(self.tmpdir, 'img')
+        os.mkdir(imgdir)
+        spec = '%s,+%s' % (self.base, self.delta)
+        self.write(self.base, ["1.2.3.4 :1: Base", "1.2.3.5 :1: Five"])
+        self.write(self.delta, [], header=False)
+        cmd = ['./rbldnsd', '-n', '-I', imgdir, 'example.com:ip4set:' + spec]
+        self.assertEqual(subprocess.call(cmd), 0)
+        dnsd = Rbldnsd(options=['-S', self.socket, '-i', imgdir])
+        dnsd.add_dataset('ip4set', spec)
+        with dnsd:
+            self.assertTrue(' (image)' in control(self.socket, 'datasets'))
+            self.write_delta(["+1.2.3.6 :1: Six", "-1.2.3.5",
+                              "-1.2.3.4", "+1.2.3.4 :1: Four"])
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Four')
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), None)
+            self.assertEqual(dnsd.query('6.3.2.1.example.com'), 'Six')
+            info = control(self.socket, 'datasets')
+            self.assertTrue(' (image) delta=' in info)
+            dump = control(self.socket, 'dump example.com')
+            self.assertTrue('\n6.3.2.1\t' in dump)
+            self.assertFalse('\n5.3.2.1\t' in dump)
+
+            # a delta may put an address back
+            self.write_delta(["-1.2.3.5", "+1.2.3.5 :1: Again"])
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), 'Again')
+
+            # and changes are folded into reloaded data
+            self.write(self.base, ["1.2.3.4 :1: Base", "1.2.3.5 :1: Five"])
+            self.assertEqual(control(self.socket, 'reload'), 'ok\n')
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), 'Again')
+            self.assertEqual(dnsd.query('6.3.2.1.example.com'), None)
+            info = control(self.socket, 'datasets')
+            self.assertFalse(' (image)' in info or ' delta=' in info)
+
+if __name__ == '__main__':
+    unittest.main()
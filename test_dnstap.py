@@ -0,0 +1,78 @@
+""" Tests for dnstap output (-D), read back with contrib/fstrmread.py
+"""
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, ZoneFile, has_option
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                'contrib'))
+import fstrmread
+
+__all__ = [
+    'TestDnstap',
+    ]
+
+# -D is only there when rbldnsd is compiled with threads support
+no_dnstap = not has_option('-D')
+
+def daemon(dest):
+    dnsd = Rbldnsd(options=['-D', dest])
+    dnsd.add_dataset('ip4set', ZoneFile(["1.2.3.4 :1: Success"]))
+    return dnsd
+
+class TestDnstap(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def find(self, frames, qname):
+        records = [fstrmread.decode(frame) for frame in frames]
+        found = [r for r in records if r.get('qname') == qname]
+        self.assertEqual(len(found), 1)
+        return found[0]
+
+    @skipIf(no_dnstap, "no dnstap support")
+    def test_file(self):
+        path = os.path.join(self.tmpdir, 'dnstap')
+        with daemon('+' + path) as dnsd:
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Success')
+        with open(path, 'rb') as f:
+            r = self.find(fstrmread.read_frames(f), '4.3.2.1.example.com')
+        self.assertEqual(r['type'], 1)                  # MESSAGE
+        self.assertEqual(r['message_type'], 2)          # AUTH_RESPONSE
+        self.assertEqual(r['query_address'], '127.0.0.1')
+        self.assertEqual(r['protocol'], 1)              # UDP
+        self.assertEqual(r['qtype'], 16)                # TXT
+        self.assertTrue(r['response'] is not None)
+        self.assertEqual(fstrmread.dns_question(r['response']),
+                         ('4.3.2.1.example.com', 16))
+
+    @skipIf(no_dnstap, "no dnstap support")
+    def test_socket(self):
+        path = os.path.join(self.tmpdir, 'sock')
+        listening = threading.Event()
+        frames = []
+        def reader():
+            frames.extend(fstrmread.serve(path, listening.set))
+        t = threading.Thread(target=reader)
+        t.daemon = True
+        t.start()
+        listening.wait(5)
+        with daemon('unix:' + path) as dnsd:
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), None)
+        t.join(5)
+        self.assertFalse(t.is_alive())
+        r = self.find(frames, '5.3.2.1.example.com')
+        self.assertEqual(r['query_address'], '127.0.0.1')
+        self.assertTrue(r['response'] is None)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,82 @@
+""" Tests for the dataset hits file (-W) and the hits command (-S)
+"""
+import os
+import shutil
+import tempfile
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, ZoneFile, control, has_option
+
+__all__ = [
+    'TestHitsFile',
+    ]
+
+HIT_SAMPLE = 16
+
+def parse_hits(lines):
+    """ Parse hits into a list of (dataset, hits, {key: hits}) """
+    hits = []
+    for line in lines:
+        fields = line.split()
+        count = int(fields[1].split('=', 1)[1])
+        if line.startswith(' '):
+            hits[-1][2][fields[0]] = count
+        else:
+            hits.append((fields[0], count, {}))
+    return hits
+
+def read_hits(path):
+    """ Parse the hits file, which starts with a comment line """
+    with open(path) as f:
+        assert f.readline().startswith('# ')
+        return parse_hits(f)
+
+class TestHitsFile(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def count_hits(self, options=()):
+        path = os.path.join(self.tmpdir, 'hits')
+        listed = ZoneFile(["1.2.3.4 :1: Listed"])
+        other = ZoneFile(["5.6.7.8 :1: Other"])
+        dnsd = Rbldnsd(options=['-W', path] + list(options))
+        dnsd.add_dataset('ip4set', listed)
+        dnsd.add_dataset('ip4set', other)
+        with dnsd:
+            for i in range(3 * HIT_SAMPLE):
+                self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Listed')
+                self.assertEqual(dnsd.query('1.1.1.1.example.com'), None)
+        # the file is written on exit
+        hits = read_hits(path)
+        self.assertEqual([(name, count) for name, count, top in hits],
+                         [('ip4set:' + listed.name, 3 * HIT_SAMPLE),
+                          ('ip4set:' + other.name, 0)])
+        self.assertEqual(hits[0][2], {'1.2.3.4': 3 * HIT_SAMPLE})
+        self.assertEqual(hits[1][2], {})
+
+    def test_hits(self):
+        self.count_hits()
+
+    def test_cached_hits(self):
+        # answers from the cache are counted, and sampled, all the same
+        self.count_hits(['-R', '64'])
+
+    @skipIf(not has_option('-S'), "no control socket support")
+    def test_command(self):
+        socket = os.path.join(self.tmpdir, 'ctl')
+        listed = ZoneFile(["1.2.3.4 :1: Listed"])
+        dnsd = Rbldnsd(options=['-S', socket])
+        dnsd.add_dataset('ip4set', listed)
+        with dnsd:
+            for i in range(HIT_SAMPLE):
+                self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Listed')
+            hits = parse_hits(control(socket, 'hits').splitlines())
+        self.assertEqual(hits, [('ip4set:' + listed.name, HIT_SAMPLE,
+                                 {'1.2.3.4': HIT_SAMPLE})])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,85 @@
+""" Tests for dataset images: written with -I, mapped with -i
+"""
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+import unittest
+
+from rbldnsd import Rbldnsd, DUMMY_ZONE_HEADER
+from test_profile import read_profile
+
+__all__ = [
+    'TestImage',
+    ]
+
+def write_file(path, lines, mtime):
+    with open(path, 'w') as f:
+        f.write(DUMMY_ZONE_HEADER)
+        f.writelines("%s\n" % line for line in lines)
+    os.utime(path, (mtime, mtime))
+
+class TestImage(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.imgdir = os.path.join(self.tmpdir, 'img')
+        os.mkdir(self.imgdir)
+        self.data = os.path.join(self.tmpdir, 'data')
+        self.profile = os.path.join(self.tmpdir, 'profile')
+        self.mtime = int(time.time()) - 100
+        write_file(self.data, ["1.2.3.4 :1: Listed",
+                               "10.0.0.0/8 :2: Range"], self.mtime)
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def make_image(self):
+        cmd = ['./rbldnsd', '-n', '-I', self.imgdir,
+               'example.com:ip4set:' + self.data,
+               'example.com:ip4trie:' + self.data]
+        self.assertEqual(subprocess.call(cmd), 0)
+        # only ip4set datasets are saved, named after type and spec
+        image = 'ip4set:%s.img' % self.data.replace('/', '_')
+        self.assertEqual(os.listdir(self.imgdir), [image])
+        return os.path.join(self.imgdir, image)
+
+    def daemon(self, stderr=None):
+        dnsd = Rbldnsd(options=['-i', self.imgdir, '-Y', self.profile],
+                       stderr=stderr)
+        dnsd.add_dataset('ip4set', self.data)
+        return dnsd
+
+    def image_size(self):
+        return dict(read_profile(self.profile)[0][1])['image']
+
+    def test_roundtrip(self):
+        self.make_image()
+        with self.daemon() as dnsd:
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Listed')
+            self.assertEqual(dnsd.query('4.3.2.10.example.com'), 'Range')
+            self.assertEqual(dnsd.query('4.3.2.11.example.com'), None)
+            self.assertTrue(self.image_size() > 0)
+
+    def test_outdated(self):
+        # the data file changed since the image was made
+        self.make_image()
+        write_file(self.data, ["1.2.3.5 :1: New"], self.mtime + 1)
+        with self.daemon() as dnsd:
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), None)
+            self.assertEqual(dnsd.query('5.3.2.1.example.com'), 'New')
+            self.assertEqual(self.image_size(), 0)
+
+    def test_damaged(self):
+        image = self.make_image()
+        with open(image, 'r+b') as f:
+            f.seek(os.path.getsize(image) // 2)
+            f.write(b'\xff' * 16)
+        # it is ignored with a warning
+        with open(os.devnull, 'w') as devnull:
+            with self.daemon(devnull) as dnsd:
+                self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Listed')
+                self.assertEqual(self.image_size(), 0)
+
+if __name__ == '__main__':
+    unittest.main()
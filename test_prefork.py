@@ -0,0 +1,60 @@
+""" Tests for answering queries in pre-forked worker processes (-P)
+"""
+import os
+import shutil
+import signal
+import tempfile
+import time
+import unittest
+from unittest import skipIf
+
+from rbldnsd import Rbldnsd, DUMMY_ZONE_HEADER, has_option
+from test_batch import BurstTestCase, daemon
+
+__all__ = [
+    'TestPrefork',
+    ]
+
+def write_data(path, txt, mtime):
+    with open(path, 'w') as f:
+        f.write(DUMMY_ZONE_HEADER)
+        f.write("1.2.3.4 :1: %s\n" % txt)
+    os.utime(path, (mtime, mtime))
+
+@skipIf(not has_option('-P'), "no pre-forked workers support")
+class TestPrefork(BurstTestCase):
+    def test_procs(self):
+        with daemon('-P', '2') as dnsd:
+            self.check_answers(dnsd)
+            self.check_burst(dnsd)
+
+    @skipIf(not has_option('-B'), "no recvmmsg support")
+    def test_procs_batch(self):
+        with daemon('-P', '2', '-B', '16') as dnsd:
+            self.check_burst(dnsd)
+
+    def test_reload(self):
+        # workers are replaced by ones answering from the new data
+        tmpdir = tempfile.mkdtemp()
+        try:
+            data = os.path.join(tmpdir, 'data')
+            mtime = int(time.time()) - 100
+            write_data(data, "Old", mtime)
+            dnsd = Rbldnsd(options=['-P', '2'])
+            dnsd.add_dataset('ip4set', data)
+            with dnsd:
+                self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Old')
+                write_data(data, "New", mtime + 1)
+                dnsd.signal(signal.SIGHUP)
+                for retry in range(50):
+                    answers = set(dnsd.query('4.3.2.1.example.com')
+                                  for i in range(8))
+                    if answers == set(['New']):
+                        break
+                    time.sleep(0.1)
+                self.assertEqual(answers, set(['New']))
+        finally:
+            shutil.rmtree(tmpdir)
+
+if __name__ == '__main__':
+    unittest.main()
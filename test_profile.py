@@ -0,0 +1,71 @@
+""" Tests for the dataset load profile file (-Y)
+"""
+import os
+import shutil
+import struct
+import tempfile
+import unittest
+
+from rbldnsd import Rbldnsd, ZoneFile
+
+__all__ = [
+    'TestProfileFile',
+    ]
+
+PROFILE_KEYS = ['stamp', 'etime', 'utime', 'lines', 'read', 'parse', 'sort',
+                'dedup', 'shrink', 'entries', 'trie', 'pool', 'chunks',
+                'image']
+
+def read_profile(path):
+    """ Parse the profile file into a list of (dataset, [(key, value)]) """
+    profile = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            pairs = [field.split('=', 1) for field in fields[1:]]
+            profile.append((fields[0], [(k, int(v)) for k, v in pairs]))
+    return profile
+
+class TestProfileFile(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.tmpdir)
+
+    def test_format(self):
+        path = os.path.join(self.tmpdir, 'profile')
+        ip4set = ZoneFile(["1.2.3.4 :1: a",
+                           "1.2.3.0/24 :2: b",
+                           "10.0.0.0/8"])
+        ip4trie = ZoneFile(["1.2.0.0/16 :1: c",
+                            "5.6.7.8 d"])
+        dnsd = Rbldnsd(options=['-Y', path])
+        dnsd.add_dataset('ip4set', ip4set)
+        dnsd.add_dataset('ip4trie', ip4trie, soa='example.net')
+        with dnsd:
+            profile = read_profile(path)
+
+        self.assertEqual([name for name, pairs in profile],
+                         ['ip4set:' + ip4set.name, 'ip4trie:' + ip4trie.name])
+        for name, pairs in profile:
+            self.assertEqual([k for k, v in pairs], PROFILE_KEYS)
+        s = dict(profile[0][1])
+        t = dict(profile[1][1])
+
+        for p, zone in ((s, ip4set), (t, ip4trie)):
+            self.assertEqual(p['stamp'], int(os.stat(zone.name).st_mtime))
+            self.assertTrue(p['pool'] > 0)
+            self.assertTrue(p['chunks'] >= 1)
+            self.assertEqual(p['image'], 0)
+        # the header (an empty line, $SOA and $NS) and the entries
+        self.assertEqual(s['lines'], 6)
+        self.assertEqual(t['lines'], 5)
+        # ip4set keeps (address, RR pointer) arrays, ip4trie a trie
+        self.assertEqual(s['entries'], 3 * struct.calcsize('IP'))
+        self.assertEqual(s['trie'], 0)
+        self.assertEqual(t['entries'], 0)
+        self.assertTrue(t['trie'] > 0)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,101 @@
+""" Tests for answering queries over TCP (-K)
+"""
+import socket
+import struct
+import unittest
+from unittest import skipIf
+
+import DNS
+from rbldnsd import Rbldnsd, ZoneFile, has_option
+from test_batch import daemon, query_packet, rcode
+
+__all__ = [
+    'TestTcp',
+    ]
+
+# five 200-byte TXT records do not fit in a 512-byte UDP reply
+LONG_TXT = ['%d' % i * 200 for i in range(1, 6)]
+
+def long_daemon(*options):
+    dnsd = Rbldnsd(options=options)
+    dnsd.add_dataset('ip4set', ZoneFile(["1.2.3.4 :1: Success"] +
+                                        ["1.2.3.5 :1: %s" % txt
+                                         for txt in LONG_TXT]))
+    return dnsd
+
+@skipIf(not has_option('-K'), "no TCP support")
+class TestTcp(unittest.TestCase):
+    def check_tcp(self, dnsd):
+        for i in range(4):
+            self.assertEqual(dnsd.query('4.3.2.1.example.com',
+                                        protocol='tcp'), 'Success')
+            self.assertEqual(dnsd.query('6.3.2.1.example.com',
+                                        protocol='tcp'), None)
+
+    def test_query(self):
+        with daemon('-K', '4') as dnsd:
+            self.check_tcp(dnsd)
+            # UDP is still answered
+            self.assertEqual(dnsd.query('4.3.2.1.example.com'), 'Success')
+
+    def test_pipelined(self):
+        # several queries over one connection without waiting for replies
+        with daemon('-K', '4') as dnsd:
+            s = socket.create_connection(('127.0.0.1', dnsd.daemon_port), 5)
+            try:
+                for i in range(8):
+                    q = query_packet(i, '%d.3.2.1.example.com' % (i % 2 + 4))
+                    s.sendall(struct.pack('>H', len(q)) + q)
+                buf = b''
+                replies = []
+                while len(replies) < 8:
+                    data = s.recv(4096)
+                    self.assertTrue(data)
+                    buf += data
+                    while len(buf) >= 2:
+                        l = struct.unpack('>H', buf[:2])[0]
+                        if len(buf) < 2 + l:
+                            break
+                        replies.append(buf[2:2+l])
+                        buf = buf[2+l:]
+            finally:
+                s.close()
+            self.assertEqual([struct.unpack('>H', r[:2])[0] for r in replies],
+                             list(range(8)))
+            self.assertEqual([rcode(r) for r in replies], [0, 3] * 4)
+
+    def test_truncated(self):
+        with long_daemon('-K', '4') as dnsd:
+            name = '5.3.2.1.example.com'
+            udp = DNS.Request(name=name, qtype='TXT', rd=0).req(
+                server=dnsd.daemon_addr, port=dnsd.daemon_port)
+            self.assertEqual(udp.header['tc'], 1)
+            tcp = DNS.Request(name=name, qtype='TXT', rd=0,
+                              protocol='tcp').req(
+                server=dnsd.daemon_addr, port=dnsd.daemon_port)
+            self.assertEqual(tcp.header['tc'], 0)
+            self.assertEqual(sorted(a['data'][0] for a in tcp.answers),
+                             LONG_TXT)
+
+    def test_not_truncated(self):
+        # without TCP, records which do not fit are omitted as before
+        with long_daemon() as dnsd:
+            udp = DNS.Request(name='5.3.2.1.example.com', qtype='TXT',
+                              rd=0).req(server=dnsd.daemon_addr,
+                                        port=dnsd.daemon_port)
+            self.assertEqual(udp.header['tc'], 0)
+            self.assertEqual(udp.header['aa'], 0)
+            self.assertTrue(0 < len(udp.answers) < len(LONG_TXT))
+
+    @skipIf(not has_option('-P'), "no pre-forked workers support")
+    def test_procs(self):
+        with daemon('-P', '2', '-K', '4') as dnsd:
+            self.check_tcp(dnsd)
+
+    @skipIf(not has_option('-T'), "no threads support")
+    def test_threads(self):
+        with daemon('-T', '2', '-K', '4') as dnsd:
+            self.check_tcp(dnsd)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,26 @@
+""" Tests for answering queries in several threads (-T)
+"""
+import unittest
+from unittest import skipIf
+
+from rbldnsd import has_option
+from test_batch import BurstTestCase, daemon
+
+__all__ = [
+    'TestThreads',
+    ]
+
+@skipIf(not has_option('-T'), "no threads support")
+class TestThreads(BurstTestCase):
+    def test_threads(self):
+        with daemon('-T', '3') as dnsd:
+            self.check_answers(dnsd)
+            self.check_burst(dnsd)
+
+    @skipIf(not has_option('-B'), "no recvmmsg support")
+    def test_threads_batch(self):
+        with daemon('-T', '3', '-B', '16') as dnsd:
+            self.check_burst(dnsd)
+
+if __name__ == '__main__':
+    unittest.main()
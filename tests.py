@@ -13,6 +13,18 @@ from test_btrie import *
 from test_ip6trie import *
 from test_ip4trie import *
 from test_acl import *
+from test_dnstap import *
+from test_profile import *
+from test_hits import *
+from test_batch import *
+from test_threads import *
+from test_prefork import *
+from test_tcp import *
+from test_image import *
+from test_control import *
+from test_cache import *
+from test_delta import *
+from test_clients import *
 
 if __name__ == '__main__':
     unittest.main()